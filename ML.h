@@ -8,9 +8,54 @@
 #include <stdbool.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #include <Windows.h>
+#include <malloc.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "Random.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ML_X86_SIMD
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+#if defined(_MSC_VER)
+#define ML_THREAD_LOCAL __declspec(thread)
+#define ML_ALIGNED(n) __declspec(align(n))
+#else
+#define ML_THREAD_LOCAL _Thread_local
+#define ML_ALIGNED(n) __attribute__((aligned(n)))
+#endif
+
+// sequentially consistent, the weight buffer's reader handshake depends on it
+#if defined(_MSC_VER)
+#define ml_atomic_load(p) InterlockedCompareExchange64((p), 0, 0)
+#define ml_atomic_store(p, v) InterlockedExchange64((p), (v))
+#define ml_atomic_add(p, v) InterlockedExchangeAdd64((p), (v))
+#define ml_atomic_cas(p, expected, desired) (InterlockedCompareExchange64((p), (desired), (expected)) == (expected))
+#else
+#define ml_atomic_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ml_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define ml_atomic_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define ml_atomic_cas(p, expected, desired) __sync_bool_compare_and_swap((p), (expected), (desired))
+#endif
+
+#if defined(_WIN32) || defined(_WIN64)
+#define ml_yield() SwitchToThread()
+#else
+#define ml_yield() sched_yield()
 #endif
 
 typedef enum ACTIVATION_TYPES
@@ -19,8 +64,44 @@ typedef enum ACTIVATION_TYPES
     RELU,
     LEAKYRELU,
     SOFTMAX,
+    LINEAR,
 } ActivationType;
 
+typedef enum EXP_MODES
+{
+    EXP_ACCURATE,
+    EXP_FAST,
+    EXP_LIBM,
+} ExpMode;
+
+typedef enum GEMM_KERNELS
+{
+    GEMM_NAIVE,
+    GEMM_GENERIC,
+    GEMM_SSE2,
+    GEMM_AVX2,
+} GemmKernel;
+
+typedef enum LAYER_KINDS
+{
+    DENSE,
+    CONV2D,
+} LayerKind;
+
+// how layer i maps layers[i] to layers[i + 1]. A CONV2D layer reads its input row as
+// height x width x channels (channels innermost), zero pads to keep the borders
+// ("same") and writes ceil(height / stride) x ceil(width / stride) x filters
+typedef struct LayerSpec
+{
+    LayerKind kind;
+    size_t height;
+    size_t width;
+    size_t channels;
+    size_t filters;
+    size_t kernel; // odd
+    size_t stride;
+} LayerSpec;
+
 typedef struct Activation
 {
     ActivationType type;
@@ -43,6 +124,73 @@ typedef struct Step
     float probability;
 } Step;
 
+// episode buffer in one allocation, states are kept as one byte code per input
+// and only expanded to floats through codeValues when they are fed to a network
+typedef struct Trajectory
+{
+    uint8_t *states; // capacity x stateLen codes, row i is step i
+    uint8_t *actions;
+    uint8_t *dones; // the game ended with this step
+    float *rewards; // as the game gave them, kept for logging and replay
+    float *returns; // what the policy gradient weighs each step by, see Returns_discounted
+    float *probabilities;
+    float *codeValues; // network input for every code, 256 entries
+    size_t stateLen;
+    size_t capacity;
+    size_t count;
+} Trajectory;
+
+// CSR rows of the nonzero inputs, row i owns entries rowStart[i]..rowStart[i + 1]
+typedef struct SparseRows
+{
+    size_t rows;
+    size_t cols;
+    size_t *rowStart;
+    uint32_t *indices;
+    float *values;
+    size_t capacity; // entries indices and values can hold
+} SparseRows;
+
+// no slot, next and prev of a transition that is not linked
+#define REPLAY_NONE ((size_t)-1)
+
+// fixed-capacity ring of transitions for off-policy learning, the oldest is overwritten first.
+// A transition stores its state as tile codes and finds its next state through next, the
+// link is dropped when either end is overwritten. Only done or linked transitions are sampled.
+// Not thread safe, the learner owns it
+typedef struct ReplayBuffer
+{
+    uint8_t *states; // capacity x stateLen codes
+    uint8_t *actions;
+    float *rewards;
+    uint8_t *dones;
+    size_t *next;
+    size_t *prev;
+    uint64_t *serials; // push that wrote the slot, counting from 1, 0 while it is empty
+    float *tree;       // sum tree over priority^alpha, leaf i is tree[leaves + i]
+    float *codeValues; // network input for every code, 256 entries
+    size_t leaves;
+    size_t stateLen;
+    size_t capacity;
+    size_t count;
+    size_t head; // slot the next push writes
+    uint64_t pushed;
+    float alpha; // 0 samples uniformly, 1 fully by priority
+    float maxPriority;
+} ReplayBuffer;
+
+// one sampled batch, states and nextStates may be views into network inputs
+typedef struct ReplayBatch
+{
+    Matrix states;
+    Matrix nextStates;
+    uint8_t *actions;
+    float *rewards;
+    uint8_t *dones;
+    size_t *indices; // slots for ReplayBuffer_update
+    float *weights;  // importance sampling weights, the largest is 1
+} ReplayBatch;
+
 typedef struct Network
 {
     Matrix *layers;
@@ -50,10 +198,238 @@ typedef struct Network
     Matrix *biases;
     Activation *activations;
     size_t count;
+    size_t batch; // rows of every layers[i], samples per forward pass
+    float *params; // arena behind every weights[i] and biases[i]
+    size_t paramCount;
+    float *state; // arena behind every layers[i]
+    size_t stateCount;
+    LayerSpec *specs; // NULL when every layer is dense
+    bool sharedParams; // params belong to another network (see Network_replica)
 } Network;
 
+// .netw v2: a 64 byte header, one NetwLayer per layer, then the params arena at a
+// 64 byte aligned dataOffset. Every field is in host byte order, endian tells readers which
+#define NETW_VERSION 2
+#define NETW_F32 1
+#define NETW_ENDIAN 0x01020304u
+
+typedef struct NetwHeader
+{
+    char magic[4]; // fileMagic
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t endian;
+    uint32_t layerCount;
+    uint32_t headerCrc; // header with this field 0, then the layer table
+    uint64_t tableOffset;
+    uint64_t dataOffset;
+    uint64_t dataSize; // bytes
+    uint32_t dataCrc;
+    uint32_t reserved[3];
+} NetwHeader;
+
+typedef struct NetwLayer
+{
+    uint32_t kind; // LayerKind
+    uint32_t activation; // ActivationType
+    uint32_t inputs;
+    uint32_t outputs;
+    uint32_t height; // conv shape, 0 for dense layers
+    uint32_t width;
+    uint32_t channels;
+    uint32_t filters;
+    uint32_t kernel;
+    uint32_t stride;
+    uint64_t weights; // file offsets of the matrices
+    uint64_t biases;
+    uint32_t reserved[2];
+} NetwLayer;
+
+// a network whose params are a read only file mapping
+typedef struct NetworkMap
+{
+    Network nn;
+    const void *base;
+    size_t size;
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} NetworkMap;
+
+#if defined(_WIN32) || defined(_WIN64)
+typedef HANDLE MlThread;
+typedef CRITICAL_SECTION MlMutex;
+typedef CONDITION_VARIABLE MlCond;
+#else
+typedef pthread_t MlThread;
+typedef pthread_mutex_t MlMutex;
+typedef pthread_cond_t MlCond;
+#endif
+
+// task runs once per index, worker is 0 for the thread that called ThreadPool_run
+// and 1..count for the pool threads
+typedef void (*PoolTask)(void *arg, size_t task, size_t worker);
+
+typedef struct ThreadPool
+{
+    size_t count; // threads besides the caller
+    MlThread *threads;
+    MlMutex lock;
+    MlCond wake;
+    MlCond done;
+    PoolTask task;
+    void *arg;
+    size_t next; // first unclaimed task
+    size_t total;
+    size_t finished;
+    size_t generation; // bumped by every ThreadPool_run
+    bool stop;
+} ThreadPool;
+
+// gradients are computed DATA_PARALLEL_LEAVES chunks at a time, each chunk into its
+// own leaf, and the leaves are summed in a fixed tree. The chunking only depends
+// on the sample count, so the result is the same for any thread count
+#define DATA_PARALLEL_LEAVES 64
+
+typedef struct DataParallel
+{
+    ThreadPool *pool;
+    Network *replicas; // one per worker, activations of their own and the params of nn
+    Network *grads; // one per worker, params are rebased onto the leaf being computed
+    float *leaves; // DATA_PARALLEL_LEAVES gradients of leafStride floats
+    size_t leafStride;
+    size_t chunk; // samples per leaf
+} DataParallel;
+
+// how many checkpoints a Checkpointer keeps at most
+#define CHECKPOINT_MAX_KEEP 64
+
+// writes snapshots of a network on its own thread, see Checkpointer_save
+typedef struct Checkpointer
+{
+    MlThread thread;
+    MlMutex lock;
+    MlCond wake;
+    MlCond idle;
+    Network pending; // views over the two snapshot buffers, swapped when the writer takes one
+    Network writing;
+    uint64_t pendingStep;
+    bool hasPending;
+    bool busy;
+    bool stop;
+    char prefix[FILENAME_MAX - 32]; // files are <prefix>.<step>.netw and <prefix>.index
+    size_t keep;
+    uint64_t steps[CHECKPOINT_MAX_KEEP + 1]; // written checkpoints, oldest first, one spare for the newest before rotation
+    size_t stepCount;
+} Checkpointer;
+
+#define ML_CACHE_LINE 64
+
+// bounded multi-producer multi-consumer queue of indices, every cell carries a
+// sequence number so producers and consumers only ever race on head or tail
+typedef struct RingCell
+{
+    volatile int64_t sequence;
+    size_t value;
+} RingCell;
+
+typedef struct RingQueue
+{
+    RingCell *cells;
+    size_t mask;
+    volatile int64_t head;
+    char headPad[ML_CACHE_LINE - sizeof(int64_t)]; // head and tail are written by different threads
+    volatile int64_t tail;
+    char tailPad[ML_CACHE_LINE - sizeof(int64_t)];
+} RingQueue;
+
+// a fixed set of trajectories passed between actors and a learner without locks:
+// actors acquire an empty one, fill it and submit it, the learner takes and recycles it
+typedef struct TrajectoryQueue
+{
+    RingQueue empty;
+    RingQueue filled;
+    Trajectory *slots;
+    size_t count;
+} TrajectoryQueue;
+
+// two param arenas, readers copy the published one while the learner fills the other.
+// A buffer is only overwritten once no reader holds it
+typedef struct WeightBuffer
+{
+    Network buffers[2];
+    volatile int64_t front;
+    volatile int64_t version;
+    volatile int64_t readers[2];
+} WeightBuffer;
+
+typedef enum OptimizerType
+{
+    OPTIMIZER_SGD,
+    OPTIMIZER_MOMENTUM,
+    OPTIMIZER_RMSPROP,
+    OPTIMIZER_ADAM,
+} OptimizerType;
+
+// update rule for the params of one network, the moments are flat arrays laid out
+// like the params arena so a step is a single pass over all of them
+typedef struct Optimizer
+{
+    OptimizerType type;
+    float rate;
+    float beta1;       // momentum, or Adam's first moment decay
+    float beta2;       // RMSProp and Adam second moment decay
+    float epsilon;
+    float weightDecay; // decoupled, params shrink by rate * weightDecay every step
+    float clipNorm;    // the gradient is scaled down to this L2 norm, 0 turns clipping off
+    uint64_t steps;
+    size_t count;
+    float *m;
+    float *v;
+} Optimizer;
+
+// score of the params in nn, higher is better. seed picks the episodes, both members
+// of an antithetic pair get the same one. Called from pool workers at the same time
+typedef float (*FitnessFn)(Network nn, void *arg, uint64_t seed);
+
+// params that share one noise stream, blocks can be regenerated independently
+#define EVOLUTION_BLOCK 4096
+
+// OpenAI-style evolution strategy around a center network. Every perturbation is rebuilt
+// from (seed, generation, pair), so evaluating one only needs the center and a few integers
+typedef struct Evolution
+{
+    ThreadPool *pool;
+    Network *replicas; // one per worker, holds the perturbed params being scored
+    Network gradient;  // estimate of the fitness gradient, negated so the optimizer descends
+    Optimizer opt;
+    float *fitness; // 2 * pairs, member 2p adds the noise of pair p and 2p + 1 subtracts it
+    float *shaped;  // centered ranks of fitness
+    float *mask;    // paramCount, 1 on every weight and bias, 0 on the arena padding
+    size_t pairs;
+    float sigma; // noise scale
+    uint64_t seed;
+    uint64_t generation;
+} Evolution;
+
+typedef struct GradCheck
+{
+    size_t checked; // params compared
+    size_t worst; // index into params of the largest relative error
+    float maxRelError; // |numeric - analytic| / max(|numeric| + |analytic|, GRAD_CHECK_FLOOR)
+    float maxAbsError;
+} GradCheck;
+
+// keeps gradients that are zero up to float noise from reporting huge relative errors
+#define GRAD_CHECK_FLOOR 1e-4f
+
 #define ARR_LEN(arr) (sizeof(arr) / sizeof(*(arr)))
 
+// arenas are 64-byte aligned and every matrix in them starts on a 64-byte boundary
+#define ML_ALIGNMENT 64
+#define ML_ALIGN_FLOATS(n) (((n) + (ML_ALIGNMENT / sizeof(float)) - 1) & ~((ML_ALIGNMENT / sizeof(float)) - 1))
+
 #define MAT_AT(M, i, j) ((M).es[(i) * (M).stride + (j)])
 
 #define PRINT_MAT(m) print_mat((m), #m, 0, "%f")
@@ -63,6 +439,10 @@ typedef struct Network
 
 #define SOFTMAX_OUTPUTS(nn) (softmaxf(NETWORK_OUT(nn)))
 
+#define LAYER_IS_CONV(nn, i) ((nn).specs && (nn).specs[i].kind == CONV2D)
+// images this many floats of im2col patches are built and multiplied at a time
+#define CONV_CHUNK_FLOATS (64 * 1024)
+
 float rand_float();
 float sigmoidf(float x);
 float reluf(float x);
@@ -70,6 +450,11 @@ float leakyreluf(float x);
 float sigmoidDerivative(float x);
 float reluDerivative(float x);
 void softmaxf(Matrix m);
+float ml_expf(float x);
+void ml_set_exp_mode(ExpMode mode);
+void mat_softmax_rows(Matrix m);
+void mat_log_softmax_rows(Matrix dest, Matrix src);
+GemmKernel gemm_get_kernel(void);
 float (*getActFunc(ActivationType a))(float);
 char *getActName(ActivationType a);
 float (*getActDerivative(ActivationType a))(float);
@@ -83,6 +468,48 @@ float safe_expf(float x)
     return expf(x);
 }
 
+// exp for the activation and softmax kernels: 2^n * p(r) with x = n * ln2 + r and
+// |r| <= ln2 / 2. EXP_ACCURATE is within a couple of ulp of expf, EXP_FAST keeps
+// ~1e-5 relative error, EXP_LIBM goes through the C library (safe_expf)
+ExpMode mlExpMode = EXP_ACCURATE;
+
+#define ML_EXP_HI 88.3762626647949f
+#define ML_EXP_LO -87.f // keeps 2^n * p(r) a normal float, denormals are very slow to produce
+#define ML_LOG2E 1.44269504088896341f
+#define ML_LN2_HI 0.693359375f
+#define ML_LN2_LO -2.12194440e-4f
+
+void ml_set_exp_mode(ExpMode mode)
+{
+    mlExpMode = mode;
+}
+
+float ml_expf(float x)
+{
+    // scalar libm is already exact to an ulp, only the fast polynomial beats it
+    if (mlExpMode != EXP_FAST)
+        return safe_expf(x);
+
+    x = x > ML_EXP_HI ? ML_EXP_HI : (x < ML_EXP_LO ? ML_EXP_LO : x);
+    int32_t ni = (int32_t)(x * ML_LOG2E + (x < 0.f ? -0.5f : 0.5f)); // round to nearest
+    float n = (float)ni;
+    float r = x - n * ML_LN2_HI;
+    r = r - n * ML_LN2_LO;
+
+    float p = 4.1666667e-2f;
+    p = p * r + 1.6666667e-1f;
+    p = p * r + 5.0000000e-1f;
+    p = p * r + 1.f;
+    p = p * r + 1.f;
+
+    union
+    {
+        uint32_t u;
+        float f;
+    } scale = {(uint32_t)(ni + 127) << 23};
+    return p * scale.f;
+}
+
 float sigmoidf(float x)
 {
     return (1.f / (1.f + expf(-x)));
@@ -113,21 +540,206 @@ float leakyreluDerivative(float x)
     return (x > 0.f ? 1 : 0.01f);
 }
 
-void softmaxf(Matrix m)
+// enum-dispatched activations, the switch sits outside the element loop so
+// each case compiles to a tight (vectorizable) loop
+static inline float activatef(float x, ActivationType type)
 {
-    float sum = 0.f;
-    for (int i = 0; i < m.rows; i++)
+    switch (type)
     {
-        for (int j = 0; j < m.cols; j++)
-        {
-            MAT_AT(m, i, j) = expf(MAT_AT(m, i, j));
-            sum += MAT_AT(m, i, j);
-        }
-        for (int j = 0; j < m.cols; j++)
+    case SIGMOID:
+        return 1.f / (1.f + ml_expf(-x));
+    case RELU:
+        return x > 0.f ? x : 0.f;
+    case LEAKYRELU:
+        return x > 0.f ? x : 0.01f * x;
+    default:
+        return x;
+    }
+}
+
+static inline void activate_row(float *row, size_t n, ActivationType type)
+{
+    switch (type)
+    {
+    case SIGMOID:
+        for (size_t j = 0; j < n; j++)
+            row[j] = 1.f / (1.f + ml_expf(-row[j]));
+        break;
+    case RELU:
+        for (size_t j = 0; j < n; j++)
+            row[j] = row[j] > 0.f ? row[j] : 0.f;
+        break;
+    case LEAKYRELU:
+        for (size_t j = 0; j < n; j++)
+            row[j] = row[j] > 0.f ? row[j] : 0.01f * row[j];
+        break;
+    default:
+        break;
+    }
+}
+
+#ifdef ML_X86_SIMD
+
+// 8-wide ml_expf
+__attribute__((target("avx2,fma"), always_inline)) static inline __m256 exp256_ps(__m256 x, ExpMode mode)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(ML_EXP_LO)), _mm256_set1_ps(ML_EXP_HI));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(ML_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(ML_LN2_HI), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(ML_LN2_LO), r);
+
+    __m256 p;
+    if (mode == EXP_FAST)
+    {
+        p = _mm256_set1_ps(4.1666667e-2f);
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666667e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000000e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.f));
+    }
+    else
+    {
+        p = _mm256_set1_ps(1.9875691500e-4f);
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+        p = _mm256_fmadd_ps(_mm256_mul_ps(p, r), r, _mm256_add_ps(r, _mm256_set1_ps(1.f)));
+    }
+
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx2,fma"), always_inline)) static inline __m256 sigmoid256_ps(__m256 x, ExpMode mode)
+{
+    __m256 one = _mm256_set1_ps(1.f);
+    __m256 e = exp256_ps(_mm256_sub_ps(_mm256_setzero_ps(), x), mode);
+    return _mm256_div_ps(one, _mm256_add_ps(one, e));
+}
+
+__attribute__((target("avx2,fma"), always_inline)) static inline float hmax256_ps(__m256 v)
+{
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+__attribute__((target("avx2,fma"), always_inline)) static inline float hsum256_ps(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+// finds the row max and the sum of exp(row - max), storing the exps into dest unless it is NULL
+__attribute__((target("avx2,fma"))) static void exp_shifted_row_avx2(const float *row, float *dest, size_t n, float *maxOut, float *sumOut)
+{
+    ExpMode mode = mlExpMode;
+    // the last n % 8 elements go through one vector padded with -inf, exp(-inf - max) adds 0 to the sum
+    size_t full = n & ~(size_t)7;
+    ML_ALIGNED(32) float padded[8];
+    for (size_t j = 0; j < 8; j++)
+        padded[j] = full + j < n ? row[full + j] : -INFINITY;
+    __m256 tail = _mm256_load_ps(padded);
+
+    __m256 vmax = tail;
+    for (size_t j = 0; j < full; j += 8)
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(row + j));
+    float max = hmax256_ps(vmax);
+
+    __m256 vsum = _mm256_setzero_ps();
+    __m256 shift = _mm256_set1_ps(max);
+    for (size_t j = 0; j < full; j += 8)
+    {
+        __m256 e = exp256_ps(_mm256_sub_ps(_mm256_loadu_ps(row + j), shift), mode);
+        if (dest)
+            _mm256_storeu_ps(dest + j, e);
+        vsum = _mm256_add_ps(vsum, e);
+    }
+    if (full < n)
+    {
+        __m256 e = exp256_ps(_mm256_sub_ps(tail, shift), mode);
+        e = _mm256_and_ps(e, _mm256_cmp_ps(tail, _mm256_set1_ps(-INFINITY), _CMP_NEQ_OQ));
+        vsum = _mm256_add_ps(vsum, e);
+        if (dest)
         {
-            MAT_AT(m, i, j) /= sum;
+            _mm256_store_ps(padded, e);
+            for (size_t j = full; j < n; j++)
+                dest[j] = padded[j - full];
         }
     }
+    *maxOut = max;
+    *sumOut = hsum256_ps(vsum);
+}
+
+#endif // ML_X86_SIMD
+
+static void exp_shifted_row(const float *row, float *dest, size_t n, float *maxOut, float *sumOut)
+{
+#ifdef ML_X86_SIMD
+    // a row shorter than one vector is latency bound, scalar code overlaps its exps better
+    if (n >= 8 && mlExpMode != EXP_LIBM && gemm_get_kernel() == GEMM_AVX2)
+    {
+        exp_shifted_row_avx2(row, dest, n, maxOut, sumOut);
+        return;
+    }
+#endif // ML_X86_SIMD
+    float max = -INFINITY;
+    for (size_t j = 0; j < n; j++)
+        max = row[j] > max ? row[j] : max;
+    float sum = 0.f;
+    for (size_t j = 0; j < n; j++)
+    {
+        float e = ml_expf(row[j] - max);
+        if (dest)
+            dest[j] = e;
+        sum += e;
+    }
+    *maxOut = max;
+    *sumOut = sum;
+}
+
+// row-wise softmax, every row is shifted by its max first so large logits
+// cannot overflow exp
+void mat_softmax_rows(Matrix m)
+{
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        float *row = &MAT_AT(m, i, 0);
+        float max, sum;
+        exp_shifted_row(row, row, m.cols, &max, &sum);
+        float inv = 1.f / sum;
+        for (size_t j = 0; j < m.cols; j++)
+            row[j] *= inv;
+    }
+}
+
+// dest = log(softmax(src)) row by row, computed as x - max - log(sum(exp(x - max)))
+// so it stays finite where softmax underflows to 0
+void mat_log_softmax_rows(Matrix dest, Matrix src)
+{
+    if (dest.rows != src.rows || dest.cols != src.cols)
+        return;
+
+    for (size_t i = 0; i < src.rows; i++)
+    {
+        float *out = &MAT_AT(dest, i, 0);
+        const float *in = &MAT_AT(src, i, 0);
+        float max, sum;
+        exp_shifted_row(in, NULL, src.cols, &max, &sum);
+        float shift = max + logf(sum);
+        for (size_t j = 0; j < src.cols; j++)
+            out[j] = in[j] - shift;
+    }
+}
+
+void softmaxf(Matrix m)
+{
+    mat_softmax_rows(m);
 }
 
 float (*getActFunc(ActivationType a))(float)
@@ -157,6 +769,8 @@ char *getActName(ActivationType a)
         return "LeakyReLU";
     case SOFTMAX:
         return "Softmax";
+    case LINEAR:
+        return "Linear";
     default:
         return NULL;
     }
@@ -177,58 +791,197 @@ float (*getActDerivative(ActivationType a))(float)
     }
 }
 
+// uniform in [0, 1) from the calling thread's generator
 float rand_float()
 {
-    return ((float)rand() / (float)RAND_MAX);
+    return Rng_float(Rng_thread());
+}
+
+void *ml_aligned_alloc(size_t alignment, size_t size)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    return _aligned_malloc(size, alignment);
+#else
+    void *p = NULL;
+    if (posix_memalign(&p, alignment, size) != 0)
+        return NULL;
+    return p;
+#endif
+}
+
+void ml_aligned_free(void *p)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
 }
 
 Matrix mat_alloc(size_t rows, size_t cols);
+void mat_free(Matrix m);
 void mat_dot(Matrix dest, Matrix a, Matrix b);
+void mat_dot_bias_act(Matrix dest, Matrix a, Matrix b, Matrix bias, ActivationType activation);
+void mat_dot_naive(Matrix dest, Matrix a, Matrix b);
+void gemm_f32(size_t m, size_t n, size_t k,
+              const float *a, size_t rsa, size_t csa,
+              const float *b, size_t rsb, size_t csb,
+              float *c, size_t ldc, bool accumulate);
+void gemm_f32_fused(size_t m, size_t n, size_t k,
+                    const float *a, size_t rsa, size_t csa,
+                    const float *b, size_t rsb, size_t csb,
+                    float *c, size_t ldc, bool accumulate,
+                    const float *bias, ActivationType activation);
+GemmKernel gemm_get_kernel(void);
+bool gemm_set_kernel(GemmKernel kernel);
+void gemm_thread_cleanup(void);
+const char *gemm_kernel_name(GemmKernel kernel);
+double ml_seconds(void);
+void mat_dot_benchmark(size_t rows, size_t inner, size_t cols, size_t repeats);
+void mat_dot_ex(Matrix dest, Matrix a, bool transA, Matrix b, bool transB, bool accumulate);
 void mat_sum(Matrix dest, Matrix src);
+void mat_col_sum(Matrix dest, Matrix src, bool accumulate);
+SparseRows sparse_alloc(size_t maxRows, size_t cols, size_t capacity);
+void sparse_free(SparseRows s);
+void sparse_from_dense(SparseRows *dest, Matrix src);
+void sparse_from_trajectory(SparseRows *dest, Trajectory t, size_t first, size_t rows);
+void mat_dot_sparse_bias_act(Matrix dest, SparseRows a, Matrix b, Matrix bias, ActivationType activation);
+void mat_dot_sparse_tn(Matrix dest, SparseRows a, Matrix b, bool accumulate);
+void mat_activation_derivative(Matrix dz, Matrix outputs, ActivationType type);
 void mat_activate(Matrix m, float (*actFunc)(float));
+void mat_activate_type(Matrix m, ActivationType type);
 void mat_sig(Matrix m);
 void mat_rand(Matrix m, float low, float high);
+void mat_randn(Matrix m, float mean, float stddev);
 Matrix mat_row(Matrix src, size_t row);
+Matrix mat_rows(Matrix src, size_t row, size_t count);
 Matrix mat_col(Matrix src, size_t col);
 void mat_copy(Matrix dest, Matrix src);
 void mat_clear(Matrix m);
 void print_mat(Matrix m, const char *name, int padding, const char *format);
 void print_activation(Activation a, const char *name, int padding);
 bool mat_same(Matrix a, Matrix b);
+Trajectory Trajectory_alloc(size_t capacity, size_t stateLen, const float *codeValues, size_t codeCount);
+void Trajectory_free(Trajectory t);
+uint8_t *Trajectory_state(Trajectory t, size_t step);
+void Trajectory_expand(Trajectory t, size_t first, Matrix dest);
+bool Trajectory_append(Trajectory *dest, Trajectory src);
+void Returns_discounted(const float *rewards, const uint8_t *dones, const float *bootstrap, size_t steps, size_t envs, float gamma, float *returns);
+void Returns_gae(const float *rewards, const float *values, const uint8_t *dones, const float *bootstrap, size_t steps, size_t envs,
+                 float gamma, float lambda, float *advantages, float *returns);
+void Returns_normalize(float *x, size_t count);
+ReplayBuffer ReplayBuffer_alloc(size_t capacity, size_t stateLen, const float *codeValues, size_t codeCount, float alpha);
+void ReplayBuffer_free(ReplayBuffer rb);
+uint64_t ReplayBuffer_add(ReplayBuffer *rb, const uint8_t *state, uint8_t action, float reward, bool done, uint64_t previous);
+size_t ReplayBuffer_sample(ReplayBuffer *rb, Rng *rng, ReplayBatch batch, size_t count, float beta);
+void ReplayBuffer_update(ReplayBuffer *rb, const size_t *indices, const float *priorities, size_t count);
+ReplayBatch ReplayBatch_alloc(size_t rows, size_t stateLen);
+void ReplayBatch_free(ReplayBatch batch);
 void fwrite_mat(Matrix m, FILE *dest);
 void fread_mat(Matrix m, FILE *src);
 void mat_shuffle_rows(Matrix m);
 void xavier_init(Matrix m);
 
 Network NeuralNetwork(size_t *layers, size_t count, ActivationType *activations);
+Network NeuralNetwork_batch(size_t *layers, size_t count, ActivationType *activations, size_t batch);
+Network NeuralNetwork_spec(size_t *layers, size_t count, ActivationType *activations, LayerSpec *specs, size_t batch);
+LayerSpec conv_spec(size_t height, size_t width, size_t channels, size_t filters, size_t kernel, size_t stride);
+size_t conv_output_size(LayerSpec spec);
+bool Network_all_dense(Network nn);
+void Network_free(Network nn);
+Network Network_clone(Network nn);
+Network Network_replica(Network nn, size_t batch);
+void Network_copy_params(Network dest, Network src);
 void print_Network(Network nn, const char *name, bool showLayers);
 void Network_rand(Network nn, float low, float high);
 float Network_cost(Network nn, Matrix in, Matrix out);
 float Network_cross_entropy_cost(Network nn, Step *steps[], size_t stepAmount);
 void Network_forward(Network nn);
+void Network_forward_rows(Network nn, size_t rows);
+void Network_forward_batch(Network nn, Matrix in);
+void Network_forward_layers(Network nn, size_t rows, bool outputSoftmax);
+void Network_forward_from(Network nn, size_t first, size_t rows, bool outputSoftmax);
+Matrix Network_accumulator_alloc(Network nn);
+void Network_accumulator_refresh(Network nn, Matrix acc);
+void Network_accumulator_set(Network nn, Matrix acc, size_t index, float value);
+void Network_forward_accumulator(Network nn, Matrix acc);
+float Network_policy_cost(Network nn, Step *steps[], size_t stepAmount);
+float Network_policy_cost_trajectory(Network nn, Trajectory t);
 void Network_diff(Network nn, Network g, float eps, Matrix in, Matrix out);
 void Network_policy_gradient_diff(Network nn, Network g, float eps, Step *steps[], size_t stepAmount);
 void Network_backprop(Network nn, Network g, Matrix in, Matrix out);
 void Network_policy_gradient_backprop(Network nn, Network g, Step *steps[], size_t stepAmount);
+void Network_backward_rows(Network nn, Network g, size_t rows);
+void Network_forward_sparse(Network nn, SparseRows in, bool outputSoftmax);
+void Network_backward_sparse(Network nn, Network g, SparseRows in);
+void Network_policy_gradient_backprop_sparse(Network nn, Network g, Trajectory t);
+void Network_backprop_batch(Network nn, Network g, Matrix in, Matrix out);
+void Network_policy_gradient_backprop_batch(Network nn, Network g, Step *steps[], size_t stepAmount);
+void Network_policy_gradient_backprop_trajectory(Network nn, Network g, Trajectory t);
 void Network_clear(Network nn);
+void Network_scale(Network nn, float s);
+float Network_max_diff(Network a, Network b);
 void Network_gradient_descent(Network nn, Network g, float rate);
 void Network_gradient_ascent(Network nn, Network g, float rate);
+TrajectoryQueue *TrajectoryQueue_alloc(size_t slots, size_t capacity, size_t stateLen, const float *codeValues, size_t codeCount);
+void TrajectoryQueue_free(TrajectoryQueue *q);
+Trajectory *TrajectoryQueue_acquire(TrajectoryQueue *q);
+void TrajectoryQueue_submit(TrajectoryQueue *q, Trajectory *t);
+Trajectory *TrajectoryQueue_take(TrajectoryQueue *q);
+void TrajectoryQueue_recycle(TrajectoryQueue *q, Trajectory *t);
+WeightBuffer *WeightBuffer_alloc(Network nn);
+void WeightBuffer_free(WeightBuffer *wb);
+void WeightBuffer_publish(WeightBuffer *wb, Network nn);
+bool WeightBuffer_fetch(WeightBuffer *wb, Network dest, int64_t *version);
+Optimizer Optimizer_alloc(Network nn, OptimizerType type, float rate);
+void Optimizer_free(Optimizer opt);
+void Optimizer_reset(Optimizer *opt);
+float Optimizer_step(Optimizer *opt, Network nn, Network g);
+float Network_grad_norm(Network g);
 bool Network_same(Network a, Network b);
 void Network_save(Network nn, const char *fileName);
 void Network_load(Network nn, const char *fileName);
+bool Network_write(Network nn, const char *path);
+bool Network_read(Network nn, const char *path);
+NetworkMap NetworkMap_open(const char *path, size_t batch, bool verify);
+void NetworkMap_close(NetworkMap map);
+bool Network_convert_legacy(const char *legacyPath, const char *path, ActivationType *activations);
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size);
 size_t *Network_getArch(Network nn);
 bool Network_cmpArch(Network nn, size_t *arch, size_t archLen);
 void Network_xavier_init(Network nn);
 
+size_t ml_cpu_count(void);
+ThreadPool *ThreadPool_create(size_t threads);
+void ThreadPool_run(ThreadPool *pool, size_t tasks, PoolTask task, void *arg);
+void ThreadPool_destroy(ThreadPool *pool);
+DataParallel DataParallel_alloc(Network nn, size_t threads, size_t chunk);
+void DataParallel_free(DataParallel dp);
+void DataParallel_backprop(DataParallel dp, Network g, Matrix in, Matrix out);
+void DataParallel_policy_gradient(DataParallel dp, Network g, Trajectory t);
+Checkpointer *Checkpointer_create(Network nn, const char *prefix, size_t keep);
+bool Checkpointer_save(Checkpointer *c, Network nn, uint64_t step);
+void Checkpointer_flush(Checkpointer *c);
+bool Checkpointer_resume(Checkpointer *c, Network nn, uint64_t *step);
+void Checkpointer_destroy(Checkpointer *c);
+Evolution Evolution_alloc(Network nn, size_t threads, size_t pairs, size_t batch, uint64_t seed);
+void Evolution_free(Evolution es);
+void Evolution_evaluate(Evolution *es, Network center, FitnessFn fitness, void *arg, size_t first, size_t count);
+void Evolution_update(Evolution *es, Network center);
+float Evolution_step(Evolution *es, Network center, FitnessFn fitness, void *arg);
+GradCheck Network_grad_check(ThreadPool *pool, Network nn, Network g, float eps, size_t count, Matrix in, Matrix out);
+GradCheck Network_policy_grad_check(ThreadPool *pool, Network nn, Network g, float eps, size_t count, Trajectory t);
+
 const char fileExtension[] = ".netw";
-const char fileHeader[] = "nn";
+const char fileHeader[] = "nn"; // legacy files
+const char fileMagic[] = "NETW";
 const char fileMatRow = '\n';
 
 void mat_shuffle_rows(Matrix m)
 {
     for (size_t i = 0; i < m.rows; i++)
     {
-        size_t j = (i + rand() % (m.rows - i));
+        size_t j = i + Rng_bounded(Rng_thread(), (uint32_t)(m.rows - i));
         if (i == j)
             continue;
         for (size_t k = 0; k < m.cols; k++)
@@ -251,9 +1004,9 @@ size_t *Network_getArch(Network nn)
     size_t *arch = (size_t *)malloc(sizeof(*arch) * (nn.count + 1));
     for (size_t i = 0; i < nn.count; i++)
     {
-        arch[i] = nn.weights[i].rows;
+        arch[i] = nn.layers[i].cols;
     }
-    arch[nn.count] = NETWORK_OUT(nn).rows;
+    arch[nn.count] = NETWORK_OUT(nn).cols;
     return arch;
 }
 
@@ -264,10 +1017,10 @@ bool Network_cmpArch(Network nn, size_t *arch, size_t archLen)
 
     for (size_t i = 0; i < nn.count; i++)
     {
-        if (arch[i] != nn.weights[i].rows)
+        if (arch[i] != nn.layers[i].cols)
             return false;
     }
-    if (arch[nn.count] != NETWORK_OUT(nn).rows)
+    if (arch[nn.count] != NETWORK_OUT(nn).cols)
         return false;
     return true;
 }
@@ -281,120 +1034,461 @@ void Network_xavier_init(Network nn)
     }
 }
 
-void Network_save(Network nn, const char *fileName)
+static Network network_build(size_t *layers, size_t count, ActivationType *activations, LayerSpec *specs,
+                             size_t batch, float *sharedParams);
+
+// <exe dir>\fileName.netw on Windows, fileName.netw relative to the working directory elsewhere
+static bool network_path(char *path, size_t size, const char *fileName)
 {
 #if defined(_WIN32) || defined(_WIN64)
-    char path[MAX_PATH];
-    unsigned long length = GetModuleFileName(NULL, path, sizeof(path));
+    unsigned long length = GetModuleFileName(NULL, path, (DWORD)size);
     if (!length)
     {
         fprintf(stderr, "Failed to get file path\n");
-        return;
+        return false;
     }
-    unsigned long writeCounter = 0;
-    for (unsigned long i = length - 1; i >= 0; i--)
+    while (length > 0 && path[length - 1] != '\\')
     {
-        if (path[i - 1] == '\\')
-        {
-            path[i] = '\0';
-            writeCounter = i;
-            break;
-        }
+        length--;
     }
-    strcat(path, fileName);
-    strcat(path, fileExtension);
+    path[length] = '\0';
+    return (size_t)snprintf(path + length, size - length, "%s%s", fileName, fileExtension) < size - length;
+#else
+    // relative to the working directory, there is no portable executable path
+    return (size_t)snprintf(path, size, "%s%s", fileName, fileExtension) < size;
+#endif
+}
+
+void Network_save(Network nn, const char *fileName)
+{
+    char path[FILENAME_MAX];
+    if (!network_path(path, sizeof(path), fileName))
+        return;
 
     FILE *networkFile = fopen(path, "r");
     if (networkFile)
     {
+        fclose(networkFile);
         fprintf(stderr, "File already exists\n");
         return;
     }
-    networkFile = fopen(path, "wb");
-    if (!networkFile)
-    {
-        fprintf(stderr, "File could not be opened\n");
-        return;
-    }
-#endif
-
-    // Writing the file
-    fwrite(fileHeader, sizeof(char), sizeof(fileHeader) - 1, networkFile);
-    size_t *arch = Network_getArch(nn);
-    size_t archLen = nn.count + 1;
-    fwrite(&archLen, sizeof(archLen), 1, networkFile);
-    fwrite(arch, sizeof(*arch), nn.count + 1, networkFile);
-    for (size_t i = 0; i < nn.count; i++)
-    {
-        fwrite_mat(nn.weights[i], networkFile);
-        fwrite_mat(nn.biases[i], networkFile);
-    }
-    fclose(networkFile);
-    printf("File saved successfully\n");
+    if (Network_write(nn, path))
+        printf("File saved successfully\n");
 }
 
 void Network_load(Network nn, const char *fileName)
 {
-#if defined(_WIN32) || defined(_WIN64)
-    char path[MAX_PATH];
-    unsigned long length = GetModuleFileName(NULL, path, sizeof(path));
-    if (!length)
-    {
-        fprintf(stderr, "Failed to get file path\n");
+    char path[FILENAME_MAX];
+    if (!network_path(path, sizeof(path), fileName))
         return;
-    }
-    unsigned long writeCounter = 0;
-    for (unsigned long i = length - 1; i >= 0; i--)
+    if (Network_read(nn, path))
+        printf("File loaded successfully\n");
+}
+
+static uint32_t crcTable[8][256];
+
+// IEEE crc32 (zlib's), start with crc = 0. Slicing by 8, one table lookup per byte
+// but eight independent ones per step
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size)
+{
+    if (crcTable[0][1] == 0)
     {
-        if (path[i - 1] == '\\')
+        for (uint32_t i = 0; i < 256; i++)
         {
-            path[i] = '\0';
-            writeCounter = i;
-            break;
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crcTable[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            for (int t = 1; t < 8; t++)
+            {
+                crcTable[t][i] = crcTable[0][crcTable[t - 1][i] & 0xFF] ^ (crcTable[t - 1][i] >> 8);
+            }
         }
     }
-    strcat(path, fileName);
-    strcat(path, fileExtension);
 
-    FILE *networkFile = fopen(path, "rb");
-    if (!networkFile)
+    const uint8_t *bytes = (const uint8_t *)data;
+    crc = ~crc;
+    // the table math assumes a little endian host
+    for (; size >= 8; size -= 8, bytes += 8)
     {
-        fprintf(stderr, "File could not be opened\n");
-        return;
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+        low ^= crc;
+        crc = crcTable[7][low & 0xFF] ^ crcTable[6][(low >> 8) & 0xFF] ^ crcTable[5][(low >> 16) & 0xFF] ^
+              crcTable[4][low >> 24] ^ crcTable[3][high & 0xFF] ^ crcTable[2][(high >> 8) & 0xFF] ^
+              crcTable[1][(high >> 16) & 0xFF] ^ crcTable[0][high >> 24];
     }
-#endif
-
-    // Reading the file
-    unsigned long headerLen = sizeof(fileHeader) - 1;
-    char header[sizeof(fileHeader) - 1];
-    fread(header, sizeof(*fileHeader), headerLen, networkFile);
-    if (strncmp(header, fileHeader, headerLen) != 0)
+    for (; size > 0; size--, bytes++)
     {
-        fprintf(stderr, "Invalid %s file\n", fileExtension);
-        fclose(networkFile);
-        return;
+        crc = crcTable[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
     }
-    size_t archLen;
-    fread(&archLen, sizeof(archLen), 1, networkFile);
-    size_t *arch = (size_t *)malloc(sizeof(*arch) * archLen);
-    fread(arch, sizeof(*arch), archLen, networkFile);
+    return ~crc;
+}
+
+// the header crc covers the header with headerCrc zeroed and the layer table
+static uint32_t netw_header_crc(NetwHeader header, const NetwLayer *table)
+{
+    header.headerCrc = 0;
+    uint32_t crc = crc32_update(0, &header, sizeof(header));
+    return crc32_update(crc, table, sizeof(*table) * header.layerCount);
+}
+
+// the data section is the params arena byte for byte, so every matrix keeps its
+// 64-byte aligned offset and a mapped file can be used as the arena directly.
+// The crcs are left 0
+static void netw_describe(Network nn, NetwHeader *header, NetwLayer *table)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, fileMagic, sizeof(header->magic));
+    header->version = NETW_VERSION;
+    header->dtype = NETW_F32;
+    header->endian = NETW_ENDIAN;
+    header->layerCount = (uint32_t)nn.count;
+    header->tableOffset = sizeof(*header);
+    size_t tableEnd = sizeof(*header) + sizeof(*table) * nn.count;
+    header->dataOffset = (tableEnd + ML_ALIGNMENT - 1) / ML_ALIGNMENT * ML_ALIGNMENT;
+    header->dataSize = sizeof(*nn.params) * nn.paramCount;
 
-    if (!Network_cmpArch(nn, arch, archLen))
-    {
-        fprintf(stderr, "Provided Network architecture is not the same as loaded Network\n");
-        fclose(networkFile);
-        return;
-    }
     for (size_t i = 0; i < nn.count; i++)
     {
-        fread_mat(nn.weights[i], networkFile);
-        fread_mat(nn.biases[i], networkFile);
+        NetwLayer *layer = &table[i];
+        memset(layer, 0, sizeof(*layer));
+        layer->kind = LAYER_IS_CONV(nn, i) ? CONV2D : DENSE;
+        layer->activation = nn.activations ? nn.activations[i].type : LINEAR;
+        layer->inputs = (uint32_t)nn.layers[i].cols;
+        layer->outputs = (uint32_t)nn.layers[i + 1].cols;
+        if (LAYER_IS_CONV(nn, i))
+        {
+            LayerSpec spec = nn.specs[i];
+            layer->height = (uint32_t)spec.height;
+            layer->width = (uint32_t)spec.width;
+            layer->channels = (uint32_t)spec.channels;
+            layer->filters = (uint32_t)spec.filters;
+            layer->kernel = (uint32_t)spec.kernel;
+            layer->stride = (uint32_t)spec.stride;
+        }
+        layer->weights = header->dataOffset + sizeof(float) * (uint64_t)(nn.weights[i].es - nn.params);
+        layer->biases = header->dataOffset + sizeof(float) * (uint64_t)(nn.biases[i].es - nn.params);
     }
-    fclose(networkFile);
-    printf("File loaded successfully\n");
 }
 
-void fwrite_mat(Matrix src, FILE *dest)
+// flushes file through the OS cache to the disk
+static bool file_sync(FILE *file)
+{
+    if (fflush(file) != 0)
+        return false;
+#if defined(_WIN32) || defined(_WIN64)
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// writes a v2 file to exactly path, replacing it
+bool Network_write(Network nn, const char *path)
+{
+    NetwHeader header;
+    NetwLayer *table = (NetwLayer *)malloc(sizeof(*table) * nn.count);
+    netw_describe(nn, &header, table);
+    header.dataCrc = crc32_update(0, nn.params, header.dataSize);
+    header.headerCrc = netw_header_crc(header, table);
+
+    FILE *networkFile = fopen(path, "wb");
+    if (!networkFile)
+    {
+        fprintf(stderr, "File could not be opened\n");
+        free(table);
+        return false;
+    }
+
+    static const char padding[ML_ALIGNMENT] = {0};
+    size_t tableEnd = sizeof(header) + sizeof(*table) * nn.count;
+    bool ok = fwrite(&header, sizeof(header), 1, networkFile) == 1;
+    ok = ok && fwrite(table, sizeof(*table), nn.count, networkFile) == nn.count;
+    ok = ok && fwrite(padding, 1, header.dataOffset - tableEnd, networkFile) == header.dataOffset - tableEnd;
+    ok = ok && fwrite(nn.params, 1, header.dataSize, networkFile) == header.dataSize;
+    // on disk before returning, so a rename after this never exposes a partial file
+    ok = ok && file_sync(networkFile);
+    ok = (fclose(networkFile) == 0) && ok;
+    free(table);
+    if (!ok)
+        fprintf(stderr, "Failed to write %s\n", path);
+    return ok;
+}
+
+// checks the fixed header of a file of size bytes, table has to follow it in memory
+static bool netw_check(const NetwHeader *header, const NetwLayer *table, size_t size)
+{
+    if (memcmp(header->magic, fileMagic, sizeof(header->magic)) != 0)
+    {
+        fprintf(stderr, "Invalid %s file\n", fileExtension);
+        return false;
+    }
+    if (header->version != NETW_VERSION || header->dtype != NETW_F32 || header->endian != NETW_ENDIAN)
+    {
+        fprintf(stderr, "Unsupported %s version, type or byte order\n", fileExtension);
+        return false;
+    }
+    if (header->tableOffset + sizeof(*table) * (uint64_t)header->layerCount > size ||
+        header->dataOffset % ML_ALIGNMENT != 0 || header->dataOffset + header->dataSize > size)
+    {
+        fprintf(stderr, "Truncated %s file\n", fileExtension);
+        return false;
+    }
+    if (netw_header_crc(*header, table) != header->headerCrc)
+    {
+        fprintf(stderr, "Corrupted %s header\n", fileExtension);
+        return false;
+    }
+    return true;
+}
+
+// a network only accepts a file with the same layer table
+static bool netw_matches(Network nn, const NetwHeader *header, const NetwLayer *table)
+{
+    NetwHeader expected;
+    NetwLayer *expectedTable = (NetwLayer *)malloc(sizeof(*expectedTable) * nn.count);
+    netw_describe(nn, &expected, expectedTable);
+    bool same = header->layerCount == expected.layerCount && header->dataOffset == expected.dataOffset &&
+                header->dataSize == expected.dataSize;
+    for (size_t i = 0; same && i < nn.count; i++)
+    {
+        NetwLayer a = table[i];
+        NetwLayer b = expectedTable[i];
+        if (!nn.activations)
+            a.activation = b.activation;
+        same = memcmp(&a, &b, sizeof(a)) == 0;
+    }
+    free(expectedTable);
+    if (!same)
+        fprintf(stderr, "Provided Network architecture is not the same as loaded Network\n");
+    return same;
+}
+
+// legacy files are "nn", the arch and every matrix row followed by a '\n' byte
+static bool network_read_legacy(Network nn, FILE *networkFile)
+{
+    size_t archLen;
+    if (fread(&archLen, sizeof(archLen), 1, networkFile) != 1 || archLen > 1024)
+    {
+        fprintf(stderr, "Invalid %s file\n", fileExtension);
+        return false;
+    }
+    size_t *arch = (size_t *)malloc(sizeof(*arch) * archLen);
+    bool ok = fread(arch, sizeof(*arch), archLen, networkFile) == archLen;
+    if (ok && (!Network_cmpArch(nn, arch, archLen) || !Network_all_dense(nn)))
+    {
+        fprintf(stderr, "Provided Network architecture is not the same as loaded Network\n");
+        ok = false;
+    }
+    free(arch);
+    for (size_t i = 0; ok && i < nn.count; i++)
+    {
+        fread_mat(nn.weights[i], networkFile);
+        fread_mat(nn.biases[i], networkFile);
+    }
+    return ok;
+}
+
+// reads a v2 (or legacy) file at exactly path into the params of nn
+bool Network_read(Network nn, const char *path)
+{
+    FILE *networkFile = fopen(path, "rb");
+    if (!networkFile)
+    {
+        fprintf(stderr, "File could not be opened\n");
+        return false;
+    }
+
+    char legacy[sizeof(fileHeader) - 1];
+    if (fread(legacy, 1, sizeof(legacy), networkFile) == sizeof(legacy) &&
+        memcmp(legacy, fileHeader, sizeof(legacy)) == 0)
+    {
+        bool ok = network_read_legacy(nn, networkFile);
+        fclose(networkFile);
+        return ok;
+    }
+
+    // the data is staged and checked first, a bad file leaves the params of nn as they were
+    NetwHeader header;
+    NetwLayer *table = NULL;
+    float *data = NULL;
+    fseek(networkFile, 0, SEEK_END);
+    long size = ftell(networkFile);
+    fseek(networkFile, 0, SEEK_SET);
+    bool ok = fread(&header, sizeof(header), 1, networkFile) == 1 && header.layerCount <= 1024;
+    if (ok)
+    {
+        table = (NetwLayer *)malloc(sizeof(*table) * (header.layerCount ? header.layerCount : 1));
+        ok = fseek(networkFile, (long)header.tableOffset, SEEK_SET) == 0 &&
+             fread(table, sizeof(*table), header.layerCount, networkFile) == header.layerCount;
+    }
+    ok = ok && netw_check(&header, table, (size_t)size) && netw_matches(nn, &header, table);
+    if (ok)
+    {
+        data = (float *)ml_aligned_alloc(ML_ALIGNMENT, header.dataSize);
+        ok = data && fseek(networkFile, (long)header.dataOffset, SEEK_SET) == 0 &&
+             fread(data, 1, header.dataSize, networkFile) == header.dataSize;
+    }
+    if (ok && crc32_update(0, data, header.dataSize) != header.dataCrc)
+    {
+        fprintf(stderr, "Corrupted %s data\n", fileExtension);
+        ok = false;
+    }
+    if (ok)
+        memcpy(nn.params, data, header.dataSize);
+    ml_aligned_free(data);
+    free(table);
+    fclose(networkFile);
+    return ok;
+}
+
+// maps a v2 file read only and builds a network with batch rows around it, the
+// params are the file pages themselves so processes mapping one file share them.
+// Opening costs the same for any model size unless verify asks for the data crc.
+// The params must not be written, map.base is NULL on failure
+NetworkMap NetworkMap_open(const char *path, size_t batch, bool verify)
+{
+    NetworkMap map = {0};
+#if defined(_WIN32) || defined(_WIN64)
+    map.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map.file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "File could not be opened\n");
+        return (NetworkMap){0};
+    }
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(map.file, &fileSize);
+    map.size = (size_t)fileSize.QuadPart;
+    map.mapping = CreateFileMappingA(map.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    map.base = map.mapping ? MapViewOfFile(map.mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "File could not be opened\n");
+        return map;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        map.size = (size_t)info.st_size;
+        map.base = mmap(NULL, map.size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map.base == MAP_FAILED)
+            map.base = NULL;
+    }
+    close(fd);
+#endif
+    if (!map.base)
+    {
+        fprintf(stderr, "File could not be mapped\n");
+        NetworkMap_close(map);
+        return (NetworkMap){0};
+    }
+
+    const NetwHeader *header = (const NetwHeader *)map.base;
+    const NetwLayer *table = (const NetwLayer *)((const char *)map.base + sizeof(*header));
+    bool ok = map.size >= sizeof(*header) && header->tableOffset == sizeof(*header) &&
+              netw_check(header, table, map.size);
+    if (ok && verify && crc32_update(0, (const char *)map.base + header->dataOffset, header->dataSize) != header->dataCrc)
+    {
+        fprintf(stderr, "Corrupted %s data\n", fileExtension);
+        ok = false;
+    }
+    if (!ok)
+    {
+        NetworkMap_close(map);
+        return (NetworkMap){0};
+    }
+
+    size_t count = header->layerCount;
+    size_t *layers = (size_t *)malloc(sizeof(*layers) * (count + 1));
+    ActivationType *acts = (ActivationType *)malloc(sizeof(*acts) * count);
+    LayerSpec *specs = (LayerSpec *)calloc(count, sizeof(*specs));
+    for (size_t i = 0; i < count; i++)
+    {
+        layers[i] = table[i].inputs;
+        layers[i + 1] = table[i].outputs;
+        acts[i] = (ActivationType)table[i].activation;
+        if (table[i].kind == CONV2D)
+            specs[i] = conv_spec(table[i].height, table[i].width, table[i].channels, table[i].filters,
+                                 table[i].kernel, table[i].stride);
+    }
+    float *params = (float *)((char *)map.base + header->dataOffset);
+    map.nn = network_build(layers, count + 1, acts, specs, batch, params);
+    free(layers);
+    free(acts);
+    free(specs);
+
+    // the file layout is checked against the arena layout the network got
+    if (map.nn.count == 0 || !netw_matches(map.nn, header, table))
+    {
+        NetworkMap_close(map);
+        return (NetworkMap){0};
+    }
+    return map;
+}
+
+void NetworkMap_close(NetworkMap map)
+{
+    if (map.nn.layers)
+        Network_free(map.nn);
+#if defined(_WIN32) || defined(_WIN64)
+    if (map.base)
+        UnmapViewOfFile(map.base);
+    if (map.mapping)
+        CloseHandle(map.mapping);
+    if (map.file && map.file != INVALID_HANDLE_VALUE)
+        CloseHandle(map.file);
+#else
+    if (map.base)
+        munmap((void *)map.base, map.size);
+#endif
+}
+
+// rewrites a legacy file as v2, the legacy format has no activations so they are passed in
+bool Network_convert_legacy(const char *legacyPath, const char *path, ActivationType *activations)
+{
+    FILE *legacyFile = fopen(legacyPath, "rb");
+    if (!legacyFile)
+    {
+        fprintf(stderr, "File could not be opened\n");
+        return false;
+    }
+
+    char header[sizeof(fileHeader) - 1];
+    size_t archLen = 0;
+    bool ok = fread(header, 1, sizeof(header), legacyFile) == sizeof(header) &&
+              memcmp(header, fileHeader, sizeof(header)) == 0 &&
+              fread(&archLen, sizeof(archLen), 1, legacyFile) == 1 && archLen >= 2 && archLen <= 1024;
+    size_t *arch = (size_t *)malloc(sizeof(*arch) * (ok ? archLen : 1));
+    ok = ok && fread(arch, sizeof(*arch), archLen, legacyFile) == archLen;
+    if (!ok)
+    {
+        fprintf(stderr, "Invalid %s file\n", fileExtension);
+        free(arch);
+        fclose(legacyFile);
+        return false;
+    }
+
+    Network nn = NeuralNetwork_batch(arch, archLen, activations, 1);
+    // network_read_legacy starts right after the magic
+    fseek(legacyFile, (long)sizeof(header), SEEK_SET);
+    ok = network_read_legacy(nn, legacyFile) && Network_write(nn, path);
+    Network_free(nn);
+    free(arch);
+    fclose(legacyFile);
+    return ok;
+}
+
+void fwrite_mat(Matrix src, FILE *dest)
 {
     for (size_t i = 0; i < src.rows; i++)
     {
@@ -435,7 +1529,8 @@ void print_activation(Activation a, const char *name, int padding)
     printf("%*s%s = %s\n", padding, "", name, actName);
 }
 
-void mat_dot(Matrix dest, Matrix a, Matrix b)
+// reference implementation, kept for benchmarking and for checking the fast kernels
+void mat_dot_naive(Matrix dest, Matrix a, Matrix b)
 {
     if (a.cols != b.rows)
         return;
@@ -458,573 +1553,4041 @@ void mat_dot(Matrix dest, Matrix a, Matrix b)
     }
 }
 
-void mat_sum(Matrix dest, Matrix src)
+void mat_dot(Matrix dest, Matrix a, Matrix b)
 {
-    if (!mat_same(dest, src))
+    if (a.cols != b.rows)
+        return;
+    if (dest.rows != a.rows)
+        return;
+    if (dest.cols != b.cols)
         return;
 
-    for (size_t i = 0; i < dest.rows; i++)
+    gemm_f32(dest.rows, dest.cols, a.cols,
+             a.es, a.stride, 1,
+             b.es, b.stride, 1,
+             dest.es, dest.stride, false);
+}
+
+// GEMM
+//
+// C (m x n) = A (m x k) * B (k x n), or C += A * B when accumulating.
+// A and B are addressed through a row stride and a column stride so transposed
+// views can be multiplied without copying them first.
+//
+// Blocking follows the usual BLIS layout: B is packed into KC x NR panels
+// (NC columns at a time) that stay in cache while a register-tiled MR x NR
+// micro-kernel sweeps over the rows of A.
+
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_NC 1024
+#define GEMM_MAX_NR 16
+
+#if defined(__x86_64__)
+#define GEMM_AVX2_MR 6
+#define GEMM_SSE2_MR 4
+#else
+// 32-bit x86 only has 8 vector registers
+#define GEMM_AVX2_MR 2
+#define GEMM_SSE2_MR 2
+#endif
+#define GEMM_AVX2_NR 16
+#define GEMM_SSE2_NR 8
+#define GEMM_GENERIC_MR 4
+#define GEMM_GENERIC_NR 8
+
+// applied to C when its last K block is written: C = act(C + bias), bias is one
+// value per column of C (NULL for none)
+typedef struct GemmEpilogue
+{
+    const float *bias;
+    ActivationType activation;
+} GemmEpilogue;
+
+typedef void (*GemmMicroKernel)(size_t kc, const float *a, size_t rsa, size_t csa, const float *bp,
+                                float *c, size_t ldc, size_t mr, size_t nr, bool accumulate, GemmEpilogue ep);
+
+typedef struct GemmImpl
+{
+    GemmKernel kernel;
+    size_t mr;
+    size_t nr;
+    GemmMicroKernel micro;
+    // C (m x n) (+)= A * B for small m where B rows are contiguous, no packing
+    void (*rows)(size_t m, size_t n, size_t k, const float *a, size_t rsa, size_t csa,
+                 const float *b, size_t rsb, float *c, size_t ldc, bool accumulate, GemmEpilogue ep);
+} GemmImpl;
+
+static ML_THREAD_LOCAL float *gemmPackBuffer = NULL;
+static volatile int64_t gemmSelectedKernel = -1;
+
+static float *gemm_pack_buffer(void)
+{
+    if (!gemmPackBuffer)
     {
-        for (size_t j = 0; j < dest.cols; j++)
-        {
-            MAT_AT(dest, i, j) += MAT_AT(src, i, j);
-        }
+        gemmPackBuffer = (float *)ml_aligned_alloc(64, sizeof(float) * GEMM_KC * (GEMM_NC + GEMM_MAX_NR));
     }
+    return gemmPackBuffer;
 }
 
-void mat_sig(Matrix m)
+// copies B[0:kc, 0:nc] into consecutive kc x nr panels, zero padding the last one
+static void gemm_pack_b(size_t kc, size_t nc, const float *b, size_t rsb, size_t csb, size_t nr, float *dest)
 {
-    for (size_t i = 0; i < m.rows; i++)
+    for (size_t j = 0; j < nc; j += nr)
     {
-        for (size_t j = 0; j < m.cols; j++)
+        size_t cols = (nc - j < nr) ? nc - j : nr;
+        const float *panel = b + j * csb;
+        for (size_t p = 0; p < kc; p++)
         {
-            MAT_AT(m, i, j) = sigmoidf(MAT_AT(m, i, j));
+            const float *src = panel + p * rsb;
+            if (csb == 1 && cols == nr)
+            {
+                memcpy(dest, src, sizeof(*dest) * nr);
+            }
+            else
+            {
+                size_t jj = 0;
+                for (; jj < cols; jj++)
+                {
+                    dest[jj] = src[jj * csb];
+                }
+                for (; jj < nr; jj++)
+                {
+                    dest[jj] = 0.f;
+                }
+            }
+            dest += nr;
         }
     }
 }
 
-void mat_activate(Matrix m, float (*actFunc)(float))
+static void gemm_epilogue_row(float *row, size_t n, GemmEpilogue ep)
 {
-    for (size_t i = 0; i < m.rows; i++)
+    if (ep.bias)
     {
-        for (size_t j = 0; j < m.cols; j++)
-        {
-            MAT_AT(m, i, j) = actFunc(MAT_AT(m, i, j));
-        }
+        for (size_t j = 0; j < n; j++)
+            row[j] += ep.bias[j];
     }
+    activate_row(row, n, ep.activation);
 }
 
-void mat_rand(Matrix m, float low, float high)
+// writes an mr x nr corner of a full register tile back to C
+static void gemm_store_tile(const float *tile, size_t tileStride, float *c, size_t ldc, size_t mr, size_t nr,
+                            bool accumulate, GemmEpilogue ep)
 {
-    for (size_t i = 0; i < m.rows; i++)
+    for (size_t i = 0; i < mr; i++)
     {
-        for (size_t j = 0; j < m.cols; j++)
+        float *row = c + i * ldc;
+        for (size_t j = 0; j < nr; j++)
         {
-            MAT_AT(m, i, j) = rand_float() * (high - low) + low;
+            if (accumulate)
+                row[j] += tile[i * tileStride + j];
+            else
+                row[j] = tile[i * tileStride + j];
         }
+        gemm_epilogue_row(row, nr, ep);
     }
 }
 
-Matrix mat_row(Matrix src, size_t row)
-{
-    Matrix m;
-    m.rows = 1;
-    m.cols = src.cols;
-    m.stride = src.stride;
-    m.es = &MAT_AT(src, row, 0);
-    return m;
-}
-
-Matrix mat_col(Matrix src, size_t col)
-{
-    Matrix m;
-    m.rows = src.rows;
-    m.cols = 1;
-    m.stride = src.stride;
-    m.es = &MAT_AT(src, 0, col);
-    return m;
-}
-
-void mat_copy(Matrix dest, Matrix src)
+static void gemm_micro_generic(size_t kc, const float *a, size_t rsa, size_t csa, const float *bp,
+                               float *c, size_t ldc, size_t mr, size_t nr, bool accumulate, GemmEpilogue ep)
 {
-    if (!mat_same(dest, src))
-        return;
-
-    for (size_t i = 0; i < dest.rows; i++)
+    float acc[GEMM_GENERIC_MR][GEMM_GENERIC_NR] = {0};
+    const float *rowA[GEMM_GENERIC_MR];
+    for (size_t i = 0; i < GEMM_GENERIC_MR; i++)
     {
-        for (size_t j = 0; j < dest.cols; j++)
+        rowA[i] = a + (i < mr ? i : mr - 1) * rsa;
+    }
+    for (size_t p = 0; p < kc; p++)
+    {
+        for (size_t i = 0; i < GEMM_GENERIC_MR; i++)
         {
-            MAT_AT(dest, i, j) = MAT_AT(src, i, j);
+            float av = rowA[i][p * csa];
+            for (size_t j = 0; j < GEMM_GENERIC_NR; j++)
+            {
+                acc[i][j] += av * bp[j];
+            }
         }
+        bp += GEMM_GENERIC_NR;
     }
+    gemm_store_tile(&acc[0][0], GEMM_GENERIC_NR, c, ldc, mr, nr, accumulate, ep);
 }
 
-void mat_clear(Matrix m)
+static void gemm_rows_generic(size_t m, size_t n, size_t k, const float *a, size_t rsa, size_t csa,
+                              const float *b, size_t rsb, float *c, size_t ldc, bool accumulate, GemmEpilogue ep)
 {
-    for (size_t i = 0; i < m.rows; i++)
+    for (size_t i = 0; i < m; i++)
     {
-        for (size_t j = 0; j < m.cols; j++)
+        float *row = c + i * ldc;
+        if (!accumulate)
         {
-            MAT_AT(m, i, j) = 0;
+            memset(row, 0, sizeof(*row) * n);
+        }
+        for (size_t p = 0; p < k; p++)
+        {
+            float av = a[i * rsa + p * csa];
+            const float *bRow = b + p * rsb;
+            for (size_t j = 0; j < n; j++)
+            {
+                row[j] += av * bRow[j];
+            }
         }
+        gemm_epilogue_row(row, n, ep);
     }
 }
 
-Matrix mat_alloc(size_t rows, size_t cols)
-{
-    Matrix m;
-    m.rows = rows;
-    m.cols = cols;
-    m.stride = cols;
-    m.es = (float *)calloc(sizeof(m.es) * rows * cols, 1);
-    return m;
-}
+#ifdef ML_X86_SIMD
 
-bool mat_same(Matrix a, Matrix b)
+// the register tiles are spelled out row by row through these lists, arrays of
+// vectors indexed in a loop end up on the stack instead of in registers
+#if defined(__x86_64__)
+#define GEMM_SSE2_ROWS(X) X(0) X(1) X(2) X(3)
+#define GEMM_AVX2_ROWS(X) X(0) X(1) X(2) X(3) X(4) X(5)
+#else
+#define GEMM_SSE2_ROWS(X) X(0) X(1)
+#define GEMM_AVX2_ROWS(X) X(0) X(1)
+#endif
+
+__attribute__((target("sse2"), always_inline)) static inline __m128 gemm_activate_sse2(__m128 v, ActivationType type)
 {
-    return ((a.rows == b.rows) && (a.cols == b.cols));
+    switch (type)
+    {
+    case RELU:
+        return _mm_max_ps(v, _mm_setzero_ps());
+    case LEAKYRELU:
+        return _mm_max_ps(v, _mm_mul_ps(v, _mm_set1_ps(0.01f)));
+    default:
+        return v;
+    }
 }
 
-bool Network_same(Network a, Network b)
+// bias and activation for 4 finished outputs, activations without a vector form run on the stored values
+__attribute__((target("sse2"), always_inline)) static inline void gemm_finish_sse2(float *dest, __m128 v, __m128 bias, ActivationType type)
 {
-    if (a.count != b.count)
-        return false;
+    v = gemm_activate_sse2(_mm_add_ps(v, bias), type);
+    _mm_storeu_ps(dest, v);
+    if (type == SIGMOID)
+        activate_row(dest, 4, type);
+}
 
-    for (size_t i = 0; i < a.count; i++)
-    {
-        if (!mat_same(a.layers[i], b.layers[i]))
-            return false;
-        if (!mat_same(a.weights[i], b.weights[i]))
-            return false;
-        if (!mat_same(a.biases[i], b.biases[i]))
-            return false;
+#define GEMM_SSE2_INIT(i)                                    \
+    const float *a##i = a + (i < mr ? i : mr - 1) * rsa;     \
+    __m128 c##i##0 = _mm_setzero_ps();                       \
+    __m128 c##i##1 = _mm_setzero_ps();
+#define GEMM_SSE2_FMA(i)                                     \
+    {                                                        \
+        __m128 av = _mm_set1_ps(*a##i);                      \
+        a##i += csa;                                         \
+        c##i##0 = _mm_add_ps(c##i##0, _mm_mul_ps(av, b0));   \
+        c##i##1 = _mm_add_ps(c##i##1, _mm_mul_ps(av, b1));   \
     }
-    return true;
-}
+#define GEMM_SSE2_STORE(i)                                           \
+    {                                                                \
+        float *row = c + i * ldc;                                    \
+        if (accumulate)                                              \
+        {                                                            \
+            c##i##0 = _mm_add_ps(c##i##0, _mm_loadu_ps(row));        \
+            c##i##1 = _mm_add_ps(c##i##1, _mm_loadu_ps(row + 4));    \
+        }                                                            \
+        gemm_finish_sse2(row, c##i##0, bias0, ep.activation);        \
+        gemm_finish_sse2(row + 4, c##i##1, bias1, ep.activation);    \
+    }
+#define GEMM_SSE2_SPILL(i)                                  \
+    _mm_store_ps(tile + i * GEMM_SSE2_NR, c##i##0);         \
+    _mm_store_ps(tile + i * GEMM_SSE2_NR + 4, c##i##1);
 
-Network NeuralNetwork(size_t *layers, size_t count, ActivationType *activations)
+__attribute__((target("sse2"))) static void gemm_micro_sse2(size_t kc, const float *a, size_t rsa, size_t csa, const float *bp,
+                                                              float *c, size_t ldc, size_t mr, size_t nr, bool accumulate, GemmEpilogue ep)
 {
-    Network nn;
-    nn.count = count - 1;
-    nn.layers = (Matrix *)malloc(sizeof(*nn.layers) * nn.count + 1);
-    nn.weights = (Matrix *)malloc(sizeof(*nn.weights) * nn.count);
-    nn.biases = (Matrix *)malloc(sizeof(*nn.biases) * nn.count);
-    if (activations != NULL)
+    GEMM_SSE2_ROWS(GEMM_SSE2_INIT)
+    for (size_t p = 0; p < kc; p++)
     {
-        nn.activations = (Activation *)malloc(sizeof(*nn.activations) * nn.count);
+        __m128 b0 = _mm_load_ps(bp);
+        __m128 b1 = _mm_load_ps(bp + 4);
+        GEMM_SSE2_ROWS(GEMM_SSE2_FMA)
+        bp += GEMM_SSE2_NR;
     }
-    else
+    if (mr == GEMM_SSE2_MR && nr == GEMM_SSE2_NR)
     {
-        nn.activations = NULL;
+        __m128 bias0 = ep.bias ? _mm_loadu_ps(ep.bias) : _mm_setzero_ps();
+        __m128 bias1 = ep.bias ? _mm_loadu_ps(ep.bias + 4) : _mm_setzero_ps();
+        GEMM_SSE2_ROWS(GEMM_SSE2_STORE)
+        return;
     }
+    ML_ALIGNED(16) float tile[GEMM_SSE2_MR * GEMM_SSE2_NR];
+    GEMM_SSE2_ROWS(GEMM_SSE2_SPILL)
+    gemm_store_tile(tile, GEMM_SSE2_NR, c, ldc, mr, nr, accumulate, ep);
+}
 
-    nn.layers[0] = mat_alloc(1, layers[0]);
-    for (size_t i = 0; i < nn.count; i++)
+__attribute__((target("sse2"))) static void gemm_rows_sse2(size_t m, size_t n, size_t k, const float *a, size_t rsa, size_t csa,
+                                                             const float *b, size_t rsb, float *c, size_t ldc, bool accumulate, GemmEpilogue ep)
+{
+    for (size_t i = 0; i < m; i++)
     {
-        nn.weights[i] = mat_alloc(layers[i], layers[i + 1]);
-        nn.biases[i] = mat_alloc(1, layers[i + 1]);
-        if (activations != NULL)
+        const float *rowA = a + i * rsa;
+        float *row = c + i * ldc;
+        size_t j = 0;
+        for (; j + 8 <= n; j += 8)
         {
-            nn.activations[i].type = activations[i];
-            nn.activations[i].activationFunc = getActFunc(activations[i]);
+            __m128 acc0 = accumulate ? _mm_loadu_ps(row + j) : _mm_setzero_ps();
+            __m128 acc1 = accumulate ? _mm_loadu_ps(row + j + 4) : _mm_setzero_ps();
+            for (size_t p = 0; p < k; p++)
+            {
+                __m128 av = _mm_set1_ps(rowA[p * csa]);
+                const float *bRow = b + p * rsb + j;
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(av, _mm_loadu_ps(bRow)));
+                acc1 = _mm_add_ps(acc1, _mm_mul_ps(av, _mm_loadu_ps(bRow + 4)));
+            }
+            gemm_finish_sse2(row + j, acc0, ep.bias ? _mm_loadu_ps(ep.bias + j) : _mm_setzero_ps(), ep.activation);
+            gemm_finish_sse2(row + j + 4, acc1, ep.bias ? _mm_loadu_ps(ep.bias + j + 4) : _mm_setzero_ps(), ep.activation);
+        }
+        for (; j < n; j++)
+        {
+            float acc = accumulate ? row[j] : 0.f;
+            for (size_t p = 0; p < k; p++)
+            {
+                acc += rowA[p * csa] * b[p * rsb + j];
+            }
+            row[j] = activatef(acc + (ep.bias ? ep.bias[j] : 0.f), ep.activation);
         }
-        nn.layers[i + 1] = mat_alloc(1, layers[i + 1]);
     }
-    return nn;
 }
 
-void print_Network(Network nn, const char *name, bool showLayers)
+__attribute__((target("avx2,fma"), always_inline)) static inline __m256 gemm_activate_avx2(__m256 v, ActivationType type)
 {
-    char buff[100];
-    printf("%s = [\n", name);
-    for (size_t i = 0; i < nn.count; i++)
+    switch (type)
     {
-        if (showLayers)
-        {
-            snprintf(buff, sizeof(buff), "%s.layers[%zu]", name, i);
-            print_mat(nn.layers[i], buff, 4, "%f");
-        }
-        snprintf(buff, sizeof(buff), "%s.weights[%zu]", name, i);
-        print_mat(nn.weights[i], buff, 4, "%f");
-        snprintf(buff, sizeof(buff), "%s.biases[%zu]", name, i);
-        print_mat(nn.biases[i], buff, 4, "%f");
-        if (nn.activations)
-        {
-            snprintf(buff, sizeof(buff), "%s.activations[%zu]", name, i);
-            print_activation(nn.activations[i], buff, 4);
-        }
+    case SIGMOID:
+        return sigmoid256_ps(v, mlExpMode);
+    case RELU:
+        return _mm256_max_ps(v, _mm256_setzero_ps());
+    case LEAKYRELU:
+        return _mm256_max_ps(v, _mm256_mul_ps(v, _mm256_set1_ps(0.01f)));
+    default:
+        return v;
     }
-    if (showLayers)
+}
+
+__attribute__((target("avx2,fma"), always_inline)) static inline void gemm_finish_avx2(float *dest, __m256 v, __m256 bias, ActivationType type)
+{
+    if (type == SIGMOID && mlExpMode == EXP_LIBM)
     {
-        snprintf(buff, sizeof(buff), "%s.layers[%zu]", name, nn.count);
-        print_mat(nn.layers[nn.count], buff, 4, "%f");
+        _mm256_storeu_ps(dest, _mm256_add_ps(v, bias));
+        activate_row(dest, 8, type);
+        return;
     }
-    printf("]\n");
+    _mm256_storeu_ps(dest, gemm_activate_avx2(_mm256_add_ps(v, bias), type));
 }
 
-void Network_rand(Network nn, float low, float high)
+#define GEMM_AVX2_INIT(i)                                    \
+    const float *a##i = a + (i < mr ? i : mr - 1) * rsa;     \
+    __m256 c##i##0 = _mm256_setzero_ps();                    \
+    __m256 c##i##1 = _mm256_setzero_ps();
+#define GEMM_AVX2_FMA(i)                                     \
+    {                                                        \
+        __m256 av = _mm256_broadcast_ss(a##i);               \
+        a##i += csa;                                         \
+        c##i##0 = _mm256_fmadd_ps(av, b0, c##i##0);          \
+        c##i##1 = _mm256_fmadd_ps(av, b1, c##i##1);          \
+    }
+#define GEMM_AVX2_STORE(i)                                              \
+    {                                                                   \
+        float *row = c + i * ldc;                                       \
+        if (accumulate)                                                 \
+        {                                                               \
+            c##i##0 = _mm256_add_ps(c##i##0, _mm256_loadu_ps(row));     \
+            c##i##1 = _mm256_add_ps(c##i##1, _mm256_loadu_ps(row + 8)); \
+        }                                                               \
+        gemm_finish_avx2(row, c##i##0, bias0, ep.activation);           \
+        gemm_finish_avx2(row + 8, c##i##1, bias1, ep.activation);       \
+    }
+#define GEMM_AVX2_SPILL(i)                                  \
+    _mm256_store_ps(tile + i * GEMM_AVX2_NR, c##i##0);      \
+    _mm256_store_ps(tile + i * GEMM_AVX2_NR + 8, c##i##1);
+
+__attribute__((target("avx2,fma"))) static void gemm_micro_avx2(size_t kc, const float *a, size_t rsa, size_t csa, const float *bp,
+                                                                  float *c, size_t ldc, size_t mr, size_t nr, bool accumulate, GemmEpilogue ep)
 {
-    for (size_t i = 0; i < nn.count; i++)
+    GEMM_AVX2_ROWS(GEMM_AVX2_INIT)
+    for (size_t p = 0; p < kc; p++)
     {
-        // mat_rand(nn.layers[i], low, high);
-        mat_rand(nn.weights[i], low, high);
-        mat_rand(nn.biases[i], low, high);
+        __m256 b0 = _mm256_load_ps(bp);
+        __m256 b1 = _mm256_load_ps(bp + 8);
+        GEMM_AVX2_ROWS(GEMM_AVX2_FMA)
+        bp += GEMM_AVX2_NR;
+    }
+    if (mr == GEMM_AVX2_MR && nr == GEMM_AVX2_NR)
+    {
+        __m256 bias0 = ep.bias ? _mm256_loadu_ps(ep.bias) : _mm256_setzero_ps();
+        __m256 bias1 = ep.bias ? _mm256_loadu_ps(ep.bias + 8) : _mm256_setzero_ps();
+        GEMM_AVX2_ROWS(GEMM_AVX2_STORE)
+        return;
     }
+    ML_ALIGNED(32) float tile[GEMM_AVX2_MR * GEMM_AVX2_NR];
+    GEMM_AVX2_ROWS(GEMM_AVX2_SPILL)
+    _mm256_zeroupper();
+    gemm_store_tile(tile, GEMM_AVX2_NR, c, ldc, mr, nr, accumulate, ep);
 }
 
-void Network_clear(Network nn)
+// row-vector case (the 1 x N activations of a single sample): each output row
+// stays in registers while the rows of B stream through once
+__attribute__((target("avx2,fma"))) static void gemm_rows_avx2(size_t m, size_t n, size_t k, const float *a, size_t rsa, size_t csa,
+                                                                 const float *b, size_t rsb, float *c, size_t ldc, bool accumulate, GemmEpilogue ep)
 {
-    for (size_t i = 0; i < nn.count; i++)
+    for (size_t i = 0; i < m; i++)
+    {
+        const float *rowA = a + i * rsa;
+        float *row = c + i * ldc;
+        size_t j = 0;
+        for (; j + 32 <= n; j += 32)
+        {
+            __m256 acc0 = accumulate ? _mm256_loadu_ps(row + j) : _mm256_setzero_ps();
+            __m256 acc1 = accumulate ? _mm256_loadu_ps(row + j + 8) : _mm256_setzero_ps();
+            __m256 acc2 = accumulate ? _mm256_loadu_ps(row + j + 16) : _mm256_setzero_ps();
+            __m256 acc3 = accumulate ? _mm256_loadu_ps(row + j + 24) : _mm256_setzero_ps();
+            for (size_t p = 0; p < k; p++)
+            {
+                __m256 av = _mm256_broadcast_ss(rowA + p * csa);
+                const float *bRow = b + p * rsb + j;
+                acc0 = _mm256_fmadd_ps(av, _mm256_loadu_ps(bRow), acc0);
+                acc1 = _mm256_fmadd_ps(av, _mm256_loadu_ps(bRow + 8), acc1);
+                acc2 = _mm256_fmadd_ps(av, _mm256_loadu_ps(bRow + 16), acc2);
+                acc3 = _mm256_fmadd_ps(av, _mm256_loadu_ps(bRow + 24), acc3);
+            }
+            gemm_finish_avx2(row + j, acc0, ep.bias ? _mm256_loadu_ps(ep.bias + j) : _mm256_setzero_ps(), ep.activation);
+            gemm_finish_avx2(row + j + 8, acc1, ep.bias ? _mm256_loadu_ps(ep.bias + j + 8) : _mm256_setzero_ps(), ep.activation);
+            gemm_finish_avx2(row + j + 16, acc2, ep.bias ? _mm256_loadu_ps(ep.bias + j + 16) : _mm256_setzero_ps(), ep.activation);
+            gemm_finish_avx2(row + j + 24, acc3, ep.bias ? _mm256_loadu_ps(ep.bias + j + 24) : _mm256_setzero_ps(), ep.activation);
+        }
+        for (; j + 8 <= n; j += 8)
+        {
+            __m256 acc = accumulate ? _mm256_loadu_ps(row + j) : _mm256_setzero_ps();
+            for (size_t p = 0; p < k; p++)
+            {
+                acc = _mm256_fmadd_ps(_mm256_broadcast_ss(rowA + p * csa), _mm256_loadu_ps(b + p * rsb + j), acc);
+            }
+            gemm_finish_avx2(row + j, acc, ep.bias ? _mm256_loadu_ps(ep.bias + j) : _mm256_setzero_ps(), ep.activation);
+        }
+        for (; j < n; j++)
+        {
+            float acc = accumulate ? row[j] : 0.f;
+            for (size_t p = 0; p < k; p++)
+            {
+                acc += rowA[p * csa] * b[p * rsb + j];
+            }
+            row[j] = activatef(acc + (ep.bias ? ep.bias[j] : 0.f), ep.activation);
+        }
+    }
+}
+
+static bool cpu_has(GemmKernel kernel)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return kernel == GEMM_GENERIC;
+    if (kernel == GEMM_SSE2)
+        return (edx & bit_SSE2) != 0;
+    if (kernel == GEMM_AVX2)
     {
-        mat_clear(nn.layers[i]);
-        mat_clear(nn.weights[i]);
-        mat_clear(nn.biases[i]);
+        // the OS also has to save the ymm registers on context switches
+        if (!(ecx & bit_AVX) || !(ecx & bit_FMA) || !(ecx & bit_OSXSAVE))
+            return false;
+        unsigned int xcr0, xcr0High;
+        __asm__ volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+        if ((xcr0 & 6) != 6)
+            return false;
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+            return false;
+        return (ebx & bit_AVX2) != 0;
     }
-    mat_clear(nn.layers[nn.count]);
+    return true;
 }
 
-float Network_cost(Network nn, Matrix in, Matrix out)
+#else
+
+static bool cpu_has(GemmKernel kernel)
 {
-    if (NETWORK_IN(nn).cols != in.cols)
-        return -1.f;
-    if (NETWORK_OUT(nn).cols != in.cols)
-        return -1.f;
+    return kernel == GEMM_NAIVE || kernel == GEMM_GENERIC;
+}
 
-    float result = 0.f;
-    for (size_t i = 0; i < in.rows; i++)
+#endif // ML_X86_SIMD
+
+static GemmImpl gemm_impl(GemmKernel kernel)
+{
+    GemmImpl impl = {GEMM_GENERIC, GEMM_GENERIC_MR, GEMM_GENERIC_NR, gemm_micro_generic, gemm_rows_generic};
+#ifdef ML_X86_SIMD
+    if (kernel == GEMM_AVX2)
+    {
+        impl = (GemmImpl){GEMM_AVX2, GEMM_AVX2_MR, GEMM_AVX2_NR, gemm_micro_avx2, gemm_rows_avx2};
+    }
+    else if (kernel == GEMM_SSE2)
     {
-        Matrix in_row = mat_row(in, i);
-        mat_copy(NETWORK_IN(nn), in_row);
-        Network_forward(nn);
+        impl = (GemmImpl){GEMM_SSE2, GEMM_SSE2_MR, GEMM_SSE2_NR, gemm_micro_sse2, gemm_rows_sse2};
+    }
+#endif // ML_X86_SIMD
+    return impl;
+}
 
-        for (size_t j = 0; j < out.cols; j++)
-        {
-            float d = MAT_AT(NETWORK_OUT(nn), 0, j) - MAT_AT(out, i, j);
-            result += d * d;
-        }
+GemmKernel gemm_get_kernel(void)
+{
+    int64_t kernel = ml_atomic_load(&gemmSelectedKernel);
+    if (kernel < 0)
+    {
+        // first caller wins, anyone racing it detects the same kernel anyway
+        int64_t detected = GEMM_GENERIC;
+        if (cpu_has(GEMM_AVX2))
+            detected = GEMM_AVX2;
+        else if (cpu_has(GEMM_SSE2))
+            detected = GEMM_SSE2;
+        ml_atomic_cas(&gemmSelectedKernel, (int64_t)-1, detected);
+        kernel = ml_atomic_load(&gemmSelectedKernel);
     }
+    return (GemmKernel)kernel;
+}
 
-    return result / in.rows;
+bool gemm_set_kernel(GemmKernel kernel)
+{
+    if (!cpu_has(kernel))
+        return false;
+    ml_atomic_store(&gemmSelectedKernel, (int64_t)kernel);
+    return true;
 }
 
-float Network_cross_entropy_cost(Network nn, Step *steps[], size_t stepAmount)
+const char *gemm_kernel_name(GemmKernel kernel)
 {
-    float cost = 0.f;
-    for (size_t i = 0; i < stepAmount; i++)
+    switch (kernel)
     {
-        float prob = steps[i]->probability;
-        if (steps[i]->reward != 0 && prob > 0)
-        {
-            cost += steps[i]->reward * -log(prob);
-        }
+    case GEMM_NAIVE:
+        return "naive";
+    case GEMM_GENERIC:
+        return "generic";
+    case GEMM_SSE2:
+        return "SSE2";
+    case GEMM_AVX2:
+        return "AVX2+FMA";
+    default:
+        return NULL;
     }
-    return cost;
 }
 
-void Network_forward(Network nn)
+void gemm_f32(size_t m, size_t n, size_t k,
+              const float *a, size_t rsa, size_t csa,
+              const float *b, size_t rsb, size_t csb,
+              float *c, size_t ldc, bool accumulate)
 {
-    for (size_t i = 0; i < nn.count; i++)
+    gemm_f32_fused(m, n, k, a, rsa, csa, b, rsb, csb, c, ldc, accumulate, NULL, LINEAR);
+}
+
+static void gemm_naive(size_t m, size_t n, size_t k,
+                       const float *a, size_t rsa, size_t csa,
+                       const float *b, size_t rsb, size_t csb,
+                       float *c, size_t ldc, bool accumulate, GemmEpilogue ep)
+{
+    for (size_t i = 0; i < m; i++)
     {
-        mat_dot(nn.layers[i + 1], nn.layers[i], nn.weights[i]);
-        mat_sum(nn.layers[i + 1], nn.biases[i]);
-        if (nn.activations)
+        for (size_t j = 0; j < n; j++)
         {
-            if (nn.activations[i].type == SOFTMAX)
+            float acc = accumulate ? c[i * ldc + j] : 0.f;
+            for (size_t p = 0; p < k; p++)
             {
-                softmaxf(nn.layers[i + 1]);
-            }
-            else if (nn.activations[i].activationFunc)
-            {
-                mat_activate(nn.layers[i + 1], nn.activations[i].activationFunc);
+                acc += a[i * rsa + p * csa] * b[p * rsb + j * csb];
             }
+            c[i * ldc + j] = acc;
         }
+        gemm_epilogue_row(c + i * ldc, n, ep);
     }
 }
 
-void Network_diff(Network nn, Network g, float eps, Matrix in, Matrix out)
+// C = act(A * B + bias), the bias add and activation run on each register tile
+// right before it is stored instead of as extra passes over C
+void gemm_f32_fused(size_t m, size_t n, size_t k,
+                    const float *a, size_t rsa, size_t csa,
+                    const float *b, size_t rsb, size_t csb,
+                    float *c, size_t ldc, bool accumulate,
+                    const float *bias, ActivationType activation)
 {
-    if (in.rows != out.rows)
+    GemmEpilogue ep = {bias, activation};
+    GemmEpilogue none = {NULL, LINEAR};
+    if (m == 0 || n == 0)
         return;
-    if (!mat_same(NETWORK_IN(nn), mat_row(in, 0)))
+    if (k == 0)
+    {
+        for (size_t i = 0; i < m; i++)
+        {
+            if (!accumulate)
+                memset(c + i * ldc, 0, sizeof(*c) * n);
+            gemm_epilogue_row(c + i * ldc, n, ep);
+        }
         return;
-    if (!mat_same(NETWORK_OUT(nn), mat_row(out, 0)))
+    }
+
+    GemmKernel kernel = gemm_get_kernel();
+    if (kernel == GEMM_NAIVE)
+    {
+        gemm_naive(m, n, k, a, rsa, csa, b, rsb, csb, c, ldc, accumulate, ep);
         return;
-    if (!Network_same(nn, g))
+    }
+
+    GemmImpl impl = gemm_impl(kernel);
+    // too few rows to amortize packing B, stream it instead
+    if (m < impl.mr && csb == 1)
+    {
+        impl.rows(m, n, k, a, rsa, csa, b, rsb, c, ldc, accumulate, ep);
         return;
+    }
 
-    float saved;
-    float cost = Network_cost(nn, in, out);
-    for (size_t i = 0; i < nn.count; i++)
+    float *packed = gemm_pack_buffer();
+    if (!packed)
     {
-        Matrix weights = nn.weights[i];
-        for (size_t j = 0; j < weights.rows; j++)
-        {
-            for (size_t k = 0; k < weights.cols; k++)
-            {
-                saved = MAT_AT(weights, j, k);
-                MAT_AT(weights, j, k) += eps;
-                float newCost = Network_cost(nn, in, out);
-                MAT_AT(g.weights[i], j, k) = (newCost - cost) / eps;
-                MAT_AT(weights, j, k) = saved;
-            }
-        }
+        // no memory for the packed panels, the naive loop still gets the right answer
+        gemm_naive(m, n, k, a, rsa, csa, b, rsb, csb, c, ldc, accumulate, ep);
+        return;
+    }
 
-        Matrix biases = nn.biases[i];
-        for (size_t j = 0; j < biases.rows; j++)
+    for (size_t jc = 0; jc < n; jc += GEMM_NC)
+    {
+        size_t nc = (n - jc < GEMM_NC) ? n - jc : GEMM_NC;
+        for (size_t pc = 0; pc < k; pc += GEMM_KC)
         {
-            for (size_t k = 0; k < biases.cols; k++)
+            size_t kc = (k - pc < GEMM_KC) ? k - pc : GEMM_KC;
+            bool acc = accumulate || pc > 0;
+            bool last = pc + kc == k;
+            gemm_pack_b(kc, nc, b + pc * rsb + jc * csb, rsb, csb, impl.nr, packed);
+
+            for (size_t ic = 0; ic < m; ic += GEMM_MC)
             {
-                saved = MAT_AT(biases, j, k);
-                MAT_AT(biases, j, k) += eps;
-                float newCost = Network_cost(nn, in, out);
-                MAT_AT(g.biases[i], j, k) = (newCost - cost) / eps;
-                MAT_AT(biases, j, k) = saved;
+                size_t mc = (m - ic < GEMM_MC) ? m - ic : GEMM_MC;
+                for (size_t jr = 0; jr < nc; jr += impl.nr)
+                {
+                    size_t nr = (nc - jr < impl.nr) ? nc - jr : impl.nr;
+                    const float *panel = packed + (jr / impl.nr) * kc * impl.nr;
+                    GemmEpilogue tileEp = none;
+                    if (last)
+                    {
+                        tileEp.bias = bias ? bias + jc + jr : NULL;
+                        tileEp.activation = activation;
+                    }
+                    for (size_t ir = 0; ir < mc; ir += impl.mr)
+                    {
+                        size_t mr = (mc - ir < impl.mr) ? mc - ir : impl.mr;
+                        size_t row = ic + ir;
+                        impl.micro(kc, a + row * rsa + pc * csa, rsa, csa, panel,
+                                   c + row * ldc + jc + jr, ldc, mr, nr, acc, tileEp);
+                    }
+                }
             }
         }
     }
 }
 
-void Network_policy_gradient_diff(Network nn, Network g, float eps, Step *steps[], size_t stepAmount)
+double ml_seconds(void)
 {
-    if (NETWORK_IN(nn).cols != steps[0]->state.cols)
-        return;
-    if (!Network_same(nn, g))
-        return;
+#if defined(_WIN32) || defined(_WIN64)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
 
-    float saved;
-    float cost = Network_cross_entropy_cost(nn, steps, stepAmount);
-    for (size_t i = 0; i < nn.count; i++)
+// times C = A * B for a rows x inner by inner x cols product with the original
+// loop and every kernel this CPU supports, and prints GFLOP/s for each
+void mat_dot_benchmark(size_t rows, size_t inner, size_t cols, size_t repeats)
+{
+    Matrix a = mat_alloc(rows, inner);
+    Matrix b = mat_alloc(inner, cols);
+    Matrix reference = mat_alloc(rows, cols);
+    Matrix c = mat_alloc(rows, cols);
+    mat_rand(a, -1.f, 1.f);
+    mat_rand(b, -1.f, 1.f);
+    if (repeats == 0)
+        repeats = 1;
+
+    GemmKernel saved = gemm_get_kernel();
+    double flops = 2.0 * (double)rows * (double)inner * (double)cols * (double)repeats;
+    printf("mat_dot %zux%zu * %zux%zu, %zu repeats\n", rows, inner, inner, cols, repeats);
+
+    double start = ml_seconds();
+    for (size_t r = 0; r < repeats; r++)
     {
-        Matrix weights = nn.weights[i];
-        for (size_t j = 0; j < weights.rows; j++)
+        mat_dot_naive(reference, a, b);
+    }
+    double naiveTime = ml_seconds() - start;
+    printf("    %-10s %8.3f GFLOP/s\n", "loop", flops / naiveTime * 1e-9);
+
+    GemmKernel kernels[] = {GEMM_GENERIC, GEMM_SSE2, GEMM_AVX2};
+    for (size_t i = 0; i < ARR_LEN(kernels); i++)
+    {
+        if (!gemm_set_kernel(kernels[i]))
+            continue;
+        mat_dot(c, a, b); // warm up the pack buffer
+        start = ml_seconds();
+        for (size_t r = 0; r < repeats; r++)
         {
-            for (size_t k = 0; k < weights.cols; k++)
-            {
-                saved = MAT_AT(weights, j, k);
-                MAT_AT(weights, j, k) += eps;
-                float newCost = Network_cross_entropy_cost(nn, steps, stepAmount);
-                MAT_AT(g.weights[i], j, k) = (newCost - cost) / eps;
-                MAT_AT(weights, j, k) = saved;
-            }
+            mat_dot(c, a, b);
         }
+        double time = ml_seconds() - start;
 
-        Matrix biases = nn.biases[i];
-        for (size_t k = 0; k < biases.cols; k++)
+        float maxError = 0.f;
+        for (size_t y = 0; y < rows; y++)
         {
-            saved = MAT_AT(biases, 0, k);
-            MAT_AT(biases, 0, k) += eps;
-            float newCost = Network_cross_entropy_cost(nn, steps, stepAmount);
-            MAT_AT(g.biases[i], 0, k) = (newCost - cost) / eps;
-            MAT_AT(biases, 0, k) = saved;
+            for (size_t x = 0; x < cols; x++)
+            {
+                float d = fabsf(MAT_AT(c, y, x) - MAT_AT(reference, y, x));
+                if (d > maxError)
+                    maxError = d;
+            }
         }
+        printf("    %-10s %8.3f GFLOP/s  %6.2fx  max error %g\n", gemm_kernel_name(kernels[i]),
+               flops / time * 1e-9, naiveTime / time, maxError);
     }
+    gemm_set_kernel(saved);
+
+    mat_free(a);
+    mat_free(b);
+    mat_free(reference);
+    mat_free(c);
 }
 
-void Network_backprop(Network nn, Network g, Matrix in, Matrix out)
+// dest = act(a * b + bias) in one pass over dest, bias is a single row
+void mat_dot_bias_act(Matrix dest, Matrix a, Matrix b, Matrix bias, ActivationType activation)
 {
-    if (in.rows != out.rows)
+    if (a.cols != b.rows)
         return;
-    if (!mat_same(NETWORK_IN(nn), mat_row(in, 0)))
+    if (dest.rows != a.rows)
         return;
-    if (!mat_same(NETWORK_OUT(nn), mat_row(out, 0)))
+    if (dest.cols != b.cols)
         return;
-    if (!Network_same(nn, g))
+    if (bias.rows != 1 || bias.cols != dest.cols)
         return;
-    size_t n = in.rows; // amount of samples
 
-    Network_clear(g);
+    gemm_f32_fused(dest.rows, dest.cols, a.cols,
+                   a.es, a.stride, 1,
+                   b.es, b.stride, 1,
+                   dest.es, dest.stride, false,
+                   bias.es, activation);
+}
 
-    // i = current sample
-    // l = current layer
-    // j = current "node"
-    // k = previous "node"
+// dest (+)= op(a) * op(b), where op transposes its matrix when the flag is set
+void mat_dot_ex(Matrix dest, Matrix a, bool transA, Matrix b, bool transB, bool accumulate)
+{
+    size_t m = transA ? a.cols : a.rows;
+    size_t k = transA ? a.rows : a.cols;
+    size_t n = transB ? b.rows : b.cols;
+    if ((transB ? b.cols : b.rows) != k)
+        return;
+    if (dest.rows != m || dest.cols != n)
+        return;
 
-    for (size_t i = 0; i < n; i++)
-    {
-        mat_copy(NETWORK_IN(nn), mat_row(in, i));
-        Network_forward(nn);
+    gemm_f32(m, n, k,
+             a.es, transA ? 1 : a.stride, transA ? a.stride : 1,
+             b.es, transB ? 1 : b.stride, transB ? b.stride : 1,
+             dest.es, dest.stride, accumulate);
+}
 
-        for (size_t j = 0; j <= g.count; j++)
+void mat_sum(Matrix dest, Matrix src)
+{
+    if (!mat_same(dest, src))
+        return;
+
+    for (size_t i = 0; i < dest.rows; i++)
+    {
+        for (size_t j = 0; j < dest.cols; j++)
         {
-            mat_clear(g.layers[j]);
+            MAT_AT(dest, i, j) += MAT_AT(src, i, j);
         }
+    }
+}
 
-        for (size_t j = 0; j < out.cols; j++)
+// sums every column of src into the single row of dest
+void mat_col_sum(Matrix dest, Matrix src, bool accumulate)
+{
+    if (dest.rows != 1 || dest.cols != src.cols)
+        return;
+
+    if (!accumulate)
+        mat_clear(dest);
+    for (size_t i = 0; i < src.rows; i++)
+    {
+        for (size_t j = 0; j < src.cols; j++)
         {
-#ifdef TRAD_BACKPROP
-            MAT_AT(NETWORK_OUT(g), 0, j) = 2 * (MAT_AT(NETWORK_OUT(nn), 0, j) - MAT_AT(out, i, j));
-#else
-            MAT_AT(NETWORK_OUT(g), 0, j) = (MAT_AT(NETWORK_OUT(nn), 0, j) - MAT_AT(out, 0, j));
-#endif // TRAD_BACKPROP
+            MAT_AT(dest, 0, j) += MAT_AT(src, i, j);
         }
+    }
+}
 
-#ifdef TRAD_BACKPROP
-        float s = 1.f;
-#else
-        float s = 2.f;
-#endif // TRAD_BACKPROP
-
-        for (size_t l = nn.count; l > 0; l--)
+// row = bias + sum of values[e] * b[indices[e]], the sparse counterpart of a gemm row
+static void sparse_row_generic(float *row, const float *bias, const uint32_t *indices, const float *values, size_t count,
+                               const float *b, size_t ldb, size_t n)
+{
+    memcpy(row, bias, sizeof(*row) * n);
+    for (size_t e = 0; e < count; e++)
+    {
+        float v = values[e];
+        const float *w = b + indices[e] * ldb;
+        for (size_t j = 0; j < n; j++)
         {
-            for (size_t j = 0; j < nn.layers[l].cols; j++)
-            {
-                float outputAhead = MAT_AT(nn.layers[l], 0, j);
-                float derivativeAhead = MAT_AT(g.layers[l], 0, j);
-                float activationDerivative = 1.f;
-                if (nn.activations && nn.activations[l].activationFunc)
-                {
-                    float (*derivativeFunc)(float) = getActDerivative(nn.activations[l].type);
-                    if (derivativeFunc)
-                    {
-                        activationDerivative = derivativeFunc(outputAhead);
-                    }
-                }
-                float fullDerivative = (s * derivativeAhead * activationDerivative);
-                MAT_AT(g.biases[l - 1], 0, j) += (fullDerivative);
+            row[j] += v * w[j];
+        }
+    }
+}
 
-                for (size_t k = 0; k < nn.layers[l - 1].cols; k++)
-                {
-                    // j - weights matrix col
-                    // k = weights matrix row
-                    float prevInput = MAT_AT(nn.layers[l - 1], 0, k);
-                    MAT_AT(g.weights[l - 1], k, j) += (fullDerivative * prevInput);
+static void axpy_generic(float *y, const float *x, float a, size_t n)
+{
+    for (size_t j = 0; j < n; j++)
+    {
+        y[j] += a * x[j];
+    }
+}
 
-                    float prevWeight = MAT_AT(nn.weights[l - 1], k, j);
-                    MAT_AT(g.layers[l - 1], 0, k) += (fullDerivative * prevWeight);
-                }
-            }
+#ifdef ML_X86_SIMD
+
+// 32 columns stay in four registers while the nonzeros stream past
+__attribute__((target("avx2,fma"))) static void sparse_row_avx2(float *row, const float *bias, const uint32_t *indices, const float *values, size_t count,
+                                                                  const float *b, size_t ldb, size_t n)
+{
+    size_t j = 0;
+    for (; j + 32 <= n; j += 32)
+    {
+        __m256 acc0 = _mm256_loadu_ps(bias + j);
+        __m256 acc1 = _mm256_loadu_ps(bias + j + 8);
+        __m256 acc2 = _mm256_loadu_ps(bias + j + 16);
+        __m256 acc3 = _mm256_loadu_ps(bias + j + 24);
+        for (size_t e = 0; e < count; e++)
+        {
+            __m256 v = _mm256_broadcast_ss(values + e);
+            const float *w = b + indices[e] * ldb + j;
+            acc0 = _mm256_fmadd_ps(v, _mm256_loadu_ps(w), acc0);
+            acc1 = _mm256_fmadd_ps(v, _mm256_loadu_ps(w + 8), acc1);
+            acc2 = _mm256_fmadd_ps(v, _mm256_loadu_ps(w + 16), acc2);
+            acc3 = _mm256_fmadd_ps(v, _mm256_loadu_ps(w + 24), acc3);
         }
+        _mm256_storeu_ps(row + j, acc0);
+        _mm256_storeu_ps(row + j + 8, acc1);
+        _mm256_storeu_ps(row + j + 16, acc2);
+        _mm256_storeu_ps(row + j + 24, acc3);
     }
-
-    for (size_t i = 0; i < g.count; i++)
+    for (; j + 8 <= n; j += 8)
     {
-        Matrix curWeights = g.weights[i];
-        for (size_t j = 0; j < curWeights.rows; j++)
+        // two chains so consecutive nonzeros do not wait on each other
+        __m256 acc0 = _mm256_loadu_ps(bias + j);
+        __m256 acc1 = _mm256_setzero_ps();
+        size_t e = 0;
+        for (; e + 2 <= count; e += 2)
         {
-            for (size_t k = 0; k < curWeights.cols; k++)
-            {
-                MAT_AT(curWeights, j, k) /= n;
-            }
+            acc0 = _mm256_fmadd_ps(_mm256_broadcast_ss(values + e), _mm256_loadu_ps(b + indices[e] * ldb + j), acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_broadcast_ss(values + e + 1), _mm256_loadu_ps(b + indices[e + 1] * ldb + j), acc1);
         }
-
-        Matrix curBiases = g.biases[i];
-        for (size_t k = 0; k < curBiases.cols; k++)
+        if (e < count)
+            acc0 = _mm256_fmadd_ps(_mm256_broadcast_ss(values + e), _mm256_loadu_ps(b + indices[e] * ldb + j), acc0);
+        _mm256_storeu_ps(row + j, _mm256_add_ps(acc0, acc1));
+    }
+    for (; j < n; j++)
+    {
+        float acc = bias[j];
+        for (size_t e = 0; e < count; e++)
         {
-            MAT_AT(curBiases, 0, k) /= n;
+            acc += values[e] * b[indices[e] * ldb + j];
         }
+        row[j] = acc;
     }
 }
 
-void Network_policy_gradient_backprop(Network nn, Network g, Step *steps[], size_t stepAmount)
+__attribute__((target("avx2,fma"))) static void axpy_avx2(float *y, const float *x, float a, size_t n)
 {
-    if (NETWORK_IN(nn).cols != steps[0]->state.cols)
-        return;
-    if (!Network_same(nn, g))
-        return;
-    size_t n = stepAmount; // amount of steps
+    __m256 av = _mm256_set1_ps(a);
+    size_t j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        _mm256_storeu_ps(y + j, _mm256_fmadd_ps(av, _mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j)));
+    }
+    for (; j < n; j++)
+    {
+        y[j] += a * x[j];
+    }
+}
 
-    Network_clear(g);
+#endif // ML_X86_SIMD
 
-    // float cumulativeRewards[n];
-    // cumulativeRewards[n - 1] = steps[n - 1]->reward;
-    // for (int i = n - 2; i >= 0; i--)
-    // {
-    //     cumulativeRewards[i] = steps[i]->reward + 0.9 * cumulativeRewards[i + 1];
-    // }
+// room for maxRows rows and capacity nonzeros, rows is set by the fill functions
+SparseRows sparse_alloc(size_t maxRows, size_t cols, size_t capacity)
+{
+    SparseRows sp = {
+        .rows = 0,
+        .cols = cols,
+        .rowStart = (size_t *)calloc(maxRows + 1, sizeof(size_t)),
+        .indices = (uint32_t *)malloc(sizeof(uint32_t) * capacity),
+        .values = (float *)malloc(sizeof(float) * capacity),
+        .capacity = capacity,
+    };
+    return sp;
+}
 
-    for (size_t i = 0; i < n; i++)
-    {
-        mat_copy(NETWORK_IN(nn), steps[i]->state);
-        Network_forward(nn);
+void sparse_free(SparseRows sp)
+{
+    free(sp.rowStart);
+    free(sp.indices);
+    free(sp.values);
+}
 
-        for (size_t j = 0; j <= g.count; j++)
-        {
-            mat_clear(g.layers[j]);
-        }
+void sparse_from_dense(SparseRows *dest, Matrix src)
+{
+    if (src.cols != dest->cols || src.rows * src.cols > dest->capacity)
+        return;
 
-        for (size_t j = 0; j < NETWORK_OUT(nn).cols; j++)
+    size_t nnz = 0;
+    for (size_t i = 0; i < src.rows; i++)
+    {
+        dest->rowStart[i] = nnz;
+        for (size_t j = 0; j < src.cols; j++)
         {
-            float P_k = MAT_AT(NETWORK_OUT(nn), 0, j);
-            MAT_AT(NETWORK_OUT(g), 0, j) = (P_k - (steps[i]->action == j ? 1 : 0)) * steps[i]->reward;
+            // always written, only kept when nonzero, so there is no branch to mispredict
+            float v = MAT_AT(src, i, j);
+            dest->indices[nnz] = (uint32_t)j;
+            dest->values[nnz] = v;
+            nnz += v != 0.f;
         }
+    }
+    dest->rowStart[src.rows] = nnz;
+    dest->rows = src.rows;
+}
 
-        for (size_t l = nn.count; l > 0; l--)
+// every code is decoded through codeValues and kept only when the value is nonzero
+void sparse_from_trajectory(SparseRows *dest, Trajectory t, size_t first, size_t rows)
+{
+    if (t.stateLen != dest->cols || rows * t.stateLen > dest->capacity || first + rows > t.count)
+        return;
+
+    // only when code 0 decodes to 0: a group of eight codes that are all 0 is skipped
+    // with one load. Any other group, or every group when code 0 decodes to a nonzero,
+    // is decoded code by code below
+    bool skipZero = t.codeValues[0] == 0.f;
+    size_t nnz = 0;
+    for (size_t i = 0; i < rows; i++)
+    {
+        dest->rowStart[i] = nnz;
+        const uint8_t *codes = Trajectory_state(t, first + i);
+        for (size_t j = 0; j < t.stateLen; j += 8)
         {
-            for (size_t j = 0; j < nn.layers[l].cols; j++)
+            size_t end = (j + 8 < t.stateLen) ? j + 8 : t.stateLen;
+            if (skipZero && end - j == 8)
             {
-                float outputAhead = MAT_AT(nn.layers[l], 0, j);
-                float derivativeAhead = MAT_AT(g.layers[l], 0, j);
-                float activationDerivative = 1.f;
-                if (nn.activations && nn.activations[l].activationFunc)
-                {
-                    float (*derivativeFunc)(float) = getActDerivative(nn.activations[l].type);
-                    if (derivativeFunc)
-                    {
-                        activationDerivative = derivativeFunc(outputAhead);
-                    }
-                }
-                float fullDerivative = (derivativeAhead * activationDerivative);
-                MAT_AT(g.biases[l - 1], 0, j) += (fullDerivative);
-
-                for (size_t k = 0; k < nn.layers[l - 1].cols; k++)
-                {
-                    // j - weights matrix col
-                    // k = weights matrix row
-                    float prevInput = MAT_AT(nn.layers[l - 1], 0, k);
-                    MAT_AT(g.weights[l - 1], k, j) += (fullDerivative * prevInput);
-
-                    float prevWeight = MAT_AT(nn.weights[l - 1], k, j);
-                    MAT_AT(g.layers[l - 1], 0, k) += (fullDerivative * prevWeight);
-                }
+                uint64_t word;
+                memcpy(&word, codes + j, sizeof(word));
+                if (word == 0)
+                    continue;
+            }
+            for (size_t q = j; q < end; q++)
+            {
+                float v = t.codeValues[codes[q]];
+                dest->indices[nnz] = (uint32_t)q;
+                dest->values[nnz] = v;
+                nnz += v != 0.f;
             }
         }
     }
+    dest->rowStart[rows] = nnz;
+    dest->rows = rows;
+}
 
-    for (size_t i = 0; i < g.count; i++)
+// dest = activation(a * b + bias), every nonzero adds one scaled row of b
+void mat_dot_sparse_bias_act(Matrix dest, SparseRows a, Matrix b, Matrix bias, ActivationType activation)
+{
+    if (a.cols != b.rows)
+        return;
+    if (dest.rows != a.rows)
+        return;
+    if (dest.cols != b.cols)
+        return;
+    if (bias.rows != 1 || bias.cols != dest.cols)
+        return;
+
+    void (*kernel)(float *, const float *, const uint32_t *, const float *, size_t, const float *, size_t, size_t) = sparse_row_generic;
+#ifdef ML_X86_SIMD
+    if (gemm_get_kernel() == GEMM_AVX2)
+        kernel = sparse_row_avx2;
+#endif // ML_X86_SIMD
+    for (size_t i = 0; i < a.rows; i++)
     {
-        Matrix curWeights = g.weights[i];
-        for (size_t j = 0; j < curWeights.rows; j++)
-        {
-            for (size_t k = 0; k < curWeights.cols; k++)
-            {
-                MAT_AT(curWeights, j, k) /= n;
-            }
-        }
+        size_t start = a.rowStart[i];
+        kernel(&MAT_AT(dest, i, 0), bias.es, a.indices + start, a.values + start, a.rowStart[i + 1] - start,
+               b.es, b.stride, dest.cols);
+    }
+    if (activation == SOFTMAX)
+        softmaxf(dest);
+    else
+        for (size_t i = 0; i < dest.rows; i++)
+            activate_row(&MAT_AT(dest, i, 0), dest.cols, activation);
+}
 
-        Matrix curBiases = g.biases[i];
-        for (size_t k = 0; k < curBiases.cols; k++)
+// dest (+)= a^T * b, only the rows of dest that some nonzero touches are written
+void mat_dot_sparse_tn(Matrix dest, SparseRows a, Matrix b, bool accumulate)
+{
+    if (a.rows != b.rows)
+        return;
+    if (dest.rows != a.cols)
+        return;
+    if (dest.cols != b.cols)
+        return;
+
+    void (*axpy)(float *, const float *, float, size_t) = axpy_generic;
+#ifdef ML_X86_SIMD
+    if (gemm_get_kernel() == GEMM_AVX2)
+        axpy = axpy_avx2;
+#endif // ML_X86_SIMD
+    if (!accumulate)
+        mat_clear(dest);
+    for (size_t i = 0; i < a.rows; i++)
+    {
+        const float *src = &MAT_AT(b, i, 0);
+        for (size_t e = a.rowStart[i]; e < a.rowStart[i + 1]; e++)
         {
-            MAT_AT(curBiases, 0, k) /= n;
+            axpy(&MAT_AT(dest, a.indices[e], 0), src, a.values[e], dest.cols);
         }
     }
 }
 
-void Network_gradient_descent(Network nn, Network g, float rate)
+void mat_sig(Matrix m)
 {
-    if (!Network_same(nn, g))
-        return;
-
-    for (size_t i = 0; i < nn.count; i++)
+    for (size_t i = 0; i < m.rows; i++)
     {
-        Matrix weights = nn.weights[i];
-        for (size_t j = 0; j < weights.rows; j++)
+        for (size_t j = 0; j < m.cols; j++)
         {
-            for (size_t k = 0; k < weights.cols; k++)
-            {
-                MAT_AT(weights, j, k) -= rate * MAT_AT(g.weights[i], j, k);
-            }
+            MAT_AT(m, i, j) = sigmoidf(MAT_AT(m, i, j));
         }
+    }
+}
 
-        Matrix biases = nn.biases[i];
-        for (size_t k = 0; k < biases.cols; k++)
+void mat_activate(Matrix m, float (*actFunc)(float))
+{
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        for (size_t j = 0; j < m.cols; j++)
         {
-            MAT_AT(biases, 0, k) -= rate * MAT_AT(g.biases[i], 0, k);
+            MAT_AT(m, i, j) = actFunc(MAT_AT(m, i, j));
         }
     }
 }
 
-void Network_gradient_ascent(Network nn, Network g, float rate)
+void mat_activate_type(Matrix m, ActivationType type)
 {
-    if (!Network_same(nn, g))
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        activate_row(&MAT_AT(m, i, 0), m.cols, type);
+    }
+}
+
+void mat_rand(Matrix m, float low, float high)
+{
+    Rng *rng = Rng_thread();
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        Rng_fill_uniform(rng, &MAT_AT(m, i, 0), m.cols, low, high);
+    }
+}
+
+void mat_randn(Matrix m, float mean, float stddev)
+{
+    Rng *rng = Rng_thread();
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        Rng_fill_normal(rng, &MAT_AT(m, i, 0), m.cols, mean, stddev);
+    }
+}
+
+Matrix mat_row(Matrix src, size_t row)
+{
+    Matrix m;
+    m.rows = 1;
+    m.cols = src.cols;
+    m.stride = src.stride;
+    m.es = &MAT_AT(src, row, 0);
+    return m;
+}
+
+// view of count consecutive rows starting at row
+Matrix mat_rows(Matrix src, size_t row, size_t count)
+{
+    Matrix m;
+    m.rows = count;
+    m.cols = src.cols;
+    m.stride = src.stride;
+    m.es = &MAT_AT(src, row, 0);
+    return m;
+}
+
+Matrix mat_col(Matrix src, size_t col)
+{
+    Matrix m;
+    m.rows = src.rows;
+    m.cols = 1;
+    m.stride = src.stride;
+    m.es = &MAT_AT(src, 0, col);
+    return m;
+}
+
+void mat_copy(Matrix dest, Matrix src)
+{
+    if (!mat_same(dest, src))
         return;
 
-    for (size_t i = 0; i < nn.count; i++)
+    for (size_t i = 0; i < dest.rows; i++)
     {
-        Matrix weights = nn.weights[i];
-        for (size_t j = 0; j < weights.rows; j++)
+        for (size_t j = 0; j < dest.cols; j++)
         {
-            for (size_t k = 0; k < weights.cols; k++)
-            {
-                MAT_AT(weights, j, k) += rate * MAT_AT(g.weights[i], j, k);
-            }
+            MAT_AT(dest, i, j) = MAT_AT(src, i, j);
         }
+    }
+}
 
-        Matrix biases = nn.biases[i];
-        for (size_t k = 0; k < biases.cols; k++)
+void mat_clear(Matrix m)
+{
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        for (size_t j = 0; j < m.cols; j++)
         {
-            MAT_AT(biases, 0, k) += rate * MAT_AT(g.biases[i], 0, k);
+            MAT_AT(m, i, j) = 0;
         }
     }
 }
 
+Matrix mat_alloc(size_t rows, size_t cols)
+{
+    Matrix m;
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = cols;
+    m.es = (float *)calloc(rows * cols, sizeof(*m.es));
+    return m;
+}
+
+void mat_free(Matrix m)
+{
+    free(m.es);
+}
+
+bool mat_same(Matrix a, Matrix b)
+{
+    return ((a.rows == b.rows) && (a.cols == b.cols));
+}
+
+// states, actions, rewards, probabilities and the code table share one aligned block
+Trajectory Trajectory_alloc(size_t capacity, size_t stateLen, const float *codeValues, size_t codeCount)
+{
+    Trajectory t = {0};
+    size_t tableSize = ML_ALIGN_FLOATS(256) * sizeof(float);
+    size_t floatsSize = ML_ALIGN_FLOATS(capacity) * sizeof(float);
+    size_t statesSize = (capacity * stateLen + ML_ALIGNMENT - 1) & ~(size_t)(ML_ALIGNMENT - 1);
+    char *block = (char *)ml_aligned_alloc(ML_ALIGNMENT, tableSize + 3 * floatsSize + statesSize + 2 * capacity);
+    if (!block)
+        return t;
+    memset(block, 0, tableSize + 3 * floatsSize + statesSize + 2 * capacity);
+
+    t.codeValues = (float *)block;
+    t.rewards = (float *)(block + tableSize);
+    t.returns = (float *)(block + tableSize + floatsSize);
+    t.probabilities = (float *)(block + tableSize + 2 * floatsSize);
+    t.states = (uint8_t *)(block + tableSize + 3 * floatsSize);
+    t.actions = (uint8_t *)(block + tableSize + 3 * floatsSize + statesSize);
+    t.dones = t.actions + capacity;
+    t.stateLen = stateLen;
+    t.capacity = capacity;
+    t.count = 0;
+    for (size_t i = 0; i < codeCount && i < 256; i++)
+    {
+        t.codeValues[i] = codeValues[i];
+    }
+    return t;
+}
+
+void Trajectory_free(Trajectory t)
+{
+    ml_aligned_free(t.codeValues);
+}
+
+uint8_t *Trajectory_state(Trajectory t, size_t step)
+{
+    return &t.states[step * t.stateLen];
+}
+
+// dest.rows states starting at step first, decoded into floats
+void Trajectory_expand(Trajectory t, size_t first, Matrix dest)
+{
+    if (dest.cols != t.stateLen || first + dest.rows > t.count)
+        return;
+
+    for (size_t i = 0; i < dest.rows; i++)
+    {
+        const uint8_t *codes = Trajectory_state(t, first + i);
+        float *row = &MAT_AT(dest, i, 0);
+        for (size_t j = 0; j < dest.cols; j++)
+        {
+            row[j] = t.codeValues[codes[j]];
+        }
+    }
+}
+
+// copies every step of src after the ones in dest, false when they do not fit
+bool Trajectory_append(Trajectory *dest, Trajectory src)
+{
+    if (dest->stateLen != src.stateLen || dest->count + src.count > dest->capacity)
+        return false;
+
+    size_t at = dest->count;
+    memcpy(Trajectory_state(*dest, at), src.states, src.count * src.stateLen);
+    memcpy(dest->actions + at, src.actions, src.count);
+    memcpy(dest->dones + at, src.dones, src.count);
+    memcpy(dest->rewards + at, src.rewards, sizeof(*src.rewards) * src.count);
+    memcpy(dest->returns + at, src.returns, sizeof(*src.returns) * src.count);
+    memcpy(dest->probabilities + at, src.probabilities, sizeof(*src.probabilities) * src.count);
+    dest->count += src.count;
+    return true;
+}
+
+// Returns_* work on steps x envs arrays, row t holds step t of every env, so one reverse
+// pass over the rows handles all envs side by side. dones[t][e] ends the game of env e
+// at step t and nothing after it flows back; bootstrap[e] stands in for what follows the
+// last row, NULL for zero. dones may be NULL, and returns may be rewards
+
+static void returns_discounted_range(const float *rewards, const uint8_t *dones, const float *bootstrap, size_t steps, size_t envs,
+                                     float gamma, float *returns, size_t first)
+{
+    for (size_t e = first; e < envs; e++)
+    {
+        float next = bootstrap ? bootstrap[e] : 0.f;
+        for (size_t t = steps; t > 0; t--)
+        {
+            size_t i = (t - 1) * envs + e;
+            if (dones && dones[i])
+                next = 0.f;
+            next = rewards[i] + gamma * next;
+            returns[i] = next;
+        }
+    }
+}
+
+static void returns_gae_range(const float *rewards, const float *values, const uint8_t *dones, const float *bootstrap, size_t steps,
+                              size_t envs, float gamma, float lambda, float *advantages, float *returns, size_t first)
+{
+    for (size_t e = first; e < envs; e++)
+    {
+        float nextValue = bootstrap ? bootstrap[e] : 0.f;
+        float nextAdvantage = 0.f;
+        for (size_t t = steps; t > 0; t--)
+        {
+            size_t i = (t - 1) * envs + e;
+            if (dones && dones[i])
+            {
+                nextValue = 0.f;
+                nextAdvantage = 0.f;
+            }
+            float delta = rewards[i] + gamma * nextValue - values[i];
+            nextAdvantage = delta + gamma * lambda * nextAdvantage;
+            nextValue = values[i];
+            advantages[i] = nextAdvantage;
+            if (returns)
+                returns[i] = nextAdvantage + values[i];
+        }
+    }
+}
+
+#ifdef ML_X86_SIMD
+
+// 1 where the 8 dones are 0, 0 where they are set
+__attribute__((target("avx2,fma"), always_inline)) static inline __m256 returns_keep_mask(const uint8_t *dones)
+{
+    if (!dones)
+        return _mm256_set1_ps(1.f);
+    __m256i done = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)dones));
+    __m256 zero = _mm256_castsi256_ps(_mm256_cmpeq_epi32(done, _mm256_setzero_si256()));
+    return _mm256_and_ps(zero, _mm256_set1_ps(1.f));
+}
+
+// 8 envs per vector, returns how many envs it covered
+__attribute__((target("avx2,fma"))) static size_t returns_discounted_avx2(const float *rewards, const uint8_t *dones, const float *bootstrap,
+                                                                          size_t steps, size_t envs, float gamma, float *returns)
+{
+    __m256 g = _mm256_set1_ps(gamma);
+    size_t e = 0;
+    for (; e + 8 <= envs; e += 8)
+    {
+        __m256 next = bootstrap ? _mm256_loadu_ps(bootstrap + e) : _mm256_setzero_ps();
+        for (size_t t = steps; t > 0; t--)
+        {
+            size_t i = (t - 1) * envs + e;
+            __m256 keep = returns_keep_mask(dones ? dones + i : NULL);
+            next = _mm256_fmadd_ps(_mm256_mul_ps(g, keep), next, _mm256_loadu_ps(rewards + i));
+            _mm256_storeu_ps(returns + i, next);
+        }
+    }
+    return e;
+}
+
+__attribute__((target("avx2,fma"))) static size_t returns_gae_avx2(const float *rewards, const float *values, const uint8_t *dones,
+                                                                   const float *bootstrap, size_t steps, size_t envs, float gamma,
+                                                                   float lambda, float *advantages, float *returns)
+{
+    __m256 g = _mm256_set1_ps(gamma);
+    __m256 gl = _mm256_set1_ps(gamma * lambda);
+    size_t e = 0;
+    for (; e + 8 <= envs; e += 8)
+    {
+        __m256 nextValue = bootstrap ? _mm256_loadu_ps(bootstrap + e) : _mm256_setzero_ps();
+        __m256 nextAdvantage = _mm256_setzero_ps();
+        for (size_t t = steps; t > 0; t--)
+        {
+            size_t i = (t - 1) * envs + e;
+            __m256 keep = returns_keep_mask(dones ? dones + i : NULL);
+            __m256 value = _mm256_loadu_ps(values + i);
+            __m256 delta = _mm256_sub_ps(_mm256_fmadd_ps(_mm256_mul_ps(g, keep), nextValue, _mm256_loadu_ps(rewards + i)), value);
+            nextAdvantage = _mm256_fmadd_ps(_mm256_mul_ps(gl, keep), nextAdvantage, delta);
+            nextValue = value;
+            _mm256_storeu_ps(advantages + i, nextAdvantage);
+            if (returns)
+                _mm256_storeu_ps(returns + i, _mm256_add_ps(nextAdvantage, value));
+        }
+    }
+    return e;
+}
+
+#endif // ML_X86_SIMD
+
+// G[t] = rewards[t] + gamma * G[t + 1], cut at dones
+void Returns_discounted(const float *rewards, const uint8_t *dones, const float *bootstrap, size_t steps, size_t envs, float gamma, float *returns)
+{
+    size_t done = 0;
+#ifdef ML_X86_SIMD
+    if (gemm_get_kernel() == GEMM_AVX2)
+        done = returns_discounted_avx2(rewards, dones, bootstrap, steps, envs, gamma, returns);
+#endif // ML_X86_SIMD
+    returns_discounted_range(rewards, dones, bootstrap, steps, envs, gamma, returns, done);
+}
+
+// generalized advantage estimation from the value estimates of every step,
+// returns gets advantages + values unless it is NULL
+void Returns_gae(const float *rewards, const float *values, const uint8_t *dones, const float *bootstrap, size_t steps, size_t envs,
+                 float gamma, float lambda, float *advantages, float *returns)
+{
+    size_t done = 0;
+#ifdef ML_X86_SIMD
+    if (gemm_get_kernel() == GEMM_AVX2)
+        done = returns_gae_avx2(rewards, values, dones, bootstrap, steps, envs, gamma, lambda, advantages, returns);
+#endif // ML_X86_SIMD
+    returns_gae_range(rewards, values, dones, bootstrap, steps, envs, gamma, lambda, advantages, returns, done);
+}
+
+// shifts x to mean 0 and scales it to standard deviation 1, a constant batch only loses its mean
+void Returns_normalize(float *x, size_t count)
+{
+    if (count == 0)
+        return;
+    double sum = 0.0;
+    for (size_t i = 0; i < count; i++)
+    {
+        sum += x[i];
+    }
+    double mean = sum / count;
+    double squares = 0.0;
+    for (size_t i = 0; i < count; i++)
+    {
+        squares += (x[i] - mean) * (x[i] - mean);
+    }
+    double variance = squares / count;
+    float scale = variance > 1e-12 ? (float)(1.0 / sqrt(variance)) : 1.f;
+    float shift = (float)mean;
+    for (size_t i = 0; i < count; i++)
+    {
+        x[i] = (x[i] - shift) * scale;
+    }
+}
+
+// all arrays share one aligned block like Trajectory_alloc
+ReplayBuffer ReplayBuffer_alloc(size_t capacity, size_t stateLen, const float *codeValues, size_t codeCount, float alpha)
+{
+    ReplayBuffer rb = {0};
+    size_t leaves = 1;
+    while (leaves < capacity)
+        leaves <<= 1;
+
+    size_t tableSize = ML_ALIGN_FLOATS(256) * sizeof(float);
+    size_t treeSize = ML_ALIGN_FLOATS(2 * leaves) * sizeof(float);
+    size_t floatsSize = ML_ALIGN_FLOATS(capacity) * sizeof(float);
+    size_t linksSize = capacity * (2 * sizeof(size_t) + sizeof(uint64_t));
+    size_t statesSize = (capacity * stateLen + ML_ALIGNMENT - 1) & ~(size_t)(ML_ALIGNMENT - 1);
+    size_t total = tableSize + treeSize + floatsSize + linksSize + statesSize + 2 * capacity;
+    char *block = (char *)ml_aligned_alloc(ML_ALIGNMENT, total);
+    if (!block)
+        return rb;
+    memset(block, 0, total);
+
+    rb.codeValues = (float *)block;
+    block += tableSize;
+    rb.tree = (float *)block;
+    block += treeSize;
+    rb.rewards = (float *)block;
+    block += floatsSize;
+    rb.serials = (uint64_t *)block;
+    block += capacity * sizeof(uint64_t);
+    rb.next = (size_t *)block;
+    block += capacity * sizeof(size_t);
+    rb.prev = (size_t *)block;
+    block += capacity * sizeof(size_t);
+    rb.states = (uint8_t *)block;
+    block += statesSize;
+    rb.actions = (uint8_t *)block;
+    rb.dones = (uint8_t *)block + capacity;
+
+    rb.leaves = leaves;
+    rb.stateLen = stateLen;
+    rb.capacity = capacity;
+    rb.alpha = alpha;
+    rb.maxPriority = 1.f;
+    for (size_t i = 0; i < codeCount && i < 256; i++)
+    {
+        rb.codeValues[i] = codeValues[i];
+    }
+    return rb;
+}
+
+void ReplayBuffer_free(ReplayBuffer rb)
+{
+    ml_aligned_free(rb.codeValues);
+}
+
+// sets leaf i and every sum above it, O(log n)
+static void replay_set_priority(ReplayBuffer *rb, size_t i, float priority)
+{
+    size_t node = rb->leaves + i;
+    rb->tree[node] = priority > 0.f ? powf(priority, rb->alpha) : 0.f;
+    for (node >>= 1; node > 0; node >>= 1)
+    {
+        rb->tree[node] = rb->tree[2 * node] + rb->tree[2 * node + 1];
+    }
+}
+
+// first leaf whose running sum passes u, never a leaf of zero priority
+static size_t replay_find(const ReplayBuffer *rb, float u)
+{
+    size_t node = 1;
+    while (node < rb->leaves)
+    {
+        float left = rb->tree[2 * node];
+        if (u < left || rb->tree[2 * node + 1] <= 0.f)
+        {
+            node = 2 * node;
+        }
+        else
+        {
+            u -= left;
+            node = 2 * node + 1;
+        }
+    }
+    return node - rb->leaves;
+}
+
+// stores a transition and returns its handle. previous is the handle of the step before it
+// in the same game, or 0 for the first step, it becomes sampleable once this one is its next state
+uint64_t ReplayBuffer_add(ReplayBuffer *rb, const uint8_t *state, uint8_t action, float reward, bool done, uint64_t previous)
+{
+    size_t slot = rb->head;
+    rb->head = (rb->head + 1) % rb->capacity;
+    if (rb->count < rb->capacity)
+        rb->count++;
+
+    // whatever was linked to the old transition loses it
+    size_t before = rb->prev[slot];
+    size_t after = rb->next[slot];
+    if (rb->serials[slot] != 0 && before != REPLAY_NONE && rb->next[before] == slot)
+    {
+        rb->next[before] = REPLAY_NONE;
+        replay_set_priority(rb, before, 0.f);
+    }
+    if (rb->serials[slot] != 0 && after != REPLAY_NONE && rb->prev[after] == slot)
+        rb->prev[after] = REPLAY_NONE;
+
+    memcpy(&rb->states[slot * rb->stateLen], state, rb->stateLen);
+    rb->actions[slot] = action;
+    rb->rewards[slot] = reward;
+    rb->dones[slot] = done;
+    rb->next[slot] = REPLAY_NONE;
+    rb->prev[slot] = REPLAY_NONE;
+    rb->serials[slot] = ++rb->pushed;
+    replay_set_priority(rb, slot, done ? rb->maxPriority : 0.f);
+
+    size_t link = previous ? (size_t)((previous - 1) % rb->capacity) : REPLAY_NONE;
+    if (link != REPLAY_NONE && link != slot && rb->serials[link] == previous && !rb->dones[link])
+    {
+        rb->next[link] = slot;
+        rb->prev[slot] = link;
+        replay_set_priority(rb, link, rb->maxPriority);
+    }
+    return rb->pushed;
+}
+
+static void replay_expand(const ReplayBuffer *rb, size_t slot, Matrix dest, size_t row)
+{
+    float *out = &MAT_AT(dest, row, 0);
+    if (slot == REPLAY_NONE)
+    {
+        memset(out, 0, sizeof(*out) * rb->stateLen);
+        return;
+    }
+    const uint8_t *codes = &rb->states[slot * rb->stateLen];
+    for (size_t j = 0; j < rb->stateLen; j++)
+    {
+        out[j] = rb->codeValues[codes[j]];
+    }
+}
+
+// draws count transitions in proportion to priority^alpha, one from each of count equal
+// slices of the total so a batch spreads over the buffer. States are decoded straight into
+// the batch matrices, the next state of a done transition is all zero. Returns how many were drawn
+size_t ReplayBuffer_sample(ReplayBuffer *rb, Rng *rng, ReplayBatch batch, size_t count, float beta)
+{
+    float total = rb->tree[1];
+    if (total <= 0.f || count == 0)
+        return 0;
+    if (batch.states.cols != rb->stateLen || batch.nextStates.cols != rb->stateLen)
+        return 0;
+    if (count > batch.states.rows || count > batch.nextStates.rows)
+        return 0;
+
+    float slice = total / count;
+    float maxWeight = 0.f;
+    for (size_t k = 0; k < count; k++)
+    {
+        size_t slot = replay_find(rb, (k + Rng_float(rng)) * slice);
+        batch.indices[k] = slot;
+        batch.actions[k] = rb->actions[slot];
+        batch.rewards[k] = rb->rewards[slot];
+        batch.dones[k] = rb->dones[slot];
+        replay_expand(rb, slot, batch.states, k);
+        replay_expand(rb, rb->dones[slot] ? REPLAY_NONE : rb->next[slot], batch.nextStates, k);
+
+        // (N * P(i))^-beta undoes the skew priorities put on the expected gradient
+        float probability = rb->tree[rb->leaves + slot] / total;
+        batch.weights[k] = powf((float)rb->count * probability, -beta);
+        if (batch.weights[k] > maxWeight)
+            maxWeight = batch.weights[k];
+    }
+    for (size_t k = 0; k < count; k++)
+    {
+        batch.weights[k] /= maxWeight;
+    }
+    return count;
+}
+
+// new priorities for sampled slots, usually the absolute TD errors
+void ReplayBuffer_update(ReplayBuffer *rb, const size_t *indices, const float *priorities, size_t count)
+{
+    for (size_t k = 0; k < count; k++)
+    {
+        size_t slot = indices[k];
+        // a transition that lost its next state since it was sampled stays out
+        if (slot >= rb->capacity || (!rb->dones[slot] && rb->next[slot] == REPLAY_NONE))
+            continue;
+        float priority = fabsf(priorities[k]) + 1e-6f;
+        if (priority > rb->maxPriority)
+            rb->maxPriority = priority;
+        replay_set_priority(rb, slot, priority);
+    }
+}
+
+ReplayBatch ReplayBatch_alloc(size_t rows, size_t stateLen)
+{
+    ReplayBatch batch = {0};
+    batch.states = mat_alloc(rows, stateLen);
+    batch.nextStates = mat_alloc(rows, stateLen);
+    batch.actions = (uint8_t *)malloc(rows);
+    batch.rewards = (float *)malloc(sizeof(*batch.rewards) * rows);
+    batch.dones = (uint8_t *)malloc(rows);
+    batch.indices = (size_t *)malloc(sizeof(*batch.indices) * rows);
+    batch.weights = (float *)malloc(sizeof(*batch.weights) * rows);
+    return batch;
+}
+
+// put back the matrices ReplayBatch_alloc made before freeing if they were swapped for views
+void ReplayBatch_free(ReplayBatch batch)
+{
+    mat_free(batch.states);
+    mat_free(batch.nextStates);
+    free(batch.actions);
+    free(batch.rewards);
+    free(batch.dones);
+    free(batch.indices);
+    free(batch.weights);
+}
+
+bool Network_same(Network a, Network b)
+{
+    if (a.count != b.count)
+        return false;
+    if (a.paramCount != b.paramCount)
+        return false;
+
+    // layers only have to agree on width, the batch size may differ
+    for (size_t i = 0; i < a.count; i++)
+    {
+        if (a.layers[i].cols != b.layers[i].cols)
+            return false;
+        if (LAYER_IS_CONV(a, i) != LAYER_IS_CONV(b, i))
+            return false;
+        if (!mat_same(a.weights[i], b.weights[i]))
+            return false;
+        if (!mat_same(a.biases[i], b.biases[i]))
+            return false;
+    }
+    return true;
+}
+
+Network NeuralNetwork(size_t *layers, size_t count, ActivationType *activations)
+{
+    return NeuralNetwork_batch(layers, count, activations, 1);
+}
+
+// every layers[i] gets batch rows so one forward pass runs batch samples
+Network NeuralNetwork_batch(size_t *layers, size_t count, ActivationType *activations, size_t batch)
+{
+    return NeuralNetwork_spec(layers, count, activations, NULL, batch);
+}
+
+// specs has count - 1 entries (or is NULL for an all dense network). A CONV2D layer
+// needs layers[i] == height * width * channels and layers[i + 1] == conv_output_size,
+// its weights are a (kernel * kernel * channels) x filters matrix
+Network NeuralNetwork_spec(size_t *layers, size_t count, ActivationType *activations, LayerSpec *specs, size_t batch)
+{
+    return network_build(layers, count, activations, specs, batch, NULL);
+}
+
+// with sharedParams set the weights and biases are views into it instead of a new
+// arena, it has to have the layout a new arena would get
+static Network network_build(size_t *layers, size_t count, ActivationType *activations, LayerSpec *specs,
+                             size_t batch, float *sharedParams)
+{
+    Network nn = {0};
+    for (size_t i = 0; specs && i + 1 < count; i++)
+    {
+        if (specs[i].kind != CONV2D)
+            continue;
+        LayerSpec c = specs[i];
+        if (c.kernel % 2 == 0 || c.stride == 0 || layers[i] != c.height * c.width * c.channels ||
+            layers[i + 1] != conv_output_size(c))
+        {
+            fprintf(stderr, "Layer %zu does not match its convolution shape\n", i);
+            return nn;
+        }
+    }
+
+    nn.count = count - 1;
+    nn.batch = batch;
+    nn.layers = (Matrix *)malloc(sizeof(*nn.layers) * (nn.count + 1));
+    nn.weights = (Matrix *)malloc(sizeof(*nn.weights) * nn.count);
+    nn.biases = (Matrix *)malloc(sizeof(*nn.biases) * nn.count);
+    if (activations != NULL)
+    {
+        nn.activations = (Activation *)malloc(sizeof(*nn.activations) * nn.count);
+    }
+    else
+    {
+        nn.activations = NULL;
+    }
+
+    // all parameters live in one arena and all activations in another,
+    // the matrices are views into them
+    size_t *weightRows = (size_t *)malloc(sizeof(*weightRows) * nn.count);
+    size_t *weightCols = (size_t *)malloc(sizeof(*weightCols) * nn.count);
+    nn.specs = NULL;
+    if (specs != NULL)
+    {
+        nn.specs = (LayerSpec *)malloc(sizeof(*nn.specs) * nn.count);
+        memcpy(nn.specs, specs, sizeof(*nn.specs) * nn.count);
+    }
+    nn.paramCount = 0;
+    nn.stateCount = ML_ALIGN_FLOATS(batch * layers[0]);
+    for (size_t i = 0; i < nn.count; i++)
+    {
+        weightRows[i] = layers[i];
+        weightCols[i] = layers[i + 1];
+        if (LAYER_IS_CONV(nn, i))
+        {
+            weightRows[i] = specs[i].kernel * specs[i].kernel * specs[i].channels;
+            weightCols[i] = specs[i].filters;
+        }
+        nn.paramCount += ML_ALIGN_FLOATS(weightRows[i] * weightCols[i]);
+        nn.paramCount += ML_ALIGN_FLOATS(weightCols[i]);
+        nn.stateCount += ML_ALIGN_FLOATS(batch * layers[i + 1]);
+    }
+    nn.sharedParams = sharedParams != NULL;
+    nn.params = sharedParams;
+    if (!nn.sharedParams)
+    {
+        nn.params = (float *)ml_aligned_alloc(ML_ALIGNMENT, sizeof(*nn.params) * nn.paramCount);
+        memset(nn.params, 0, sizeof(*nn.params) * nn.paramCount);
+    }
+    nn.state = (float *)ml_aligned_alloc(ML_ALIGNMENT, sizeof(*nn.state) * nn.stateCount);
+    memset(nn.state, 0, sizeof(*nn.state) * nn.stateCount);
+
+    float *param = nn.params;
+    float *state = nn.state;
+    nn.layers[0] = (Matrix){batch, layers[0], layers[0], state};
+    state += ML_ALIGN_FLOATS(batch * layers[0]);
+    for (size_t i = 0; i < nn.count; i++)
+    {
+        nn.weights[i] = (Matrix){weightRows[i], weightCols[i], weightCols[i], param};
+        param += ML_ALIGN_FLOATS(weightRows[i] * weightCols[i]);
+        nn.biases[i] = (Matrix){1, weightCols[i], weightCols[i], param};
+        param += ML_ALIGN_FLOATS(weightCols[i]);
+        if (activations != NULL)
+        {
+            nn.activations[i].type = activations[i];
+            nn.activations[i].activationFunc = getActFunc(activations[i]);
+        }
+        nn.layers[i + 1] = (Matrix){batch, layers[i + 1], layers[i + 1], state};
+        state += ML_ALIGN_FLOATS(batch * layers[i + 1]);
+    }
+    free(weightRows);
+    free(weightCols);
+    return nn;
+}
+
+LayerSpec conv_spec(size_t height, size_t width, size_t channels, size_t filters, size_t kernel, size_t stride)
+{
+    return (LayerSpec){CONV2D, height, width, channels, filters, kernel, stride};
+}
+
+// width of the layer a CONV2D spec writes
+size_t conv_output_size(LayerSpec spec)
+{
+    size_t outHeight = (spec.height + spec.stride - 1) / spec.stride;
+    size_t outWidth = (spec.width + spec.stride - 1) / spec.stride;
+    return outHeight * outWidth * spec.filters;
+}
+
+bool Network_all_dense(Network nn)
+{
+    for (size_t i = 0; nn.specs && i < nn.count; i++)
+    {
+        if (nn.specs[i].kind != DENSE)
+            return false;
+    }
+    return true;
+}
+
+void Network_free(Network nn)
+{
+    if (!nn.sharedParams)
+        ml_aligned_free(nn.params);
+    ml_aligned_free(nn.state);
+    free(nn.layers);
+    free(nn.weights);
+    free(nn.biases);
+    free(nn.activations);
+    free(nn.specs);
+}
+
+// new network with the same architecture and the given batch size, its params
+// are zero or, with sharedParams set, views into that arena
+static Network network_like(Network nn, size_t batch, float *sharedParams)
+{
+    size_t *arch = Network_getArch(nn);
+    ActivationType *acts = NULL;
+    if (nn.activations)
+    {
+        acts = (ActivationType *)malloc(sizeof(*acts) * nn.count);
+        for (size_t i = 0; i < nn.count; i++)
+        {
+            acts[i] = nn.activations[i].type;
+        }
+    }
+    Network like = network_build(arch, nn.count + 1, acts, nn.specs, batch, sharedParams);
+    free(acts);
+    free(arch);
+    return like;
+}
+
+// moves the weight and bias views of nn onto another arena with the same layout
+static void network_rebase(Network *nn, float *params)
+{
+    for (size_t i = 0; i < nn->count; i++)
+    {
+        nn->weights[i].es = params + (nn->weights[i].es - nn->params);
+        nn->biases[i].es = params + (nn->biases[i].es - nn->params);
+    }
+    nn->params = params;
+}
+
+// new network with the same architecture, batch size and parameters
+Network Network_clone(Network nn)
+{
+    Network clone = network_like(nn, nn.batch, NULL);
+    Network_copy_params(clone, nn);
+    return clone;
+}
+
+// network with its own activations that reads the parameters of nn in place,
+// updates to nn are seen by the replica. nn has to outlive it
+Network Network_replica(Network nn, size_t batch)
+{
+    return network_like(nn, batch, nn.params);
+}
+
+void Network_copy_params(Network dest, Network src)
+{
+    if (!Network_same(dest, src))
+        return;
+    memcpy(dest.params, src.params, sizeof(*dest.params) * dest.paramCount);
+}
+
+void print_Network(Network nn, const char *name, bool showLayers)
+{
+    char buff[100];
+    printf("%s = [\n", name);
+    for (size_t i = 0; i < nn.count; i++)
+    {
+        if (showLayers)
+        {
+            snprintf(buff, sizeof(buff), "%s.layers[%zu]", name, i);
+            print_mat(nn.layers[i], buff, 4, "%f");
+        }
+        snprintf(buff, sizeof(buff), "%s.weights[%zu]", name, i);
+        print_mat(nn.weights[i], buff, 4, "%f");
+        snprintf(buff, sizeof(buff), "%s.biases[%zu]", name, i);
+        print_mat(nn.biases[i], buff, 4, "%f");
+        if (nn.activations)
+        {
+            snprintf(buff, sizeof(buff), "%s.activations[%zu]", name, i);
+            print_activation(nn.activations[i], buff, 4);
+        }
+    }
+    if (showLayers)
+    {
+        snprintf(buff, sizeof(buff), "%s.layers[%zu]", name, nn.count);
+        print_mat(nn.layers[nn.count], buff, 4, "%f");
+    }
+    printf("]\n");
+}
+
+void Network_rand(Network nn, float low, float high)
+{
+    for (size_t i = 0; i < nn.count; i++)
+    {
+        // mat_rand(nn.layers[i], low, high);
+        mat_rand(nn.weights[i], low, high);
+        mat_rand(nn.biases[i], low, high);
+    }
+}
+
+void Network_clear(Network nn)
+{
+    memset(nn.params, 0, sizeof(*nn.params) * nn.paramCount);
+    memset(nn.state, 0, sizeof(*nn.state) * nn.stateCount);
+}
+
+void Network_scale(Network nn, float s)
+{
+    for (size_t i = 0; i < nn.paramCount; i++)
+    {
+        nn.params[i] *= s;
+    }
+}
+
+// largest absolute difference between the parameters of two networks
+float Network_max_diff(Network a, Network b)
+{
+    if (!Network_same(a, b))
+        return INFINITY;
+
+    float result = 0.f;
+    for (size_t i = 0; i < a.paramCount; i++)
+    {
+        float d = fabsf(a.params[i] - b.params[i]);
+        if (d > result)
+            result = d;
+    }
+    return result;
+}
+
+float Network_cost(Network nn, Matrix in, Matrix out)
+{
+    if (NETWORK_IN(nn).cols != in.cols)
+        return -1.f;
+    if (NETWORK_OUT(nn).cols != out.cols)
+        return -1.f;
+
+    double result = 0.0; // finite differences of the cost need more than float accumulation
+    for (size_t i = 0; i < in.rows; i += nn.batch)
+    {
+        size_t rows = (in.rows - i < nn.batch) ? in.rows - i : nn.batch;
+        Network_forward_batch(nn, mat_rows(in, i, rows));
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < out.cols; j++)
+            {
+                float d = MAT_AT(NETWORK_OUT(nn), r, j) - MAT_AT(out, i + r, j);
+                result += d * d;
+            }
+        }
+    }
+
+    return (float)(result / in.rows);
+}
+
+float Network_cross_entropy_cost(Network nn, Step *steps[], size_t stepAmount)
+{
+    float cost = 0.f;
+    for (size_t i = 0; i < stepAmount; i++)
+    {
+        float prob = steps[i]->probability;
+        if (steps[i]->reward != 0 && prob > 0)
+        {
+            cost += steps[i]->reward * -log(prob);
+        }
+    }
+    return cost;
+}
+
+// mean of -reward * log(pi(action | state)) with the log-probabilities recomputed
+// through a log-softmax of the logits, the cost Network_policy_gradient_backprop differentiates
+float Network_policy_cost(Network nn, Step *steps[], size_t stepAmount)
+{
+    if (stepAmount == 0)
+        return 0.f;
+    if (NETWORK_IN(nn).cols != steps[0]->state.cols)
+        return -1.f;
+
+    float cost = 0.f;
+    for (size_t i = 0; i < stepAmount; i += nn.batch)
+    {
+        size_t rows = (stepAmount - i < nn.batch) ? stepAmount - i : nn.batch;
+        for (size_t r = 0; r < rows; r++)
+        {
+            mat_copy(mat_row(NETWORK_IN(nn), r), steps[i + r]->state);
+        }
+        Network_forward_layers(nn, rows, false);
+        Matrix logits = mat_rows(NETWORK_OUT(nn), 0, rows);
+        mat_log_softmax_rows(logits, logits);
+        for (size_t r = 0; r < rows; r++)
+        {
+            cost -= steps[i + r]->reward * MAT_AT(logits, r, steps[i + r]->action);
+        }
+    }
+    return cost / stepAmount;
+}
+
+float Network_policy_cost_trajectory(Network nn, Trajectory t)
+{
+    if (t.count == 0)
+        return 0.f;
+    if (NETWORK_IN(nn).cols != t.stateLen)
+        return -1.f;
+
+    double cost = 0.0;
+    for (size_t i = 0; i < t.count; i += nn.batch)
+    {
+        size_t rows = (t.count - i < nn.batch) ? t.count - i : nn.batch;
+        Trajectory_expand(t, i, mat_rows(NETWORK_IN(nn), 0, rows));
+        Network_forward_layers(nn, rows, false);
+        Matrix logits = mat_rows(NETWORK_OUT(nn), 0, rows);
+        mat_log_softmax_rows(logits, logits);
+        for (size_t r = 0; r < rows; r++)
+        {
+            cost -= t.returns[i + r] * MAT_AT(logits, r, t.actions[i + r]);
+        }
+    }
+    return (float)(cost / t.count);
+}
+
+void Network_forward(Network nn)
+{
+    Network_forward_rows(nn, NETWORK_IN(nn).rows);
+}
+
+// forwards the first rows samples of the batch, each layer is one matrix-matrix product
+void Network_forward_rows(Network nn, size_t rows)
+{
+    Network_forward_layers(nn, rows, true);
+}
+
+static ML_THREAD_LOCAL float *convScratch = NULL;
+static ML_THREAD_LOCAL size_t convScratchCount = 0;
+
+// per thread im2col buffer, grown to the largest chunk seen so far
+static float *conv_scratch(size_t count)
+{
+    if (count > convScratchCount)
+    {
+        ml_aligned_free(convScratch);
+        convScratch = (float *)ml_aligned_alloc(ML_ALIGNMENT, sizeof(*convScratch) * ML_ALIGN_FLOATS(count));
+        convScratchCount = convScratch ? count : 0;
+    }
+    return convScratch;
+}
+
+// frees this thread's GEMM pack buffer and im2col scratch, threads started with
+// ml_thread_start call it on exit, other threads that ran the network should too
+void gemm_thread_cleanup(void)
+{
+    ml_aligned_free(gemmPackBuffer);
+    gemmPackBuffer = NULL;
+    ml_aligned_free(convScratch);
+    convScratch = NULL;
+    convScratchCount = 0;
+}
+
+// how many images of layer i go through one im2col chunk
+static size_t conv_chunk_images(LayerSpec spec)
+{
+    size_t patch = spec.kernel * spec.kernel * spec.channels;
+    size_t perImage = conv_output_size(spec) / spec.filters * patch;
+    size_t images = CONV_CHUNK_FLOATS / perImage;
+    return images ? images : 1;
+}
+
+// writes one row of kernel x kernel x channels inputs per output position of each image,
+// taps that fall outside the image are zero
+static void conv_im2col(Matrix in, LayerSpec spec, float *cols)
+{
+    size_t outHeight = (spec.height + spec.stride - 1) / spec.stride;
+    size_t outWidth = (spec.width + spec.stride - 1) / spec.stride;
+    size_t tap = spec.kernel * spec.channels;
+    ptrdiff_t half = (ptrdiff_t)(spec.kernel / 2);
+    for (size_t n = 0; n < in.rows; n++)
+    {
+        const float *image = &MAT_AT(in, n, 0);
+        for (size_t oy = 0; oy < outHeight; oy++)
+        {
+            for (size_t ox = 0; ox < outWidth; ox++)
+            {
+                ptrdiff_t x0 = (ptrdiff_t)(ox * spec.stride) - half;
+                for (size_t ky = 0; ky < spec.kernel; ky++)
+                {
+                    ptrdiff_t y = (ptrdiff_t)(oy * spec.stride + ky) - half;
+                    if (y < 0 || y >= (ptrdiff_t)spec.height)
+                    {
+                        memset(cols, 0, sizeof(*cols) * tap);
+                        cols += tap;
+                        continue;
+                    }
+                    // a kernel row is contiguous in the image once clipped to it
+                    const float *src = image + (size_t)y * spec.width * spec.channels;
+                    for (size_t kx = 0; kx < spec.kernel; kx++, cols += spec.channels)
+                    {
+                        ptrdiff_t x = x0 + (ptrdiff_t)kx;
+                        bool inside = x >= 0 && x < (ptrdiff_t)spec.width;
+                        const float *tapSrc = src + (inside ? (size_t)x * spec.channels : 0);
+                        for (size_t c = 0; c < spec.channels; c++)
+                        {
+                            cols[c] = inside ? tapSrc[c] : 0.f;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// the transpose of conv_im2col, every patch value is added back onto the input it came from
+static void conv_col2im_add(Matrix dest, LayerSpec spec, const float *cols)
+{
+    size_t outHeight = (spec.height + spec.stride - 1) / spec.stride;
+    size_t outWidth = (spec.width + spec.stride - 1) / spec.stride;
+    size_t tap = spec.kernel * spec.channels;
+    ptrdiff_t half = (ptrdiff_t)(spec.kernel / 2);
+    for (size_t n = 0; n < dest.rows; n++)
+    {
+        float *image = &MAT_AT(dest, n, 0);
+        for (size_t oy = 0; oy < outHeight; oy++)
+        {
+            for (size_t ox = 0; ox < outWidth; ox++)
+            {
+                ptrdiff_t x0 = (ptrdiff_t)(ox * spec.stride) - half;
+                for (size_t ky = 0; ky < spec.kernel; ky++)
+                {
+                    ptrdiff_t y = (ptrdiff_t)(oy * spec.stride + ky) - half;
+                    if (y < 0 || y >= (ptrdiff_t)spec.height)
+                    {
+                        cols += tap;
+                        continue;
+                    }
+                    float *row = image + (size_t)y * spec.width * spec.channels;
+                    for (size_t kx = 0; kx < spec.kernel; kx++, cols += spec.channels)
+                    {
+                        ptrdiff_t x = x0 + (ptrdiff_t)kx;
+                        if (x < 0 || x >= (ptrdiff_t)spec.width)
+                            continue;
+                        float *dst = row + (size_t)x * spec.channels;
+                        for (size_t c = 0; c < spec.channels; c++)
+                        {
+                            dst[c] += cols[c];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// out = act(conv(in) + bias) for rows images, a chunk of images at a time so the
+// patches stay in cache, each chunk is one gemm of (images * positions) x patch by patch x filters
+static void conv_forward(Matrix in, Matrix out, Matrix weights, Matrix bias, LayerSpec spec, ActivationType activation)
+{
+    size_t positions = out.cols / spec.filters;
+    size_t chunk = conv_chunk_images(spec);
+    float *cols = conv_scratch(chunk * positions * weights.rows);
+    for (size_t n = 0; n < in.rows; n += chunk)
+    {
+        size_t images = (in.rows - n < chunk) ? in.rows - n : chunk;
+        conv_im2col(mat_rows(in, n, images), spec, cols);
+        Matrix patches = {images * positions, weights.rows, weights.rows, cols};
+        // layer rows are contiguous, so the images' outputs are one positions x filters matrix
+        Matrix z = {images * positions, spec.filters, spec.filters, &MAT_AT(out, n, 0)};
+        mat_dot_bias_act(z, patches, weights, bias, activation);
+    }
+}
+
+// adds the weight and bias gradients of a conv layer given dZ, and writes dIn when it is not NULL
+static void conv_backward(Matrix in, Matrix dz, Matrix weights, Matrix dWeights, Matrix dBias, LayerSpec spec, Matrix *dIn)
+{
+    size_t positions = dz.cols / spec.filters;
+    size_t chunk = conv_chunk_images(spec);
+    float *cols = conv_scratch(chunk * positions * weights.rows);
+    if (dIn)
+        mat_clear(*dIn);
+    for (size_t n = 0; n < in.rows; n += chunk)
+    {
+        size_t images = (in.rows - n < chunk) ? in.rows - n : chunk;
+        Matrix patches = {images * positions, weights.rows, weights.rows, cols};
+        Matrix d = {images * positions, spec.filters, spec.filters, &MAT_AT(dz, n, 0)};
+
+        // dW = patches^T * dZ, db = colsum(dZ), dPatches = dZ * W^T
+        conv_im2col(mat_rows(in, n, images), spec, cols);
+        mat_dot_ex(dWeights, patches, true, d, false, true);
+        mat_col_sum(dBias, d, true);
+        if (dIn)
+        {
+            mat_dot_ex(patches, d, false, weights, true, false);
+            conv_col2im_add(mat_rows(*dIn, n, images), spec, cols);
+        }
+    }
+}
+
+// with outputSoftmax false a softmax output layer is left as raw logits
+void Network_forward_layers(Network nn, size_t rows, bool outputSoftmax)
+{
+    Network_forward_from(nn, 0, rows, outputSoftmax);
+}
+
+// runs layers first..count-1, nn.layers[first] has to hold their input already
+void Network_forward_from(Network nn, size_t first, size_t rows, bool outputSoftmax)
+{
+    if (rows > NETWORK_IN(nn).rows)
+        return;
+
+    for (size_t i = first; i < nn.count; i++)
+    {
+        Matrix out = mat_rows(nn.layers[i + 1], 0, rows);
+        ActivationType type = nn.activations ? nn.activations[i].type : LINEAR;
+        // softmax needs the whole row, so only the bias is fused for it
+        if (LAYER_IS_CONV(nn, i))
+            conv_forward(mat_rows(nn.layers[i], 0, rows), out, nn.weights[i], nn.biases[i], nn.specs[i],
+                         type == SOFTMAX ? LINEAR : type);
+        else
+            mat_dot_bias_act(out, mat_rows(nn.layers[i], 0, rows), nn.weights[i], nn.biases[i],
+                             type == SOFTMAX ? LINEAR : type);
+        if (type == SOFTMAX && (outputSoftmax || i + 1 < nn.count))
+        {
+            softmaxf(out);
+        }
+    }
+}
+
+// forward pass with the input layer given as nonzeros, layers[0] is left untouched
+void Network_forward_sparse(Network nn, SparseRows in, bool outputSoftmax)
+{
+    if (in.rows > NETWORK_IN(nn).rows || in.cols != NETWORK_IN(nn).cols)
+        return;
+    if (LAYER_IS_CONV(nn, 0))
+        return;
+
+    ActivationType type = nn.activations ? nn.activations[0].type : LINEAR;
+    if (type == SOFTMAX && !outputSoftmax && nn.count == 1)
+        type = LINEAR;
+    mat_dot_sparse_bias_act(mat_rows(nn.layers[1], 0, in.rows), in, nn.weights[0], nn.biases[0], type);
+    Network_forward_from(nn, 1, in.rows, outputSoftmax);
+}
+
+// NNUE style single sample inference: acc caches the first layer pre-activation
+// of input row 0, so a change to a few inputs only costs a few weight rows
+Matrix Network_accumulator_alloc(Network nn)
+{
+    return mat_alloc(1, nn.weights[0].cols);
+}
+
+// recomputes acc from input row 0, needed after a full input rewrite or a weight update
+void Network_accumulator_refresh(Network nn, Matrix acc)
+{
+    if (acc.cols != nn.weights[0].cols || LAYER_IS_CONV(nn, 0))
+        return;
+    mat_dot_bias_act(acc, mat_row(NETWORK_IN(nn), 0), nn.weights[0], nn.biases[0], LINEAR);
+}
+
+// writes one input of row 0 and adds (value - old) * W[index] to acc
+void Network_accumulator_set(Network nn, Matrix acc, size_t index, float value)
+{
+    if (acc.cols != nn.weights[0].cols || index >= NETWORK_IN(nn).cols || LAYER_IS_CONV(nn, 0))
+        return;
+
+    float delta = value - MAT_AT(NETWORK_IN(nn), 0, index);
+    if (delta == 0.f)
+        return;
+    MAT_AT(NETWORK_IN(nn), 0, index) = value;
+    const float *w = &MAT_AT(nn.weights[0], index, 0);
+    for (size_t j = 0; j < acc.cols; j++)
+    {
+        MAT_AT(acc, 0, j) += delta * w[j];
+    }
+}
+
+// same outputs as Network_forward_rows(nn, 1) without the first layer product
+void Network_forward_accumulator(Network nn, Matrix acc)
+{
+    if (acc.cols != nn.weights[0].cols || LAYER_IS_CONV(nn, 0))
+        return;
+
+    Matrix hidden = mat_row(nn.layers[1], 0);
+    mat_copy(hidden, acc);
+    ActivationType type = nn.activations ? nn.activations[0].type : LINEAR;
+    if (type == SOFTMAX)
+        softmaxf(hidden);
+    else
+        activate_row(&MAT_AT(hidden, 0, 0), hidden.cols, type);
+    Network_forward_from(nn, 1, 1, true);
+}
+
+// runs every row of in (at most nn.batch of them), outputs land in the same rows of NETWORK_OUT
+void Network_forward_batch(Network nn, Matrix in)
+{
+    if (in.rows > nn.batch)
+        return;
+    if (in.cols != NETWORK_IN(nn).cols)
+        return;
+
+    mat_copy(mat_rows(NETWORK_IN(nn), 0, in.rows), in);
+    Network_forward_rows(nn, in.rows);
+}
+
+void Network_diff(Network nn, Network g, float eps, Matrix in, Matrix out)
+{
+    if (in.rows != out.rows)
+        return;
+    if (NETWORK_IN(nn).cols != in.cols)
+        return;
+    if (NETWORK_OUT(nn).cols != out.cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+
+    float saved;
+    float cost = Network_cost(nn, in, out);
+    for (size_t i = 0; i < nn.count; i++)
+    {
+        Matrix weights = nn.weights[i];
+        for (size_t j = 0; j < weights.rows; j++)
+        {
+            for (size_t k = 0; k < weights.cols; k++)
+            {
+                saved = MAT_AT(weights, j, k);
+                MAT_AT(weights, j, k) += eps;
+                float newCost = Network_cost(nn, in, out);
+                MAT_AT(g.weights[i], j, k) = (newCost - cost) / eps;
+                MAT_AT(weights, j, k) = saved;
+            }
+        }
+
+        Matrix biases = nn.biases[i];
+        for (size_t j = 0; j < biases.rows; j++)
+        {
+            for (size_t k = 0; k < biases.cols; k++)
+            {
+                saved = MAT_AT(biases, j, k);
+                MAT_AT(biases, j, k) += eps;
+                float newCost = Network_cost(nn, in, out);
+                MAT_AT(g.biases[i], j, k) = (newCost - cost) / eps;
+                MAT_AT(biases, j, k) = saved;
+            }
+        }
+    }
+}
+
+void Network_policy_gradient_diff(Network nn, Network g, float eps, Step *steps[], size_t stepAmount)
+{
+    if (NETWORK_IN(nn).cols != steps[0]->state.cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+
+    float saved;
+    float cost = Network_cross_entropy_cost(nn, steps, stepAmount);
+    for (size_t i = 0; i < nn.count; i++)
+    {
+        Matrix weights = nn.weights[i];
+        for (size_t j = 0; j < weights.rows; j++)
+        {
+            for (size_t k = 0; k < weights.cols; k++)
+            {
+                saved = MAT_AT(weights, j, k);
+                MAT_AT(weights, j, k) += eps;
+                float newCost = Network_cross_entropy_cost(nn, steps, stepAmount);
+                MAT_AT(g.weights[i], j, k) = (newCost - cost) / eps;
+                MAT_AT(weights, j, k) = saved;
+            }
+        }
+
+        Matrix biases = nn.biases[i];
+        for (size_t k = 0; k < biases.cols; k++)
+        {
+            saved = MAT_AT(biases, 0, k);
+            MAT_AT(biases, 0, k) += eps;
+            float newCost = Network_cross_entropy_cost(nn, steps, stepAmount);
+            MAT_AT(g.biases[i], 0, k) = (newCost - cost) / eps;
+            MAT_AT(biases, 0, k) = saved;
+        }
+    }
+}
+
+void Network_backprop(Network nn, Network g, Matrix in, Matrix out)
+{
+    if (in.rows != out.rows)
+        return;
+    if (NETWORK_IN(nn).cols != in.cols)
+        return;
+    if (NETWORK_OUT(nn).cols != out.cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    // walks the weights neuron by neuron, only dense layers have that shape
+    if (!Network_all_dense(nn))
+        return;
+    size_t n = in.rows; // amount of samples
+
+    Network_clear(g);
+
+    // i = current sample
+    // l = current layer
+    // j = current "node"
+    // k = previous "node"
+
+    for (size_t i = 0; i < n; i++)
+    {
+        mat_copy(mat_row(NETWORK_IN(nn), 0), mat_row(in, i));
+        Network_forward_rows(nn, 1);
+
+        for (size_t j = 0; j <= g.count; j++)
+        {
+            mat_clear(mat_row(g.layers[j], 0));
+        }
+
+        for (size_t j = 0; j < out.cols; j++)
+        {
+#ifdef TRAD_BACKPROP
+            MAT_AT(NETWORK_OUT(g), 0, j) = 2 * (MAT_AT(NETWORK_OUT(nn), 0, j) - MAT_AT(out, i, j));
+#else
+            MAT_AT(NETWORK_OUT(g), 0, j) = (MAT_AT(NETWORK_OUT(nn), 0, j) - MAT_AT(out, i, j));
+#endif // TRAD_BACKPROP
+        }
+
+#ifdef TRAD_BACKPROP
+        float s = 1.f;
+#else
+        float s = 2.f;
+#endif // TRAD_BACKPROP
+
+        for (size_t l = nn.count; l > 0; l--)
+        {
+            for (size_t j = 0; j < nn.layers[l].cols; j++)
+            {
+                float outputAhead = MAT_AT(nn.layers[l], 0, j);
+                float derivativeAhead = MAT_AT(g.layers[l], 0, j);
+                float activationDerivative = 1.f;
+                if (nn.activations && nn.activations[l - 1].activationFunc)
+                {
+                    float (*derivativeFunc)(float) = getActDerivative(nn.activations[l - 1].type);
+                    if (derivativeFunc)
+                    {
+                        activationDerivative = derivativeFunc(outputAhead);
+                    }
+                }
+                float fullDerivative = (s * derivativeAhead * activationDerivative);
+                MAT_AT(g.biases[l - 1], 0, j) += (fullDerivative);
+
+                for (size_t k = 0; k < nn.layers[l - 1].cols; k++)
+                {
+                    // j - weights matrix col
+                    // k = weights matrix row
+                    float prevInput = MAT_AT(nn.layers[l - 1], 0, k);
+                    MAT_AT(g.weights[l - 1], k, j) += (fullDerivative * prevInput);
+
+                    float prevWeight = MAT_AT(nn.weights[l - 1], k, j);
+                    MAT_AT(g.layers[l - 1], 0, k) += (fullDerivative * prevWeight);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < g.count; i++)
+    {
+        Matrix curWeights = g.weights[i];
+        for (size_t j = 0; j < curWeights.rows; j++)
+        {
+            for (size_t k = 0; k < curWeights.cols; k++)
+            {
+                MAT_AT(curWeights, j, k) /= n;
+            }
+        }
+
+        Matrix curBiases = g.biases[i];
+        for (size_t k = 0; k < curBiases.cols; k++)
+        {
+            MAT_AT(curBiases, 0, k) /= n;
+        }
+    }
+}
+
+void Network_policy_gradient_backprop(Network nn, Network g, Step *steps[], size_t stepAmount)
+{
+    if (NETWORK_IN(nn).cols != steps[0]->state.cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    if (!Network_all_dense(nn))
+        return;
+    size_t n = stepAmount; // amount of steps
+
+    Network_clear(g);
+
+    // float cumulativeRewards[n];
+    // cumulativeRewards[n - 1] = steps[n - 1]->reward;
+    // for (int i = n - 2; i >= 0; i--)
+    // {
+    //     cumulativeRewards[i] = steps[i]->reward + 0.9 * cumulativeRewards[i + 1];
+    // }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        mat_copy(mat_row(NETWORK_IN(nn), 0), steps[i]->state);
+        Network_forward_rows(nn, 1);
+
+        for (size_t j = 0; j <= g.count; j++)
+        {
+            mat_clear(mat_row(g.layers[j], 0));
+        }
+
+        for (size_t j = 0; j < NETWORK_OUT(nn).cols; j++)
+        {
+            float P_k = MAT_AT(NETWORK_OUT(nn), 0, j);
+            MAT_AT(NETWORK_OUT(g), 0, j) = (P_k - ((size_t)steps[i]->action == j)) * steps[i]->reward;
+        }
+
+        for (size_t l = nn.count; l > 0; l--)
+        {
+            for (size_t j = 0; j < nn.layers[l].cols; j++)
+            {
+                float outputAhead = MAT_AT(nn.layers[l], 0, j);
+                float derivativeAhead = MAT_AT(g.layers[l], 0, j);
+                float activationDerivative = 1.f;
+                if (nn.activations && nn.activations[l - 1].activationFunc)
+                {
+                    float (*derivativeFunc)(float) = getActDerivative(nn.activations[l - 1].type);
+                    if (derivativeFunc)
+                    {
+                        activationDerivative = derivativeFunc(outputAhead);
+                    }
+                }
+                float fullDerivative = (derivativeAhead * activationDerivative);
+                MAT_AT(g.biases[l - 1], 0, j) += (fullDerivative);
+
+                for (size_t k = 0; k < nn.layers[l - 1].cols; k++)
+                {
+                    // j - weights matrix col
+                    // k = weights matrix row
+                    float prevInput = MAT_AT(nn.layers[l - 1], 0, k);
+                    MAT_AT(g.weights[l - 1], k, j) += (fullDerivative * prevInput);
+
+                    float prevWeight = MAT_AT(nn.weights[l - 1], k, j);
+                    MAT_AT(g.layers[l - 1], 0, k) += (fullDerivative * prevWeight);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < g.count; i++)
+    {
+        Matrix curWeights = g.weights[i];
+        for (size_t j = 0; j < curWeights.rows; j++)
+        {
+            for (size_t k = 0; k < curWeights.cols; k++)
+            {
+                MAT_AT(curWeights, j, k) /= n;
+            }
+        }
+
+        Matrix curBiases = g.biases[i];
+        for (size_t k = 0; k < curBiases.cols; k++)
+        {
+            MAT_AT(curBiases, 0, k) /= n;
+        }
+    }
+}
+
+// multiplies the gradient dz by the activation derivative, taken from the activated outputs
+void mat_activation_derivative(Matrix dz, Matrix outputs, ActivationType type)
+{
+    if (!mat_same(dz, outputs))
+        return;
+
+    for (size_t i = 0; i < dz.rows; i++)
+    {
+        float *d = &MAT_AT(dz, i, 0);
+        const float *o = &MAT_AT(outputs, i, 0);
+        switch (type)
+        {
+        case SIGMOID:
+            for (size_t j = 0; j < dz.cols; j++)
+                d[j] *= o[j] * (1.f - o[j]);
+            break;
+        case RELU:
+            for (size_t j = 0; j < dz.cols; j++)
+                d[j] = o[j] > 0.f ? d[j] : 0.f;
+            break;
+        case LEAKYRELU:
+            for (size_t j = 0; j < dz.cols; j++)
+                d[j] = o[j] > 0.f ? d[j] : 0.01f * d[j];
+            break;
+        default:
+            // softmax outputs get their gradient w.r.t. the logits directly
+            break;
+        }
+    }
+}
+
+static void network_backward(Network nn, Network g, size_t rows, const SparseRows *in);
+
+// backward pass over the first rows samples of the batch. NETWORK_OUT(g) has to
+// hold the cost gradient w.r.t. the outputs (w.r.t. the logits for softmax), the
+// parameter gradients are added to g.weights and g.biases
+void Network_backward_rows(Network nn, Network g, size_t rows)
+{
+    network_backward(nn, g, rows, NULL);
+}
+
+// Network_backward_rows for a network that was run with Network_forward_sparse(nn, in, ...)
+void Network_backward_sparse(Network nn, Network g, SparseRows in)
+{
+    if (LAYER_IS_CONV(nn, 0))
+        return;
+    network_backward(nn, g, in.rows, &in);
+}
+
+// with in set, the first layer weight gradient comes from the sparse inputs
+static void network_backward(Network nn, Network g, size_t rows, const SparseRows *in)
+{
+    for (size_t l = nn.count; l > 0; l--)
+    {
+        Matrix dz = mat_rows(g.layers[l], 0, rows);
+        if (nn.activations)
+        {
+            mat_activation_derivative(dz, mat_rows(nn.layers[l], 0, rows), nn.activations[l - 1].type);
+        }
+
+        if (LAYER_IS_CONV(nn, l - 1))
+        {
+            Matrix dIn = mat_rows(g.layers[l - 1], 0, rows);
+            conv_backward(mat_rows(nn.layers[l - 1], 0, rows), dz, nn.weights[l - 1], g.weights[l - 1],
+                          g.biases[l - 1], nn.specs[l - 1], l > 1 ? &dIn : NULL);
+            continue;
+        }
+
+        // dW = A^T * dZ, db = colsum(dZ), dA = dZ * W^T
+        if (l == 1 && in)
+            mat_dot_sparse_tn(g.weights[0], *in, dz, true);
+        else
+            mat_dot_ex(g.weights[l - 1], mat_rows(nn.layers[l - 1], 0, rows), true, dz, false, true);
+        mat_col_sum(g.biases[l - 1], dz, true);
+        if (l > 1)
+        {
+            mat_dot_ex(mat_rows(g.layers[l - 1], 0, rows), dz, false, nn.weights[l - 1], true, false);
+        }
+    }
+}
+
+// same gradient as the TRAD_BACKPROP build of Network_backprop, computed a batch at a time
+void Network_backprop_batch(Network nn, Network g, Matrix in, Matrix out)
+{
+    if (in.rows != out.rows || in.rows == 0)
+        return;
+    if (NETWORK_IN(nn).cols != in.cols)
+        return;
+    if (NETWORK_OUT(nn).cols != out.cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    size_t n = in.rows;
+    size_t batch = (nn.batch < g.batch) ? nn.batch : g.batch;
+
+    Network_clear(g);
+
+    for (size_t i = 0; i < n; i += batch)
+    {
+        size_t rows = (n - i < batch) ? n - i : batch;
+        Network_forward_batch(nn, mat_rows(in, i, rows));
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < out.cols; j++)
+            {
+                MAT_AT(NETWORK_OUT(g), r, j) = 2 * (MAT_AT(NETWORK_OUT(nn), r, j) - MAT_AT(out, i + r, j));
+            }
+        }
+        Network_backward_rows(nn, g, rows);
+    }
+
+    Network_scale(g, 1.f / n);
+}
+
+void Network_policy_gradient_backprop_batch(Network nn, Network g, Step *steps[], size_t stepAmount)
+{
+    if (stepAmount == 0)
+        return;
+    if (NETWORK_IN(nn).cols != steps[0]->state.cols)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    size_t n = stepAmount;
+    size_t batch = (nn.batch < g.batch) ? nn.batch : g.batch;
+
+    Network_clear(g);
+
+    for (size_t i = 0; i < n; i += batch)
+    {
+        size_t rows = (n - i < batch) ? n - i : batch;
+        for (size_t r = 0; r < rows; r++)
+        {
+            mat_copy(mat_row(NETWORK_IN(nn), r), steps[i + r]->state);
+        }
+        Network_forward_rows(nn, rows);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            Step *step = steps[i + r];
+            for (size_t j = 0; j < NETWORK_OUT(nn).cols; j++)
+            {
+                float P_k = MAT_AT(NETWORK_OUT(nn), r, j);
+                MAT_AT(NETWORK_OUT(g), r, j) = (P_k - ((size_t)step->action == j)) * step->reward;
+            }
+        }
+        Network_backward_rows(nn, g, rows);
+    }
+
+    Network_scale(g, 1.f / n);
+}
+
+// gradient of -return * log(softmax)[action] w.r.t. the logits of steps first..first+rows
+static void policy_output_gradient(Network nn, Network g, Trajectory t, size_t first, size_t rows)
+{
+    for (size_t r = 0; r < rows; r++)
+    {
+        uint8_t action = t.actions[first + r];
+        float reward = t.returns[first + r];
+        for (size_t j = 0; j < NETWORK_OUT(nn).cols; j++)
+        {
+            float P_k = MAT_AT(NETWORK_OUT(nn), r, j);
+            MAT_AT(NETWORK_OUT(g), r, j) = (P_k - (action == j ? 1 : 0)) * reward;
+        }
+    }
+}
+
+// Network_policy_gradient_backprop_batch over a compact trajectory, states are
+// decoded a batch at a time straight into the input layer
+void Network_policy_gradient_backprop_trajectory(Network nn, Network g, Trajectory t)
+{
+    if (t.count == 0)
+        return;
+    if (NETWORK_IN(nn).cols != t.stateLen)
+        return;
+    if (!Network_same(nn, g))
+        return;
+    size_t n = t.count;
+    size_t batch = (nn.batch < g.batch) ? nn.batch : g.batch;
+
+    Network_clear(g);
+
+    for (size_t i = 0; i < n; i += batch)
+    {
+        size_t rows = (n - i < batch) ? n - i : batch;
+        Trajectory_expand(t, i, mat_rows(NETWORK_IN(nn), 0, rows));
+        Network_forward_rows(nn, rows);
+        policy_output_gradient(nn, g, t, i, rows);
+        Network_backward_rows(nn, g, rows);
+    }
+
+    Network_scale(g, 1.f / n);
+}
+
+// Network_policy_gradient_backprop_trajectory with a sparse first layer, the
+// first layer work scales with the nonzero cells instead of the input width
+void Network_policy_gradient_backprop_sparse(Network nn, Network g, Trajectory t)
+{
+    if (t.count == 0)
+        return;
+    if (NETWORK_IN(nn).cols != t.stateLen)
+        return;
+    if (!Network_same(nn, g) || LAYER_IS_CONV(nn, 0))
+        return;
+    size_t n = t.count;
+    size_t batch = (nn.batch < g.batch) ? nn.batch : g.batch;
+    SparseRows in = sparse_alloc(batch, t.stateLen, batch * t.stateLen);
+
+    Network_clear(g);
+
+    for (size_t i = 0; i < n; i += batch)
+    {
+        size_t rows = (n - i < batch) ? n - i : batch;
+        sparse_from_trajectory(&in, t, i, rows);
+        Network_forward_sparse(nn, in, true);
+        policy_output_gradient(nn, g, t, i, rows);
+        Network_backward_sparse(nn, g, in);
+    }
+
+    Network_scale(g, 1.f / n);
+    sparse_free(in);
+}
+
+void Network_gradient_descent(Network nn, Network g, float rate)
+{
+    if (!Network_same(nn, g))
+        return;
+
+    for (size_t i = 0; i < nn.paramCount; i++)
+    {
+        nn.params[i] -= rate * g.params[i];
+    }
+}
+
+void Network_gradient_ascent(Network nn, Network g, float rate)
+{
+    if (!Network_same(nn, g))
+        return;
+
+    for (size_t i = 0; i < nn.paramCount; i++)
+    {
+        nn.params[i] += rate * g.params[i];
+    }
+}
+
+// the usual defaults for each rule, the moments start at zero
+Optimizer Optimizer_alloc(Network nn, OptimizerType type, float rate)
+{
+    Optimizer opt = {0};
+    opt.type = type;
+    opt.rate = rate;
+    opt.beta1 = 0.9f;
+    opt.beta2 = type == OPTIMIZER_RMSPROP ? 0.99f : 0.999f;
+    opt.epsilon = 1e-8f;
+    opt.count = nn.paramCount;
+    if (type == OPTIMIZER_MOMENTUM || type == OPTIMIZER_ADAM)
+        opt.m = (float *)ml_aligned_alloc(ML_ALIGNMENT, sizeof(*opt.m) * opt.count);
+    if (type == OPTIMIZER_RMSPROP || type == OPTIMIZER_ADAM)
+        opt.v = (float *)ml_aligned_alloc(ML_ALIGNMENT, sizeof(*opt.v) * opt.count);
+    Optimizer_reset(&opt);
+    return opt;
+}
+
+void Optimizer_free(Optimizer opt)
+{
+    ml_aligned_free(opt.m);
+    ml_aligned_free(opt.v);
+}
+
+void Optimizer_reset(Optimizer *opt)
+{
+    opt->steps = 0;
+    if (opt->m)
+        memset(opt->m, 0, sizeof(*opt->m) * opt->count);
+    if (opt->v)
+        memset(opt->v, 0, sizeof(*opt->v) * opt->count);
+}
+
+// everything one step needs, with clipping and Adam's bias correction already folded in
+typedef struct OptimizerStep
+{
+    OptimizerType type;
+    float scale; // applied to the gradient
+    float rate;
+    float decay; // params are multiplied by it before the update
+    float beta1;
+    float beta2;
+    float epsilon;
+} OptimizerStep;
+
+static void optimizer_update(OptimizerStep k, float *p, const float *grad, float *m, float *v, size_t first, size_t n)
+{
+    for (size_t i = first; i < n; i++)
+    {
+        float g = grad[i] * k.scale;
+        float update = g;
+        switch (k.type)
+        {
+        case OPTIMIZER_SGD:
+            break;
+        case OPTIMIZER_MOMENTUM:
+            m[i] = k.beta1 * m[i] + g;
+            update = m[i];
+            break;
+        case OPTIMIZER_RMSPROP:
+            v[i] = k.beta2 * v[i] + (1.f - k.beta2) * g * g;
+            update = g / (sqrtf(v[i]) + k.epsilon);
+            break;
+        case OPTIMIZER_ADAM:
+            m[i] = k.beta1 * m[i] + (1.f - k.beta1) * g;
+            v[i] = k.beta2 * v[i] + (1.f - k.beta2) * g * g;
+            update = m[i] / (sqrtf(v[i]) + k.epsilon);
+            break;
+        }
+        p[i] = p[i] * k.decay - k.rate * update;
+    }
+}
+
+static float sum_squares(const float *x, size_t n)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += (double)x[i] * x[i];
+    }
+    return (float)sum;
+}
+
+#ifdef ML_X86_SIMD
+
+// the rule is picked once per call, each loop body is one load and store per array
+__attribute__((target("avx2,fma"))) static size_t optimizer_update_avx2(OptimizerStep k, float *p, const float *grad, float *m, float *v, size_t n)
+{
+    __m256 scale = _mm256_set1_ps(k.scale);
+    __m256 rate = _mm256_set1_ps(-k.rate);
+    __m256 decay = _mm256_set1_ps(k.decay);
+    __m256 beta1 = _mm256_set1_ps(k.beta1);
+    __m256 beta2 = _mm256_set1_ps(k.beta2);
+    __m256 oneBeta1 = _mm256_set1_ps(1.f - k.beta1);
+    __m256 oneBeta2 = _mm256_set1_ps(1.f - k.beta2);
+    __m256 epsilon = _mm256_set1_ps(k.epsilon);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 g = _mm256_mul_ps(_mm256_loadu_ps(grad + i), scale);
+        __m256 update = g;
+        if (k.type == OPTIMIZER_MOMENTUM)
+        {
+            update = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(m + i), g);
+            _mm256_storeu_ps(m + i, update);
+        }
+        else if (k.type == OPTIMIZER_RMSPROP)
+        {
+            __m256 vi = _mm256_fmadd_ps(beta2, _mm256_loadu_ps(v + i), _mm256_mul_ps(oneBeta2, _mm256_mul_ps(g, g)));
+            _mm256_storeu_ps(v + i, vi);
+            update = _mm256_div_ps(g, _mm256_add_ps(_mm256_sqrt_ps(vi), epsilon));
+        }
+        else if (k.type == OPTIMIZER_ADAM)
+        {
+            __m256 mi = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(m + i), _mm256_mul_ps(oneBeta1, g));
+            __m256 vi = _mm256_fmadd_ps(beta2, _mm256_loadu_ps(v + i), _mm256_mul_ps(oneBeta2, _mm256_mul_ps(g, g)));
+            _mm256_storeu_ps(m + i, mi);
+            _mm256_storeu_ps(v + i, vi);
+            update = _mm256_div_ps(mi, _mm256_add_ps(_mm256_sqrt_ps(vi), epsilon));
+        }
+        __m256 pi = _mm256_mul_ps(_mm256_loadu_ps(p + i), decay);
+        _mm256_storeu_ps(p + i, _mm256_fmadd_ps(rate, update, pi));
+    }
+    return i;
+}
+
+__attribute__((target("avx2,fma"))) static float sum_squares_avx2(const float *x, size_t n)
+{
+    // four accumulators hide the fma latency
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        for (size_t a = 0; a < 4; a++)
+        {
+            __m256 xi = _mm256_loadu_ps(x + i + 8 * a);
+            acc[a] = _mm256_fmadd_ps(xi, xi, acc[a]);
+        }
+    }
+    __m256 sum = _mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3]));
+    return hsum256_ps(sum) + sum_squares(x + i, n - i);
+}
+
+#endif // ML_X86_SIMD
+
+// L2 norm of the whole gradient arena
+float Network_grad_norm(Network g)
+{
+#ifdef ML_X86_SIMD
+    if (gemm_get_kernel() == GEMM_AVX2)
+        return sqrtf(sum_squares_avx2(g.params, g.paramCount));
+#endif // ML_X86_SIMD
+    return sqrtf(sum_squares(g.params, g.paramCount));
+}
+
+// one update of nn from the gradient in g, descending.
+// Returns the gradient norm before clipping, 0 when clipping is off
+float Optimizer_step(Optimizer *opt, Network nn, Network g)
+{
+    if (!Network_same(nn, g) || nn.paramCount != opt->count)
+        return -1.f;
+
+    float norm = 0.f;
+    OptimizerStep k = {opt->type, 1.f, opt->rate, 1.f - opt->rate * opt->weightDecay, opt->beta1, opt->beta2, opt->epsilon};
+    if (opt->clipNorm > 0.f)
+    {
+        norm = Network_grad_norm(g);
+        if (norm > opt->clipNorm)
+            k.scale = opt->clipNorm / norm;
+    }
+
+    opt->steps++;
+    if (opt->type == OPTIMIZER_ADAM)
+    {
+        // m / (1 - beta1^t) over sqrt(v / (1 - beta2^t)) + eps, moved onto the rate and eps
+        float correction1 = 1.f - powf(opt->beta1, (float)opt->steps);
+        float correction2 = sqrtf(1.f - powf(opt->beta2, (float)opt->steps));
+        k.rate = opt->rate * correction2 / correction1;
+        k.epsilon = opt->epsilon * correction2;
+    }
+
+    size_t done = 0;
+#ifdef ML_X86_SIMD
+    if (gemm_get_kernel() == GEMM_AVX2)
+        done = optimizer_update_avx2(k, nn.params, g.params, opt->m, opt->v, nn.paramCount);
+#endif // ML_X86_SIMD
+    optimizer_update(k, nn.params, g.params, opt->m, opt->v, done, nn.paramCount);
+    return norm;
+}
+
+size_t ml_cpu_count(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t)count : 1;
+#endif
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+#define ml_mutex_init(m) InitializeCriticalSection(m)
+#define ml_mutex_destroy(m) DeleteCriticalSection(m)
+#define ml_mutex_lock(m) EnterCriticalSection(m)
+#define ml_mutex_unlock(m) LeaveCriticalSection(m)
+#define ml_cond_init(c) InitializeConditionVariable(c)
+#define ml_cond_destroy(c) ((void)(c))
+#define ml_cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define ml_cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+#define ml_mutex_init(m) pthread_mutex_init(m, NULL)
+#define ml_mutex_destroy(m) pthread_mutex_destroy(m)
+#define ml_mutex_lock(m) pthread_mutex_lock(m)
+#define ml_mutex_unlock(m) pthread_mutex_unlock(m)
+#define ml_cond_init(c) pthread_cond_init(c, NULL)
+#define ml_cond_destroy(c) pthread_cond_destroy(c)
+#define ml_cond_wait(c, m) pthread_cond_wait(c, m)
+#define ml_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+typedef struct MlThreadStart
+{
+    void (*run)(void *arg);
+    void *arg;
+} MlThreadStart;
+
+#if defined(_WIN32) || defined(_WIN64)
+static DWORD WINAPI ml_thread_main(LPVOID arg)
+#else
+static void *ml_thread_main(void *arg)
+#endif
+{
+    MlThreadStart start = *(MlThreadStart *)arg;
+    free(arg);
+    start.run(start.arg);
+    gemm_thread_cleanup();
+#if defined(_WIN32) || defined(_WIN64)
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// runs run(arg) on a new thread
+static bool ml_thread_start(MlThread *thread, void (*run)(void *arg), void *arg)
+{
+    MlThreadStart *start = (MlThreadStart *)malloc(sizeof(*start));
+    start->run = run;
+    start->arg = arg;
+#if defined(_WIN32) || defined(_WIN64)
+    *thread = CreateThread(NULL, 0, ml_thread_main, start, 0, NULL);
+    bool started = *thread != NULL;
+#else
+    bool started = pthread_create(thread, NULL, ml_thread_main, start) == 0;
+#endif
+    if (!started)
+        free(start);
+    return started;
+}
+
+static void ml_thread_join(MlThread thread)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+typedef struct PoolWorker
+{
+    ThreadPool *pool;
+    size_t index;
+} PoolWorker;
+
+// claims tasks of the current job until none are left
+static void pool_drain(ThreadPool *pool, size_t worker)
+{
+    for (;;)
+    {
+        ml_mutex_lock(&pool->lock);
+        if (pool->next >= pool->total)
+        {
+            ml_mutex_unlock(&pool->lock);
+            return;
+        }
+        size_t task = pool->next++;
+        PoolTask run = pool->task;
+        void *arg = pool->arg;
+        ml_mutex_unlock(&pool->lock);
+
+        run(arg, task, worker);
+
+        ml_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->total)
+            ml_cond_broadcast(&pool->done);
+        ml_mutex_unlock(&pool->lock);
+    }
+}
+
+static void pool_loop(void *arg)
+{
+    PoolWorker *self = (PoolWorker *)arg;
+    ThreadPool *pool = self->pool;
+    size_t worker = self->index;
+    free(self);
+
+    size_t seen = 0;
+    for (;;)
+    {
+        ml_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->stop)
+        {
+            ml_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop)
+        {
+            ml_mutex_unlock(&pool->lock);
+            return;
+        }
+        seen = pool->generation;
+        ml_mutex_unlock(&pool->lock);
+        pool_drain(pool, worker);
+    }
+}
+
+// threads == 0 uses one thread per core, counting the caller
+ThreadPool *ThreadPool_create(size_t threads)
+{
+    if (threads == 0)
+        threads = ml_cpu_count() - 1;
+
+    ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(*pool));
+    pool->threads = (MlThread *)malloc(sizeof(*pool->threads) * (threads ? threads : 1));
+    ml_mutex_init(&pool->lock);
+    ml_cond_init(&pool->wake);
+    ml_cond_init(&pool->done);
+    for (size_t i = 0; i < threads; i++)
+    {
+        PoolWorker *worker = (PoolWorker *)malloc(sizeof(*worker));
+        worker->pool = pool;
+        worker->index = i + 1;
+        if (!ml_thread_start(&pool->threads[i], pool_loop, worker))
+        {
+            fprintf(stderr, "Failed to start worker thread %zu\n", i);
+            free(worker);
+            break;
+        }
+        pool->count++;
+    }
+    return pool;
+}
+
+// runs task(arg, i, worker) for every i < tasks and returns once all of them are done
+void ThreadPool_run(ThreadPool *pool, size_t tasks, PoolTask task, void *arg)
+{
+    if (tasks == 0)
+        return;
+
+    ml_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->next = 0;
+    pool->total = tasks;
+    pool->finished = 0;
+    pool->generation++;
+    ml_cond_broadcast(&pool->wake);
+    ml_mutex_unlock(&pool->lock);
+
+    pool_drain(pool, 0);
+
+    ml_mutex_lock(&pool->lock);
+    while (pool->finished < pool->total)
+    {
+        ml_cond_wait(&pool->done, &pool->lock);
+    }
+    ml_mutex_unlock(&pool->lock);
+}
+
+void ThreadPool_destroy(ThreadPool *pool)
+{
+    ml_mutex_lock(&pool->lock);
+    pool->stop = true;
+    ml_cond_broadcast(&pool->wake);
+    ml_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->count; i++)
+    {
+        ml_thread_join(pool->threads[i]);
+    }
+    ml_mutex_destroy(&pool->lock);
+    ml_cond_destroy(&pool->wake);
+    ml_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
+
+// threads and chunk follow ThreadPool_create, chunk == 0 uses nn.batch samples per leaf.
+// Gradients only depend on chunk, never on threads
+DataParallel DataParallel_alloc(Network nn, size_t threads, size_t chunk)
+{
+    DataParallel dp;
+    dp.pool = ThreadPool_create(threads);
+    dp.chunk = chunk ? chunk : nn.batch;
+    size_t workers = dp.pool->count + 1;
+    dp.replicas = (Network *)malloc(sizeof(*dp.replicas) * workers);
+    dp.grads = (Network *)malloc(sizeof(*dp.grads) * workers);
+    for (size_t i = 0; i < workers; i++)
+    {
+        dp.replicas[i] = Network_replica(nn, dp.chunk);
+        dp.grads[i] = Network_replica(nn, dp.chunk);
+    }
+    dp.leafStride = ML_ALIGN_FLOATS(nn.paramCount);
+    dp.leaves = (float *)ml_aligned_alloc(ML_ALIGNMENT, sizeof(*dp.leaves) * dp.leafStride * DATA_PARALLEL_LEAVES);
+    memset(dp.leaves, 0, sizeof(*dp.leaves) * dp.leafStride * DATA_PARALLEL_LEAVES);
+    return dp;
+}
+
+void DataParallel_free(DataParallel dp)
+{
+    for (size_t i = 0; i < dp.pool->count + 1; i++)
+    {
+        Network_free(dp.replicas[i]);
+        Network_free(dp.grads[i]);
+    }
+    ThreadPool_destroy(dp.pool);
+    free(dp.replicas);
+    free(dp.grads);
+    ml_aligned_free(dp.leaves);
+}
+
+typedef struct DataParallelJob
+{
+    DataParallel *dp;
+    Matrix in; // set for DataParallel_backprop
+    Matrix out;
+    Trajectory t; // set for DataParallel_policy_gradient
+    size_t n;
+    size_t first; // sample of leaf 0
+    size_t width; // leaves summed into one at the current tree level
+    size_t pairs;
+} DataParallelJob;
+
+// forward and backward of one chunk, the gradient lands in its leaf
+static void data_parallel_leaf(void *arg, size_t task, size_t worker)
+{
+    DataParallelJob *job = (DataParallelJob *)arg;
+    DataParallel *dp = job->dp;
+    Network nn = dp->replicas[worker];
+    Network *g = &dp->grads[worker];
+    size_t first = job->first + task * dp->chunk;
+    size_t rows = (job->n - first < dp->chunk) ? job->n - first : dp->chunk;
+
+    network_rebase(g, dp->leaves + task * dp->leafStride);
+    memset(g->params, 0, sizeof(*g->params) * g->paramCount);
+    if (job->t.states)
+    {
+        Trajectory_expand(job->t, first, mat_rows(NETWORK_IN(nn), 0, rows));
+        Network_forward_rows(nn, rows);
+        policy_output_gradient(nn, *g, job->t, first, rows);
+    }
+    else
+    {
+        mat_copy(mat_rows(NETWORK_IN(nn), 0, rows), mat_rows(job->in, first, rows));
+        Network_forward_rows(nn, rows);
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < job->out.cols; j++)
+            {
+                MAT_AT(NETWORK_OUT(*g), r, j) = 2 * (MAT_AT(NETWORK_OUT(nn), r, j) - MAT_AT(job->out, first + r, j));
+            }
+        }
+    }
+    Network_backward_rows(nn, *g, rows);
+}
+
+// leaf[2 * width * pair] += leaf[2 * width * pair + width], a slice of the params at a time
+#define DATA_PARALLEL_SLICE (16 * 1024)
+
+static void data_parallel_pair(void *arg, size_t task, size_t worker)
+{
+    (void)worker;
+    DataParallelJob *job = (DataParallelJob *)arg;
+    DataParallel *dp = job->dp;
+    size_t pair = task % job->pairs;
+    size_t start = task / job->pairs * DATA_PARALLEL_SLICE;
+    size_t end = (start + DATA_PARALLEL_SLICE < dp->leafStride) ? start + DATA_PARALLEL_SLICE : dp->leafStride;
+    float *a = dp->leaves + 2 * job->width * pair * dp->leafStride;
+    const float *b = a + job->width * dp->leafStride;
+    for (size_t i = start; i < end; i++)
+    {
+        a[i] += b[i];
+    }
+}
+
+static void data_parallel_run(DataParallel dp, Network g, DataParallelJob *job)
+{
+    size_t slices = (dp.leafStride + DATA_PARALLEL_SLICE - 1) / DATA_PARALLEL_SLICE;
+    Network_clear(g);
+    for (job->first = 0; job->first < job->n; job->first += dp.chunk * DATA_PARALLEL_LEAVES)
+    {
+        size_t leaves = (job->n - job->first + dp.chunk - 1) / dp.chunk;
+        if (leaves > DATA_PARALLEL_LEAVES)
+            leaves = DATA_PARALLEL_LEAVES;
+        ThreadPool_run(dp.pool, leaves, data_parallel_leaf, job);
+
+        // pairwise tree over the leaves, its shape only depends on their count
+        for (job->width = 1; job->width < leaves; job->width *= 2)
+        {
+            job->pairs = (leaves - job->width + 2 * job->width - 1) / (2 * job->width);
+            ThreadPool_run(dp.pool, job->pairs * slices, data_parallel_pair, job);
+        }
+        for (size_t i = 0; i < g.paramCount; i++)
+        {
+            g.params[i] += dp.leaves[i];
+        }
+    }
+    Network_scale(g, 1.f / job->n);
+}
+
+// Network_backprop_batch split over the pool, nn is the network dp was made from
+void DataParallel_backprop(DataParallel dp, Network g, Matrix in, Matrix out)
+{
+    if (in.rows != out.rows || in.rows == 0)
+        return;
+    if (NETWORK_IN(dp.replicas[0]).cols != in.cols)
+        return;
+    if (NETWORK_OUT(dp.replicas[0]).cols != out.cols)
+        return;
+    if (!Network_same(dp.replicas[0], g))
+        return;
+
+    DataParallelJob job = {0};
+    job.dp = &dp;
+    job.in = in;
+    job.out = out;
+    job.n = in.rows;
+    data_parallel_run(dp, g, &job);
+}
+
+// Network_policy_gradient_backprop_trajectory split over the pool
+void DataParallel_policy_gradient(DataParallel dp, Network g, Trajectory t)
+{
+    if (t.count == 0)
+        return;
+    if (NETWORK_IN(dp.replicas[0]).cols != t.stateLen)
+        return;
+    if (!Network_same(dp.replicas[0], g))
+        return;
+
+    DataParallelJob job = {0};
+    job.dp = &dp;
+    job.t = t;
+    job.n = t.count;
+    data_parallel_run(dp, g, &job);
+}
+
+typedef struct GradCheckJob
+{
+    Network *copies; // one per worker, perturbed in place
+    const size_t *indices;
+    size_t count;
+    size_t perTask;
+    float eps;
+    Matrix in; // set for Network_grad_check
+    Matrix out;
+    Trajectory t; // set for Network_policy_grad_check
+    float *numeric; // central difference of indices[i]
+} GradCheckJob;
+
+static float grad_check_cost(GradCheckJob *job, Network nn)
+{
+    if (job->t.states)
+        return Network_policy_cost_trajectory(nn, job->t);
+    return Network_cost(nn, job->in, job->out);
+}
+
+static void grad_check_task(void *arg, size_t task, size_t worker)
+{
+    GradCheckJob *job = (GradCheckJob *)arg;
+    Network nn = job->copies[worker];
+    size_t end = (task + 1) * job->perTask;
+    if (end > job->count)
+        end = job->count;
+    for (size_t i = task * job->perTask; i < end; i++)
+    {
+        float *param = &nn.params[job->indices[i]];
+        float saved = *param;
+        *param = saved + job->eps;
+        float plus = grad_check_cost(job, nn);
+        *param = saved - job->eps;
+        float minus = grad_check_cost(job, nn);
+        *param = saved;
+        job->numeric[i] = (plus - minus) / (2.f * job->eps);
+    }
+}
+
+// central differences of count random params (all of them when count is 0 or too
+// large) on per worker copies of nn, compared against the analytic gradient in g.
+// The forward pass is float, eps around 1e-2 keeps its noise below the error of the difference
+static GradCheck grad_check(ThreadPool *pool, Network nn, Network g, GradCheckJob *job)
+{
+    GradCheck result = {0};
+    if (!Network_same(nn, g))
+        return result;
+
+    // arena padding is not a parameter, only offsets inside the matrices are picked
+    size_t total = 0;
+    size_t *indices = (size_t *)malloc(sizeof(*indices) * nn.paramCount);
+    for (size_t l = 0; l < nn.count; l++)
+    {
+        Matrix m[2] = {nn.weights[l], nn.biases[l]};
+        for (size_t k = 0; k < 2; k++)
+        {
+            size_t offset = (size_t)(m[k].es - nn.params);
+            for (size_t i = 0; i < m[k].rows * m[k].cols; i++)
+            {
+                indices[total++] = offset + i;
+            }
+        }
+    }
+    size_t count = (job->count == 0 || job->count > total) ? total : job->count;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t j = i + Rng_bounded(Rng_thread(), (uint32_t)(total - i));
+        size_t temp = indices[i];
+        indices[i] = indices[j];
+        indices[j] = temp;
+    }
+
+    bool ownPool = pool == NULL;
+    if (ownPool)
+        pool = ThreadPool_create(0);
+    size_t workers = pool->count + 1;
+    job->copies = (Network *)malloc(sizeof(*job->copies) * workers);
+    for (size_t i = 0; i < workers; i++)
+    {
+        job->copies[i] = Network_clone(nn);
+    }
+    job->indices = indices;
+    job->count = count;
+    // a few tasks per worker so uneven costs still balance
+    job->perTask = (count + workers * 4 - 1) / (workers * 4);
+    job->numeric = (float *)malloc(sizeof(*job->numeric) * count);
+    ThreadPool_run(pool, (count + job->perTask - 1) / job->perTask, grad_check_task, job);
+
+    result.checked = count;
+    for (size_t i = 0; i < count; i++)
+    {
+        float numeric = job->numeric[i];
+        float analytic = g.params[indices[i]];
+        float absError = fabsf(numeric - analytic);
+        float scale = fabsf(numeric) + fabsf(analytic);
+        float relError = absError / (scale > GRAD_CHECK_FLOOR ? scale : GRAD_CHECK_FLOOR);
+        if (absError > result.maxAbsError)
+            result.maxAbsError = absError;
+        if (relError > result.maxRelError || i == 0)
+        {
+            result.maxRelError = relError;
+            result.worst = indices[i];
+        }
+    }
+
+    for (size_t i = 0; i < workers; i++)
+    {
+        Network_free(job->copies[i]);
+    }
+    free(job->copies);
+    free(job->numeric);
+    free(indices);
+    if (ownPool)
+        ThreadPool_destroy(pool);
+    return result;
+}
+
+// checks a Network_backprop_batch gradient in g against Network_cost, pool may be NULL
+GradCheck Network_grad_check(ThreadPool *pool, Network nn, Network g, float eps, size_t count, Matrix in, Matrix out)
+{
+    GradCheckJob job = {0};
+    job.eps = eps;
+    job.count = count;
+    job.in = in;
+    job.out = out;
+    return grad_check(pool, nn, g, &job);
+}
+
+// checks a Network_policy_gradient_backprop_trajectory gradient in g against Network_policy_cost_trajectory
+GradCheck Network_policy_grad_check(ThreadPool *pool, Network nn, Network g, float eps, size_t count, Trajectory t)
+{
+    GradCheckJob job = {0};
+    job.eps = eps;
+    job.count = count;
+    job.t = t;
+    return grad_check(pool, nn, g, &job);
+}
+
+static void checkpoint_path(const Checkpointer *c, uint64_t step, char *path, size_t size)
+{
+    snprintf(path, size, "%s.%llu%s", c->prefix, (unsigned long long)step, fileExtension);
+}
+
+// replaces dest, atomic as long as both are on one volume
+static bool checkpoint_rename(const char *src, const char *dest)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    return MoveFileExA(src, dest, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(src, dest) == 0;
+#endif
+}
+
+// makes the renames in the checkpoint directory durable, MoveFileEx already wrote them through on Windows
+static void checkpoint_sync_dir(const Checkpointer *c)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    char dir[FILENAME_MAX];
+    snprintf(dir, sizeof(dir), "%s", c->prefix);
+    char *slash = strrchr(dir, '/');
+    if (!slash)
+        snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    close(fd);
+#else
+    (void)c;
+#endif
+}
+
+// the index lists the kept steps oldest first, one per line, and is replaced like a checkpoint
+static bool checkpoint_write_index(const Checkpointer *c)
+{
+    char path[FILENAME_MAX];
+    char temp[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s.index", c->prefix);
+    snprintf(temp, sizeof(temp), "%s.index.tmp", c->prefix);
+    FILE *index = fopen(temp, "w");
+    if (!index)
+        return false;
+    for (size_t i = 0; i < c->stepCount; i++)
+    {
+        fprintf(index, "%llu\n", (unsigned long long)c->steps[i]);
+    }
+    bool ok = file_sync(index);
+    ok = (fclose(index) == 0) && ok;
+    if (!ok)
+        remove(temp);
+    return ok && checkpoint_rename(temp, path);
+}
+
+static void checkpoint_write(Checkpointer *c, Network snapshot, uint64_t step)
+{
+    char path[FILENAME_MAX];
+    char temp[FILENAME_MAX + 8];
+    checkpoint_path(c, step, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    if (!Network_write(snapshot, temp) || !checkpoint_rename(temp, path))
+    {
+        fprintf(stderr, "Failed to write checkpoint %s\n", path);
+        remove(temp);
+        return;
+    }
+
+    // the new checkpoint is in place before older ones are dropped
+    if (c->stepCount > 0 && c->steps[c->stepCount - 1] == step)
+        c->stepCount--;
+    c->steps[c->stepCount++] = step;
+    size_t drop = c->stepCount > c->keep ? c->stepCount - c->keep : 0;
+    uint64_t dropped[CHECKPOINT_MAX_KEEP];
+    memcpy(dropped, c->steps, sizeof(*dropped) * drop);
+    memmove(c->steps, c->steps + drop, sizeof(*c->steps) * (c->stepCount - drop));
+    c->stepCount -= drop;
+    checkpoint_write_index(c);
+    checkpoint_sync_dir(c);
+    for (size_t i = 0; i < drop; i++)
+    {
+        checkpoint_path(c, dropped[i], path, sizeof(path));
+        remove(path);
+    }
+}
+
+static void checkpoint_loop(void *arg)
+{
+    Checkpointer *c = (Checkpointer *)arg;
+    ml_mutex_lock(&c->lock);
+    for (;;)
+    {
+        while (!c->hasPending && !c->stop)
+        {
+            ml_cond_wait(&c->wake, &c->lock);
+        }
+        if (!c->hasPending)
+            break;
+
+        Network taken = c->pending;
+        c->pending = c->writing;
+        c->writing = taken;
+        uint64_t step = c->pendingStep;
+        c->hasPending = false;
+        c->busy = true;
+        ml_mutex_unlock(&c->lock);
+
+        checkpoint_write(c, taken, step);
+
+        ml_mutex_lock(&c->lock);
+        c->busy = false;
+        ml_cond_broadcast(&c->idle);
+    }
+    ml_mutex_unlock(&c->lock);
+}
+
+// the last keep checkpoints of nn go to <prefix>.<step>.netw. The ones listed in an
+// existing <prefix>.index are picked up, so rotation carries on after a restart
+Checkpointer *Checkpointer_create(Network nn, const char *prefix, size_t keep)
+{
+    Checkpointer *c = (Checkpointer *)calloc(1, sizeof(*c));
+    snprintf(c->prefix, sizeof(c->prefix), "%s", prefix);
+    c->keep = keep == 0 ? 1 : (keep > CHECKPOINT_MAX_KEEP ? CHECKPOINT_MAX_KEEP : keep);
+    c->pending = network_like(nn, 1, NULL);
+    c->writing = network_like(nn, 1, NULL);
+
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s.index", c->prefix);
+    FILE *index = fopen(path, "r");
+    unsigned long long step;
+    while (index && c->stepCount < CHECKPOINT_MAX_KEEP && fscanf(index, "%llu", &step) == 1)
+    {
+        c->steps[c->stepCount++] = step;
+    }
+    if (index)
+        fclose(index);
+
+    ml_mutex_init(&c->lock);
+    ml_cond_init(&c->wake);
+    ml_cond_init(&c->idle);
+    if (!ml_thread_start(&c->thread, checkpoint_loop, c))
+    {
+        fprintf(stderr, "Failed to start the checkpoint thread\n");
+        c->stop = true;
+    }
+    return c;
+}
+
+// copies the params of nn and returns, the copy is written in the background.
+// A snapshot still waiting when the next one comes in is replaced by it,
+// so the caller never waits on the disk
+bool Checkpointer_save(Checkpointer *c, Network nn, uint64_t step)
+{
+    ml_mutex_lock(&c->lock);
+    if (c->stop || !Network_same(nn, c->pending))
+    {
+        ml_mutex_unlock(&c->lock);
+        return false;
+    }
+    Network_copy_params(c->pending, nn);
+    c->pendingStep = step;
+    c->hasPending = true;
+    ml_cond_broadcast(&c->wake);
+    ml_mutex_unlock(&c->lock);
+    return true;
+}
+
+// waits until every snapshot taken so far is on disk
+void Checkpointer_flush(Checkpointer *c)
+{
+    ml_mutex_lock(&c->lock);
+    while (!c->stop && (c->hasPending || c->busy))
+    {
+        ml_cond_wait(&c->idle, &c->lock);
+    }
+    ml_mutex_unlock(&c->lock);
+}
+
+// loads the newest checkpoint that reads back intact into nn and falls back to older
+// ones when it does not
+bool Checkpointer_resume(Checkpointer *c, Network nn, uint64_t *step)
+{
+    Checkpointer_flush(c);
+    char path[FILENAME_MAX];
+    for (size_t i = c->stepCount; i > 0; i--)
+    {
+        checkpoint_path(c, c->steps[i - 1], path, sizeof(path));
+        if (Network_read(nn, path))
+        {
+            if (step)
+                *step = c->steps[i - 1];
+            return true;
+        }
+    }
+    return false;
+}
+
+// writes what is still pending, then stops the thread
+void Checkpointer_destroy(Checkpointer *c)
+{
+    ml_mutex_lock(&c->lock);
+    bool running = !c->stop;
+    c->stop = true;
+    ml_cond_broadcast(&c->wake);
+    ml_mutex_unlock(&c->lock);
+    if (running)
+        ml_thread_join(c->thread);
+
+    ml_mutex_destroy(&c->lock);
+    ml_cond_destroy(&c->wake);
+    ml_cond_destroy(&c->idle);
+    Network_free(c->pending);
+    Network_free(c->writing);
+    free(c);
+}
+
+static void ring_init(RingQueue *q, size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    q->cells = (RingCell *)malloc(sizeof(*q->cells) * size);
+    q->mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+    {
+        q->cells[i].sequence = (int64_t)i;
+    }
+    q->head = 0;
+    q->tail = 0;
+}
+
+static bool ring_push(RingQueue *q, size_t value)
+{
+    int64_t pos = ml_atomic_load(&q->tail);
+    RingCell *cell;
+    for (;;)
+    {
+        cell = &q->cells[(size_t)pos & q->mask];
+        int64_t ahead = ml_atomic_load(&cell->sequence) - pos;
+        if (ahead == 0 && ml_atomic_cas(&q->tail, pos, pos + 1))
+            break;
+        if (ahead < 0)
+            return false; // full
+        pos = ml_atomic_load(&q->tail);
+    }
+    cell->value = value;
+    ml_atomic_store(&cell->sequence, pos + 1);
+    return true;
+}
+
+static bool ring_pop(RingQueue *q, size_t *value)
+{
+    int64_t pos = ml_atomic_load(&q->head);
+    RingCell *cell;
+    for (;;)
+    {
+        cell = &q->cells[(size_t)pos & q->mask];
+        int64_t ahead = ml_atomic_load(&cell->sequence) - (pos + 1);
+        if (ahead == 0 && ml_atomic_cas(&q->head, pos, pos + 1))
+            break;
+        if (ahead < 0)
+            return false; // empty
+        pos = ml_atomic_load(&q->head);
+    }
+    *value = cell->value;
+    ml_atomic_store(&cell->sequence, pos + (int64_t)q->mask + 1);
+    return true;
+}
+
+// slots trajectories of capacity steps each, all empty
+TrajectoryQueue *TrajectoryQueue_alloc(size_t slots, size_t capacity, size_t stateLen, const float *codeValues, size_t codeCount)
+{
+    TrajectoryQueue *q = (TrajectoryQueue *)ml_aligned_alloc(ML_CACHE_LINE, sizeof(*q));
+    memset(q, 0, sizeof(*q));
+    q->count = slots;
+    q->slots = (Trajectory *)malloc(sizeof(*q->slots) * slots);
+    ring_init(&q->empty, slots);
+    ring_init(&q->filled, slots);
+    for (size_t i = 0; i < slots; i++)
+    {
+        q->slots[i] = Trajectory_alloc(capacity, stateLen, codeValues, codeCount);
+        ring_push(&q->empty, i);
+    }
+    return q;
+}
+
+void TrajectoryQueue_free(TrajectoryQueue *q)
+{
+    for (size_t i = 0; i < q->count; i++)
+    {
+        Trajectory_free(q->slots[i]);
+    }
+    free(q->slots);
+    free(q->empty.cells);
+    free(q->filled.cells);
+    ml_aligned_free(q);
+}
+
+// an empty trajectory for an actor to fill, NULL while the learner holds them all
+Trajectory *TrajectoryQueue_acquire(TrajectoryQueue *q)
+{
+    size_t i;
+    if (!ring_pop(&q->empty, &i))
+        return NULL;
+    q->slots[i].count = 0;
+    return &q->slots[i];
+}
+
+void TrajectoryQueue_submit(TrajectoryQueue *q, Trajectory *t)
+{
+    ring_push(&q->filled, (size_t)(t - q->slots));
+}
+
+// the oldest filled trajectory, NULL when there is none
+Trajectory *TrajectoryQueue_take(TrajectoryQueue *q)
+{
+    size_t i;
+    if (!ring_pop(&q->filled, &i))
+        return NULL;
+    return &q->slots[i];
+}
+
+void TrajectoryQueue_recycle(TrajectoryQueue *q, Trajectory *t)
+{
+    ring_push(&q->empty, (size_t)(t - q->slots));
+}
+
+// both buffers start out as the params of nn, published as version 1
+WeightBuffer *WeightBuffer_alloc(Network nn)
+{
+    WeightBuffer *wb = (WeightBuffer *)ml_aligned_alloc(ML_CACHE_LINE, sizeof(*wb));
+    memset(wb, 0, sizeof(*wb));
+    for (size_t i = 0; i < 2; i++)
+    {
+        wb->buffers[i] = network_like(nn, 1, NULL);
+        Network_copy_params(wb->buffers[i], nn);
+    }
+    wb->version = 1;
+    return wb;
+}
+
+void WeightBuffer_free(WeightBuffer *wb)
+{
+    Network_free(wb->buffers[0]);
+    Network_free(wb->buffers[1]);
+    ml_aligned_free(wb);
+}
+
+// only one thread publishes. It fills the buffer readers are not on and flips to it,
+// waiting just for readers that still copy from that buffer's previous contents
+void WeightBuffer_publish(WeightBuffer *wb, Network nn)
+{
+    int64_t back = ml_atomic_load(&wb->front) ^ 1;
+    while (ml_atomic_load(&wb->readers[back]) != 0)
+    {
+        ml_yield();
+    }
+    Network_copy_params(wb->buffers[back], nn);
+    ml_atomic_store(&wb->front, back);
+    ml_atomic_add(&wb->version, 1);
+}
+
+// copies the published params into dest when they are newer than *version
+bool WeightBuffer_fetch(WeightBuffer *wb, Network dest, int64_t *version)
+{
+    int64_t latest = ml_atomic_load(&wb->version);
+    if (latest == *version)
+        return false;
+
+    // pin the front buffer, the publisher could have flipped in between so check it again
+    int64_t front;
+    for (;;)
+    {
+        front = ml_atomic_load(&wb->front);
+        ml_atomic_add(&wb->readers[front], 1);
+        if (ml_atomic_load(&wb->front) == front)
+            break;
+        ml_atomic_add(&wb->readers[front], -1);
+    }
+    Network_copy_params(dest, wb->buffers[front]);
+    ml_atomic_add(&wb->readers[front], -1);
+    *version = latest;
+    return true;
+}
+
+// marks the params of m in mask, the padding around its rows stays 0
+static void evolution_mask(float *mask, const float *params, Matrix m)
+{
+    float *row = mask + (m.es - params);
+    for (size_t i = 0; i < m.rows; i++, row += m.stride)
+    {
+        for (size_t j = 0; j < m.cols; j++)
+        {
+            row[j] = 1.f;
+        }
+    }
+}
+
+// threads follows ThreadPool_create, batch is the row count of the replicas fitness runs forwards on.
+// sigma starts at a quarter of the RMS of nn's weights and biases (0.02 if they are all 0),
+// noise much smaller than the weights barely changes what a member does and most pairs tie. sigma and the optimizer (Adam at 0.05)
+// can be changed before the first step
+Evolution Evolution_alloc(Network nn, size_t threads, size_t pairs, size_t batch, uint64_t seed)
+{
+    Evolution es = {0};
+    es.pool = ThreadPool_create(threads);
+    size_t workers = es.pool->count + 1;
+    es.replicas = (Network *)malloc(sizeof(*es.replicas) * workers);
+    for (size_t i = 0; i < workers; i++)
+    {
+        es.replicas[i] = network_like(nn, batch, NULL);
+    }
+    es.gradient = network_like(nn, 1, NULL);
+    es.opt = Optimizer_alloc(nn, OPTIMIZER_ADAM, 0.05f);
+    es.fitness = (float *)calloc(2 * pairs, sizeof(*es.fitness));
+    es.shaped = (float *)calloc(2 * pairs, sizeof(*es.shaped));
+    es.mask = (float *)calloc(nn.paramCount, sizeof(*es.mask));
+    for (size_t i = 0; i < nn.count; i++)
+    {
+        evolution_mask(es.mask, nn.params, nn.weights[i]);
+        evolution_mask(es.mask, nn.params, nn.biases[i]);
+    }
+    es.pairs = pairs;
+    double sum = 0.0;
+    size_t real = 0;
+    for (size_t i = 0; i < nn.paramCount; i++)
+    {
+        sum += es.mask[i] * nn.params[i] * nn.params[i];
+        real += es.mask[i] != 0.f;
+    }
+    float rms = real ? (float)sqrt(sum / real) : 0.f;
+    es.sigma = rms > 0.f ? 0.25f * rms : 0.02f;
+    es.seed = seed;
+    return es;
+}
+
+void Evolution_free(Evolution es)
+{
+    for (size_t i = 0; i < es.pool->count + 1; i++)
+    {
+        Network_free(es.replicas[i]);
+    }
+    ThreadPool_destroy(es.pool);
+    free(es.replicas);
+    Network_free(es.gradient);
+    Optimizer_free(es.opt);
+    free(es.fitness);
+    free(es.shaped);
+    free(es.mask);
+}
+
+static uint64_t evolution_key(const Evolution *es, uint64_t stream, uint64_t pair, uint64_t block)
+{
+    uint64_t state = es->seed;
+    uint64_t key = splitmix64(&state) ^ es->generation;
+    key = splitmix64(&key) ^ stream;
+    key = splitmix64(&key) ^ pair;
+    key = splitmix64(&key) ^ block;
+    return splitmix64(&key);
+}
+
+// standard normal noise of pair over params [block * EVOLUTION_BLOCK, + count)
+static void evolution_noise(const Evolution *es, size_t pair, size_t block, float *dest, size_t count)
+{
+    Rng rng = Rng_seed(evolution_key(es, 0, pair, block));
+    Rng_fill_normal(&rng, dest, count, 0.f, 1.f);
+}
+
+typedef struct EvolutionJob
+{
+    Evolution *es;
+    Network center;
+    FitnessFn fitness;
+    void *arg;
+    size_t first;
+} EvolutionJob;
+
+static void evolution_evaluate_task(void *arg, size_t task, size_t worker)
+{
+    EvolutionJob *job = (EvolutionJob *)arg;
+    Evolution *es = job->es;
+    size_t member = job->first + task;
+    size_t pair = member / 2;
+    float scale = (member % 2 ? -1.f : 1.f) * es->sigma;
+
+    Network nn = es->replicas[worker];
+    float noise[EVOLUTION_BLOCK];
+    for (size_t start = 0; start < nn.paramCount; start += EVOLUTION_BLOCK)
+    {
+        size_t count = nn.paramCount - start < EVOLUTION_BLOCK ? nn.paramCount - start : EVOLUTION_BLOCK;
+        evolution_noise(es, pair, start / EVOLUTION_BLOCK, noise, count);
+        for (size_t j = 0; j < count; j++)
+        {
+            // padding is never perturbed, SIMD kernels may read it as zeros
+            nn.params[start + j] = job->center.params[start + j] + scale * noise[j] * es->mask[start + j];
+        }
+    }
+    es->fitness[member] = job->fitness(nn, job->arg, evolution_key(es, 1, pair, 0));
+}
+
+// scores members first..first+count of this generation into es->fitness. Separate processes
+// can each score a range and only trade the fitness values before Evolution_update
+void Evolution_evaluate(Evolution *es, Network center, FitnessFn fitness, void *arg, size_t first, size_t count)
+{
+    if (!Network_same(center, es->gradient) || first + count > 2 * es->pairs)
+        return;
+    EvolutionJob job = {es, center, fitness, arg, first};
+    ThreadPool_run(es->pool, count, evolution_evaluate_task, &job);
+}
+
+typedef struct EvolutionRank
+{
+    float fitness;
+    size_t member;
+} EvolutionRank;
+
+static int evolution_rank_cmp(const void *a, const void *b)
+{
+    const EvolutionRank *ra = (const EvolutionRank *)a;
+    const EvolutionRank *rb = (const EvolutionRank *)b;
+    // ties keep member order so every platform ranks the same
+    if (ra->fitness != rb->fitness)
+        return ra->fitness > rb->fitness ? 1 : -1;
+    return (ra->member > rb->member) - (ra->member < rb->member);
+}
+
+// every block sums the noise of all pairs in pair order, so the estimate does not
+// depend on how blocks land on workers
+static void evolution_gradient_task(void *arg, size_t task, size_t worker)
+{
+    (void)worker;
+    EvolutionJob *job = (EvolutionJob *)arg;
+    Evolution *es = job->es;
+    size_t start = task * EVOLUTION_BLOCK;
+    size_t count = es->gradient.paramCount - start < EVOLUTION_BLOCK ? es->gradient.paramCount - start : EVOLUTION_BLOCK;
+    float *dest = es->gradient.params + start;
+    float noise[EVOLUTION_BLOCK];
+
+    memset(dest, 0, sizeof(*dest) * count);
+    for (size_t pair = 0; pair < es->pairs; pair++)
+    {
+        float weight = es->shaped[2 * pair] - es->shaped[2 * pair + 1];
+        if (weight == 0.f)
+            continue;
+        evolution_noise(es, pair, task, noise, count);
+        for (size_t j = 0; j < count; j++)
+        {
+            dest[j] += weight * noise[j];
+        }
+    }
+    // the optimizer descends, the fitness has to go up. Padding gets no gradient so it stays 0
+    float scale = -1.f / (2 * es->pairs * es->sigma);
+    for (size_t j = 0; j < count; j++)
+    {
+        dest[j] *= scale * es->mask[start + j];
+    }
+}
+
+// turns the fitness of the whole generation into one optimizer step on center.
+// Fitness only counts through its rank, in [-0.5, 0.5], so outliers cannot dominate
+void Evolution_update(Evolution *es, Network center)
+{
+    if (!Network_same(center, es->gradient))
+        return;
+
+    size_t members = 2 * es->pairs;
+    EvolutionRank *ranks = (EvolutionRank *)malloc(sizeof(*ranks) * members);
+    for (size_t i = 0; i < members; i++)
+    {
+        ranks[i].fitness = es->fitness[i];
+        ranks[i].member = i;
+    }
+    qsort(ranks, members, sizeof(*ranks), evolution_rank_cmp);
+    for (size_t i = 0; i < members; i++)
+    {
+        es->shaped[ranks[i].member] = members > 1 ? (float)i / (members - 1) - 0.5f : 0.f;
+    }
+    free(ranks);
+
+    EvolutionJob job = {es, center, NULL, NULL, 0};
+    size_t blocks = (center.paramCount + EVOLUTION_BLOCK - 1) / EVOLUTION_BLOCK;
+    ThreadPool_run(es->pool, blocks, evolution_gradient_task, &job);
+    Optimizer_step(&es->opt, center, es->gradient);
+    es->generation++;
+}
+
+// one generation on this machine, returns the mean fitness of the population
+float Evolution_step(Evolution *es, Network center, FitnessFn fitness, void *arg)
+{
+    Evolution_evaluate(es, center, fitness, arg, 0, 2 * es->pairs);
+    double sum = 0.0;
+    for (size_t i = 0; i < 2 * es->pairs; i++)
+    {
+        sum += es->fitness[i];
+    }
+    Evolution_update(es, center);
+    return es->pairs ? (float)(sum / (2 * es->pairs)) : 0.f;
+}
+
 #endif // ML_H
\ No newline at end of file
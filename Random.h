@@ -0,0 +1,213 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <Windows.h>
+#endif
+
+#if defined(_MSC_VER)
+#define RNG_THREAD_LOCAL __declspec(thread)
+#else
+#define RNG_THREAD_LOCAL _Thread_local
+#endif
+
+// xoshiro256** generator, 2^256 - 1 period and 2^128 steps between jumped streams.
+// A state is never shared between threads: every thread has its own (Rng_thread)
+// and every environment can carry one
+typedef struct Rng
+{
+    uint64_t s[4];
+} Rng;
+
+uint64_t splitmix64(uint64_t *state);
+Rng Rng_seed(uint64_t seed);
+uint64_t Rng_next(Rng *rng);
+void Rng_jump(Rng *rng);
+Rng Rng_split(Rng *rng);
+float Rng_float(Rng *rng);
+uint32_t Rng_bounded(Rng *rng, uint32_t range);
+int Rng_int(Rng *rng, int low, int high);
+float Rng_normal(Rng *rng);
+void Rng_fill_uniform(Rng *rng, float *dest, size_t count, float low, float high);
+void Rng_fill_normal(Rng *rng, float *dest, size_t count, float mean, float stddev);
+void Rng_seed_threads(uint64_t seed);
+Rng *Rng_thread(void);
+
+// only used to expand a 64-bit seed into a full xoshiro state
+uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+Rng Rng_seed(uint64_t seed)
+{
+    Rng rng;
+    for (size_t i = 0; i < 4; i++)
+    {
+        rng.s[i] = splitmix64(&seed);
+    }
+    return rng;
+}
+
+static inline uint64_t rng_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+uint64_t Rng_next(Rng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+
+// same as 2^128 calls to Rng_next
+void Rng_jump(Rng *rng)
+{
+    static const uint64_t jump[] = {0x180EC6D33CFD0ABAull, 0xD5A61266F0C9392Cull, 0xA9582618E03FC9AAull,
+                                    0x39ABDC4529B1661Cull};
+    uint64_t s[4] = {0};
+    for (size_t i = 0; i < 4; i++)
+    {
+        for (int b = 0; b < 64; b++)
+        {
+            if (jump[i] & ((uint64_t)1 << b))
+            {
+                s[0] ^= rng->s[0];
+                s[1] ^= rng->s[1];
+                s[2] ^= rng->s[2];
+                s[3] ^= rng->s[3];
+            }
+            Rng_next(rng);
+        }
+    }
+    memcpy(rng->s, s, sizeof(s));
+}
+
+// returns the current stream and moves rng to the next independent one
+Rng Rng_split(Rng *rng)
+{
+    Rng stream = *rng;
+    Rng_jump(rng);
+    return stream;
+}
+
+// uniform in [0, 1) from the top 24 bits
+float Rng_float(Rng *rng)
+{
+    return (float)(Rng_next(rng) >> 40) * (1.f / 16777216.f);
+}
+
+// uniform in [0, range) without the modulo bias, Lemire's multiply and reject
+uint32_t Rng_bounded(Rng *rng, uint32_t range)
+{
+    uint64_t m = (Rng_next(rng) >> 32) * range;
+    uint32_t low = (uint32_t)m;
+    if (low < range)
+    {
+        uint32_t threshold = (0u - range) % range;
+        while (low < threshold)
+        {
+            m = (Rng_next(rng) >> 32) * range;
+            low = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+
+// low <= n <= high
+int Rng_int(Rng *rng, int low, int high)
+{
+    return low + (int)Rng_bounded(rng, (uint32_t)(high - low + 1));
+}
+
+// standard normal through Box-Muller, the second value of the pair is dropped
+float Rng_normal(Rng *rng)
+{
+    float u = 1.f - Rng_float(rng); // (0, 1], log stays finite
+    float v = Rng_float(rng);
+    return sqrtf(-2.f * logf(u)) * cosf(6.28318530718f * v);
+}
+
+void Rng_fill_uniform(Rng *rng, float *dest, size_t count, float low, float high)
+{
+    float scale = (high - low) * (1.f / 16777216.f);
+    for (size_t i = 0; i < count; i++)
+    {
+        dest[i] = (float)(Rng_next(rng) >> 40) * scale + low;
+    }
+}
+
+// both Box-Muller outputs are used, one 64-bit draw feeds a pair
+void Rng_fill_normal(Rng *rng, float *dest, size_t count, float mean, float stddev)
+{
+    for (size_t i = 0; i < count; i += 2)
+    {
+        uint64_t bits = Rng_next(rng);
+        float u = (float)((bits >> 40) + 1) * (1.f / 16777216.f);
+        float v = (float)((bits >> 16) & 0xFFFFFF) * (1.f / 16777216.f);
+        float radius = sqrtf(-2.f * logf(u)) * stddev;
+        float angle = 6.28318530718f * v;
+        dest[i] = mean + radius * cosf(angle);
+        if (i + 1 < count)
+            dest[i + 1] = mean + radius * sinf(angle);
+    }
+}
+
+static uint64_t rngThreadSeed = 0x5EED5EED5EED5EEDull;
+static volatile int64_t rngThreadStreams = 0;
+static RNG_THREAD_LOCAL Rng rngThread;
+static RNG_THREAD_LOCAL uint64_t rngThreadEpoch = 0; // 0 until the thread picked its stream
+static volatile int64_t rngEpoch = 1;
+
+static int64_t rng_fetch_add(volatile int64_t *value, int64_t add)
+{
+#if defined(_MSC_VER)
+    return InterlockedExchangeAdd64(value, add);
+#else
+    return __atomic_fetch_add(value, add, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// every thread draws stream 0, 1, 2, ... of seed in the order it first calls Rng_thread,
+// the caller takes stream 0. Call it before starting workers for a reproducible run
+void Rng_seed_threads(uint64_t seed)
+{
+    rngThreadSeed = seed;
+    rngThreadStreams = 0;
+    rng_fetch_add(&rngEpoch, 1);
+    Rng_thread();
+}
+
+// the calling thread's generator
+Rng *Rng_thread(void)
+{
+    if (rngThreadEpoch != (uint64_t)rngEpoch)
+    {
+        int64_t stream = rng_fetch_add(&rngThreadStreams, 1);
+        rngThread = Rng_seed(rngThreadSeed);
+        for (int64_t i = 0; i < stream; i++)
+        {
+            Rng_jump(&rngThread);
+        }
+        rngThreadEpoch = (uint64_t)rngEpoch;
+    }
+    return &rngThread;
+}
+
+#endif // RANDOM_H
@@ -0,0 +1,417 @@
+#ifndef SNAKE_ENGINE_H
+#define SNAKE_ENGINE_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "Random.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+// amount of horizontal tiles
+#ifndef GRID_HEIGHT
+#define GRID_HEIGHT 7
+#endif
+// amount of veritical tiles
+#ifndef GRID_WIDTH
+#define GRID_WIDTH 7
+#endif
+
+#define GRID_LEN (GRID_HEIGHT * GRID_WIDTH)
+
+#define GRID_AT(grid, x, y) (grid[y][x])
+
+// cells are packed as y * GRID_WIDTH + x
+#define CELL(x, y) ((uint16_t)((y) * GRID_WIDTH + (x)))
+#define CELL_X(cell) ((int)(cell) % GRID_WIDTH)
+#define CELL_Y(cell) ((int)(cell) / GRID_WIDTH)
+#define CELL_AT(grid, cell) (((uint8_t *)(grid))[cell])
+
+#if GRID_LEN > 65536
+#error "GRID_LEN does not fit the uint16_t cell indices"
+#endif
+
+// one bit per cell, a single word for the 7x7 default
+#define BOARD_WORDS ((GRID_LEN + 63) / 64)
+#define BOARD_TEST(board, cell) (((board)[(cell) >> 6] >> ((cell) & 63)) & 1)
+#define BOARD_SET(board, cell) ((board)[(cell) >> 6] |= (uint64_t)1 << ((cell) & 63))
+#define BOARD_CLEAR(board, cell) ((board)[(cell) >> 6] &= ~((uint64_t)1 << ((cell) & 63)))
+
+// apple cell once the board is full
+#define NO_APPLE 0xFFFF
+
+// cells a consumer can be behind on before it has to re-read the whole board
+#define MAX_CHANGES 8
+// changedCount once the whole board has to be re-read
+#define ALL_CHANGED 255
+
+#define DEATH_REWARD -3.f
+#define APPLE_REWARD 0.f
+#define NONE_REWARD 0.01f
+
+// no direction chosen yet
+#define NO_DIRECTION 255
+
+typedef enum TILE_TYPE
+{
+    NoneTile,
+    BorderTile,
+    SnakeTile,
+    AppleTile,
+} TileType;
+
+// network input per tile type, scaled to [0, 1]
+static const float TileFeatures[] = {
+    [NoneTile] = 0.f,
+    [BorderTile] = 1.f / 3.f,
+    [SnakeTile] = 2.f / 3.f,
+    [AppleTile] = 1.f,
+};
+
+typedef enum SNAKE_DIRECTION
+{
+    Up,
+    Left,
+    Down,
+    Right,
+} SnakeDirections;
+
+typedef enum SNAKE_EVENT
+{
+    NoneEvent,
+    AppleEvent,
+    DeathEvent,
+    WinEvent, // the snake filled the board
+} SnakeEvent;
+
+// the whole game state, a step never allocates
+typedef struct SnakeGame
+{
+    uint8_t grid[GRID_HEIGHT][GRID_WIDTH]; // tile view for drawing and observations
+    uint64_t borderBits[BOARD_WORDS];
+    uint64_t snakeBits[BOARD_WORDS];
+    uint16_t body[GRID_LEN]; // ring buffer of cells, body[head] is the head
+    size_t head;
+    size_t length;
+    uint16_t apple;
+    uint8_t lastDirection;
+    uint16_t changed[MAX_CHANGES]; // cells rewritten since the consumer last cleared changedCount
+    uint8_t changedCount;
+    Rng rng; // start positions and apples, set by SnakeGame_seed
+} SnakeGame;
+
+// N independent games stepped in lockstep, the per-step inputs and outputs are arrays over the games
+typedef struct SnakeEnvs
+{
+    SnakeGame *games;
+    size_t count;
+    uint8_t *actions; // set by the caller before SnakeEnvs_step
+    float *rewards;
+    uint8_t *events; // SnakeEvent of the last step, the game is already reset after a death or a win
+} SnakeEnvs;
+
+uint16_t SnakeGame_body_at(const SnakeGame *game, size_t i);
+uint16_t SnakeGame_tail(const SnakeGame *game);
+void SnakeGame_seed(SnakeGame *game, uint64_t seed);
+void SnakeGame_reset(SnakeGame *game);
+void SnakeGame_mark_changed(SnakeGame *game, uint16_t cell);
+int Board_popcount(uint64_t w);
+int Board_select(uint64_t w, int r);
+bool SnakeGame_new_apple(SnakeGame *game);
+SnakeEvent SnakeGame_step(SnakeGame *game, uint8_t direction, float *reward);
+void SnakeGame_observe(const SnakeGame *game, float *dest);
+void SnakeGame_encode(const SnakeGame *game, uint8_t *dest);
+SnakeEnvs SnakeEnvs_alloc(size_t count, uint64_t seed);
+void SnakeEnvs_free(SnakeEnvs envs);
+void SnakeEnvs_reset(SnakeEnvs envs);
+void SnakeEnvs_step(SnakeEnvs envs);
+void SnakeEnvs_observe(SnakeEnvs envs, float *dest, size_t stride);
+
+// i-th cell counting back from the head, 0 is the head
+uint16_t SnakeGame_body_at(const SnakeGame *game, size_t i)
+{
+    size_t at = game->head >= i ? game->head - i : game->head + GRID_LEN - i;
+    return game->body[at];
+}
+
+uint16_t SnakeGame_tail(const SnakeGame *game)
+{
+    return SnakeGame_body_at(game, game->length - 1);
+}
+
+int Board_popcount(uint64_t w)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(w);
+#else
+    w = w - ((w >> 1) & 0x5555555555555555ull);
+    w = (w & 0x3333333333333333ull) + ((w >> 2) & 0x3333333333333333ull);
+    w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (int)((w * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+// position of the r-th set bit of w, r < popcount(w)
+int Board_select(uint64_t w, int r)
+{
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BMI2__)
+    return __builtin_ctzll(_pdep_u64((uint64_t)1 << r, w));
+#else
+    // narrow down by halves, six popcounts at most
+    int pos = 0;
+    for (int width = 32; width > 0; width >>= 1)
+    {
+        uint64_t low = w & (((uint64_t)1 << width) - 1);
+        int count = Board_popcount(low);
+        if (r >= count)
+        {
+            r -= count;
+            w >>= width;
+            pos += width;
+        }
+        else
+        {
+            w = low;
+        }
+    }
+    return pos;
+#endif
+}
+
+// picks a free cell uniformly in bounded time, false when the board is full
+bool SnakeGame_new_apple(SnakeGame *game)
+{
+    uint64_t freeBits[BOARD_WORDS];
+    int counts[BOARD_WORDS];
+    int total = 0;
+    for (size_t i = 0; i < BOARD_WORDS; i++)
+    {
+        freeBits[i] = ~(game->borderBits[i] | game->snakeBits[i]);
+        if (i == BOARD_WORDS - 1 && GRID_LEN % 64)
+            freeBits[i] &= ((uint64_t)1 << (GRID_LEN % 64)) - 1;
+        counts[i] = Board_popcount(freeBits[i]);
+        total += counts[i];
+    }
+    if (total == 0)
+    {
+        game->apple = NO_APPLE;
+        return false;
+    }
+
+    int r = (int)Rng_bounded(&game->rng, (uint32_t)total);
+    size_t word = 0;
+    while (r >= counts[word])
+        r -= counts[word++];
+    game->apple = (uint16_t)(word * 64 + Board_select(freeBits[word], r));
+    CELL_AT(game->grid, game->apple) = AppleTile;
+    SnakeGame_mark_changed(game, game->apple);
+    return true;
+}
+
+void SnakeGame_mark_changed(SnakeGame *game, uint16_t cell)
+{
+    if (game->changedCount >= MAX_CHANGES)
+    {
+        game->changedCount = ALL_CHANGED;
+        return;
+    }
+    game->changed[game->changedCount++] = cell;
+}
+
+// the game replays the same starts and apples for the same seed and moves
+void SnakeGame_seed(SnakeGame *game, uint64_t seed)
+{
+    game->rng = Rng_seed(seed);
+}
+
+void SnakeGame_reset(SnakeGame *game)
+{
+    memset(game->grid, NoneTile, sizeof(game->grid));
+    memset(game->borderBits, 0, sizeof(game->borderBits));
+    memset(game->snakeBits, 0, sizeof(game->snakeBits));
+
+    int randomSnakeX = Rng_int(&game->rng, 1, GRID_WIDTH - 2);
+    int randomSnakeY = Rng_int(&game->rng, 1, GRID_HEIGHT - 2);
+    int randomAppleX = Rng_int(&game->rng, 1, GRID_WIDTH - 2);
+    int randomAppleY = Rng_int(&game->rng, 1, GRID_HEIGHT - 2);
+    while (randomAppleX == randomSnakeX)
+    {
+        randomAppleX = Rng_int(&game->rng, 1, GRID_WIDTH - 2);
+    }
+    while (randomAppleY == randomSnakeY)
+    {
+        randomAppleY = Rng_int(&game->rng, 1, GRID_HEIGHT - 2);
+    }
+    // only the border ring is walked, the inside is already clear
+    for (int x = 0; x < GRID_WIDTH; x++)
+    {
+        GRID_AT(game->grid, x, 0) = BorderTile;
+        GRID_AT(game->grid, x, GRID_HEIGHT - 1) = BorderTile;
+        BOARD_SET(game->borderBits, CELL(x, 0));
+        BOARD_SET(game->borderBits, CELL(x, GRID_HEIGHT - 1));
+    }
+    for (int y = 1; y < GRID_HEIGHT - 1; y++)
+    {
+        GRID_AT(game->grid, 0, y) = BorderTile;
+        GRID_AT(game->grid, GRID_WIDTH - 1, y) = BorderTile;
+        BOARD_SET(game->borderBits, CELL(0, y));
+        BOARD_SET(game->borderBits, CELL(GRID_WIDTH - 1, y));
+    }
+    game->apple = CELL(randomAppleX, randomAppleY);
+
+    game->head = 0;
+    game->body[0] = CELL(randomSnakeX, randomSnakeY);
+    game->length = 1;
+    game->lastDirection = NO_DIRECTION;
+
+    GRID_AT(game->grid, randomAppleX, randomAppleY) = AppleTile;
+    GRID_AT(game->grid, randomSnakeX, randomSnakeY) = SnakeTile;
+    BOARD_SET(game->snakeBits, game->body[0]);
+    game->changedCount = ALL_CHANGED;
+}
+
+// moves the snake one tile, an invalid direction keeps the last one
+// on death the state is left as it was, the caller resets the game
+SnakeEvent SnakeGame_step(SnakeGame *game, uint8_t direction, float *reward)
+{
+    if (direction > Right)
+        direction = game->lastDirection;
+    if (direction > Right)
+    {
+        *reward = 0.f;
+        return NoneEvent;
+    }
+
+    uint16_t head = game->body[game->head];
+    switch (direction)
+    {
+    case Up:
+        head -= GRID_WIDTH;
+        break;
+    case Down:
+        head += GRID_WIDTH;
+        break;
+    case Left:
+        head--;
+        break;
+    case Right:
+        head++;
+        break;
+    }
+    game->lastDirection = direction;
+
+    // Events to handle:
+    //     Snake touches apple
+    //     Snake touches border
+    //     Snake touches snake, other than the tail that moves away this step
+    // the head never leaves the border ring, so the new cell is always inside the grid
+    uint16_t tail = SnakeGame_tail(game);
+    if (BOARD_TEST(game->borderBits, head) || (BOARD_TEST(game->snakeBits, head) && head != tail))
+    {
+        *reward = DEATH_REWARD;
+        return DeathEvent;
+    }
+
+    game->head = game->head + 1 == GRID_LEN ? 0 : game->head + 1;
+    game->body[game->head] = head;
+    if (head == game->apple)
+    {
+        game->length++;
+        CELL_AT(game->grid, head) = SnakeTile;
+        BOARD_SET(game->snakeBits, head);
+        SnakeGame_mark_changed(game, head);
+        *reward = APPLE_REWARD;
+        return SnakeGame_new_apple(game) ? AppleEvent : WinEvent;
+    }
+
+    // the old tail slot is simply left behind by the ring
+    CELL_AT(game->grid, tail) = NoneTile;
+    BOARD_CLEAR(game->snakeBits, tail);
+    CELL_AT(game->grid, head) = SnakeTile;
+    BOARD_SET(game->snakeBits, head);
+    SnakeGame_mark_changed(game, tail);
+    SnakeGame_mark_changed(game, head);
+    *reward = NONE_REWARD;
+    return NoneEvent;
+}
+
+// writes the tiles as network inputs
+void SnakeGame_observe(const SnakeGame *game, float *dest)
+{
+    const uint8_t *tiles = &game->grid[0][0];
+    for (size_t i = 0; i < GRID_LEN; i++)
+    {
+        dest[i] = TileFeatures[tiles[i]];
+    }
+}
+
+// GRID_LEN tile codes, TileFeatures turns them back into the observation
+void SnakeGame_encode(const SnakeGame *game, uint8_t *dest)
+{
+    memcpy(dest, game->grid, GRID_LEN);
+}
+
+// game i runs on stream i of seed, so the games never share random numbers
+SnakeEnvs SnakeEnvs_alloc(size_t count, uint64_t seed)
+{
+    SnakeEnvs envs = {
+        .games = (SnakeGame *)malloc(sizeof(*envs.games) * count),
+        .count = count,
+        .actions = (uint8_t *)calloc(count, sizeof(*envs.actions)),
+        .rewards = (float *)calloc(count, sizeof(*envs.rewards)),
+        .events = (uint8_t *)calloc(count, sizeof(*envs.events)),
+    };
+    Rng streams = Rng_seed(seed);
+    for (size_t i = 0; i < count; i++)
+    {
+        envs.games[i].rng = Rng_split(&streams);
+    }
+    SnakeEnvs_reset(envs);
+    return envs;
+}
+
+void SnakeEnvs_free(SnakeEnvs envs)
+{
+    free(envs.games);
+    free(envs.actions);
+    free(envs.rewards);
+    free(envs.events);
+}
+
+void SnakeEnvs_reset(SnakeEnvs envs)
+{
+    for (size_t i = 0; i < envs.count; i++)
+    {
+        SnakeGame_reset(&envs.games[i]);
+        envs.actions[i] = NO_DIRECTION;
+        envs.events[i] = NoneEvent;
+    }
+}
+
+// steps every game with its action, finished games start over right away
+void SnakeEnvs_step(SnakeEnvs envs)
+{
+    for (size_t i = 0; i < envs.count; i++)
+    {
+        SnakeEvent event = SnakeGame_step(&envs.games[i], envs.actions[i], &envs.rewards[i]);
+        envs.events[i] = event;
+        if (event == DeathEvent || event == WinEvent)
+            SnakeGame_reset(&envs.games[i]);
+    }
+}
+
+// one row of GRID_LEN inputs per game, dest rows are stride floats apart
+void SnakeEnvs_observe(SnakeEnvs envs, float *dest, size_t stride)
+{
+    for (size_t i = 0; i < envs.count; i++)
+    {
+        SnakeGame_observe(&envs.games[i], dest + i * stride);
+    }
+}
+
+#endif // SNAKE_ENGINE_H
@@ -9,6 +9,9 @@
 #define GRID_HEIGHT 7
 // amount of veritical tiles
 #define GRID_WIDTH 7
+
+#include "SnakeEngine.h"
+
 // height and width of a single tile
 #define TILE_SIZE 200
 // height in pixels
@@ -16,27 +19,42 @@
 // width in pixels
 #define PIXELS_WIDTH (GRID_WIDTH * TILE_SIZE)
 
-#define GRID_LEN (GRID_HEIGHT * GRID_WIDTH)
-
 // remembers what is drawn on the screen
 BYTE SCREEN_GRID[GRID_HEIGHT][GRID_WIDTH];
 
 // remembers what is going on in the game
-BYTE GAME_GRID[GRID_HEIGHT][GRID_WIDTH];
+SnakeGame Game;
 
 #define GAME_STEPS 200
+// samples per forward/backward pass while training
+#define TRAIN_BATCH 64
 int actionCounter = 0;
 int sleepTime = 100;
 int ManualDeath = 0;
 int ManualControl = 0;
 
+// the game thread plays with SnakeNN while the learner thread trains SnakeLearnerNN,
+// finished trajectories go one way through SnakeQueue and new weights the other way through SnakeWeights
 Network SnakeNN;
+Network SnakeLearnerNN;
 Network SnakeNNGradient;
-Step *snakeSteps[GAME_STEPS];
-
-#define GRID_AT(grid, x, y) (grid[y][x])
-
-#define COMP_POINT(p1, p2) (((p1)->x == (p2)->x) && ((p1)->y == (p2)->y))
+Optimizer SnakeOptimizer;
+TrajectoryQueue *SnakeQueue;
+WeightBuffer *SnakeWeights;
+int64_t snakeWeightsVersion = 0;
+// trajectories the learner may fall behind by before the game waits for it
+#define QUEUE_SLOTS 8
+// first layer pre-activation of the current board, rebuilt when it goes stale
+Matrix SnakeAccumulator;
+bool SnakeAccumulatorValid = false;
+Trajectory *snakeTrajectory;
+
+// a snapshot of SnakeLearnerNN every few training rounds, the newest is picked up on startup
+#define CHECKPOINT_PREFIX "snake"
+#define CHECKPOINT_EVERY 10
+#define CHECKPOINT_KEEP 5
+Checkpointer *SnakeCheckpoints;
+uint64_t trainingRounds = 0;
 
 #define EYE_COLOR ((COLORREF)RGB(0, 0, 0))
 
@@ -48,37 +66,7 @@ typedef enum TILE_RGB
     AppleTileRGB = (COLORREF)RGB(255, 0, 0),
 } TileRGB;
 
-typedef enum TILE_TYPE
-{
-    NoneTile,
-    BorderTile,
-    SnakeTile,
-    AppleTile,
-} TileType;
-
-typedef enum SNAKE_DIRECTION
-{
-    Up,
-    Left,
-    Down,
-    Right,
-} SnakeDirections;
-
-typedef struct Point
-{
-    int x;
-    int y;
-} Point;
-typedef struct POINT_LIST_NODE
-{
-    struct POINT_LIST_NODE *next;
-    Point *point;
-} PointList;
-
-Point *ApplePoint;
-PointList *SnakePoints;
-BYTE LastDirection = 255;
-BYTE SnakeDirection = 255;
+BYTE SnakeDirection = NO_DIRECTION;
 
 int GetTileRGB(TileType tileType)
 {
@@ -97,110 +85,53 @@ int GetTileRGB(TileType tileType)
     }
 }
 
-// random number from low to high including high
-// low <= n <= high
-int RandomInt(int low, int high)
+void InitializeGame(void)
 {
-    return (rand() % (high - low + 1)) + low;
+    SnakeGame_reset(&Game);
+    // force a full repaint
+    memset(SCREEN_GRID, 255, sizeof(SCREEN_GRID));
 }
 
-void FreePointList(PointList *p)
+void ReinforcementLearning(Trajectory *trajectory)
 {
-    if (!p)
-        return;
-    if (!p->next)
-    {
-        GlobalFree(p->point);
-        GlobalFree(p);
-        return;
-    }
-    FreePointList(p->next);
-    GlobalFree(p->point);
-    GlobalFree(p);
-}
+    float gamma = 0.9; // Discount factor
+    Returns_discounted(trajectory->rewards, trajectory->dones, NULL, trajectory->count, 1, gamma, trajectory->returns);
+    // better than average moves get pushed up and worse ones down
+    Returns_normalize(trajectory->returns, trajectory->count);
+    float cost = Network_policy_cost_trajectory(SnakeLearnerNN, *trajectory);
+    printf("Cost: %f\n\n", cost);
 
-void NewApple(void)
-{
-    int randomAppleX = RandomInt(1, GRID_WIDTH - 2);
-    int randomAppleY = RandomInt(1, GRID_HEIGHT - 2);
-    while (GRID_AT(GAME_GRID, randomAppleX, randomAppleY) == SnakeTile)
-    {
-        randomAppleX = RandomInt(1, GRID_WIDTH - 2);
-        randomAppleY = RandomInt(1, GRID_HEIGHT - 2);
-    }
-    ApplePoint->x = randomAppleX;
-    ApplePoint->y = randomAppleY;
-    GRID_AT(GAME_GRID, ApplePoint->x, ApplePoint->y) = AppleTile;
+    Network_policy_gradient_backprop_trajectory(SnakeLearnerNN, SnakeNNGradient, *trajectory);
+    // the gradient is of the policy cost, so this steps downhill
+    Optimizer_step(&SnakeOptimizer, SnakeLearnerNN, SnakeNNGradient);
+    WeightBuffer_publish(SnakeWeights, SnakeLearnerNN);
+
+    trainingRounds++;
+    if (trainingRounds % CHECKPOINT_EVERY == 0)
+        Checkpointer_save(SnakeCheckpoints, SnakeLearnerNN, trainingRounds);
 }
 
-void InitializeGame(void)
+// trains on every trajectory the game thread hands over
+DWORD WINAPI LearnerLoop(LPVOID lpParam)
 {
-    ZeroMemory(GAME_GRID, sizeof(GAME_GRID));
-    ZeroMemory(SCREEN_GRID, sizeof(SCREEN_GRID));
-
-    FreePointList(SnakePoints->next);
-    SnakePoints->next = NULL;
-
-    int randomSnakeX = RandomInt(1, GRID_WIDTH - 2);
-    int randomSnakeY = RandomInt(1, GRID_HEIGHT - 2);
-    int randomAppleX = RandomInt(1, GRID_WIDTH - 2);
-    int randomAppleY = RandomInt(1, GRID_HEIGHT - 2);
-    while (randomAppleX == randomSnakeX)
-    {
-        randomAppleX = RandomInt(1, GRID_WIDTH - 2);
-    }
-    while (randomAppleY == randomSnakeY)
-    {
-        randomAppleY = RandomInt(1, GRID_HEIGHT - 2);
-    }
-    for (int y = 0; y < GRID_HEIGHT; y++)
+    while (1)
     {
-        for (int x = 0; x < GRID_WIDTH; x++)
+        Trajectory *trajectory = TrajectoryQueue_take(SnakeQueue);
+        if (!trajectory)
         {
-            GRID_AT(SCREEN_GRID, x, y) = 255;
-            if (x == 0 || y == 0 || x == GRID_WIDTH - 1 || y == GRID_HEIGHT - 1)
-            {
-                GRID_AT(GAME_GRID, x, y) = BorderTile;
-            }
+            Sleep(1);
+            continue;
         }
+        ReinforcementLearning(trajectory);
+        TrajectoryQueue_recycle(SnakeQueue, trajectory);
     }
-    ApplePoint->x = randomAppleX;
-    ApplePoint->y = randomAppleY;
-
-    SnakePoints->point->x = randomSnakeX;
-    SnakePoints->point->y = randomSnakeY;
-
-    GRID_AT(GAME_GRID, randomAppleX, randomAppleY) = AppleTile;
-    GRID_AT(GAME_GRID, randomSnakeX, randomSnakeY) = SnakeTile;
-}
-
-void ReinforcementLearning()
-{
-    float gamma = 0.9; // Discount factor
-    float cumulative = 0;
-    for (int i = actionCounter - 1; i >= 0; i--)
-    {
-        cumulative = snakeSteps[i]->reward + gamma * cumulative;
-        snakeSteps[i]->reward = cumulative; // Overwrite with cumulative
-    }
-    float cost = Network_cross_entropy_cost(SnakeNN, snakeSteps, actionCounter);
-    printf("Cost: %f\n\n", cost);
-
-    Network_policy_gradient_backprop(SnakeNN, SnakeNNGradient, snakeSteps, actionCounter);
-    Network_gradient_ascent(SnakeNN, SnakeNNGradient, 0.0015f);
 }
 
 void GameOver(HWND hwnd)
 {
     // ReinforcementLearning();
 
-    // for (int i = 0; i < GAME_STEPS; i++)
-    // {
-    //     mat_clear(snakeSteps[i]->state);
-    //     snakeSteps[i]->action = 0;
-    //     snakeSteps[i]->probability = 0;
-    //     snakeSteps[i]->reward = 0;
-    // }
+    // snakeTrajectory.count = 0;
     // actionCounter = 0;
 
     InitializeGame();
@@ -208,128 +139,42 @@ void GameOver(HWND hwnd)
     SendMessage(hwnd, WM_PAINT, 0, 0);
 }
 
-#define DEATH_REWARD -3.f
-#define APPLE_REWARD 0.f
-#define NONE_REWARD 0.01f
-
 void GameStep(HWND hwnd)
 {
     // Snake has to take a step and update the game grid data
-
-    PointList *newList = (PointList *)GlobalAlloc(GMEM_FIXED, sizeof(*SnakePoints));
-    if (!newList)
+    float reward;
+    SnakeEvent event = SnakeGame_step(&Game, SnakeDirection, &reward);
+    snakeTrajectory->rewards[actionCounter] = reward;
+    snakeTrajectory->dones[actionCounter] = event == DeathEvent || event == WinEvent;
+    if (event == DeathEvent || event == WinEvent)
     {
-        return;
-    }
-    newList->next = NULL;
-    newList->point = (Point *)GlobalAlloc(GMEM_FIXED, sizeof(*SnakePoints->point));
-    if (!newList->point)
-    {
-        return;
-    }
-
-    switch (SnakeDirection)
-    {
-    case Up:
-        newList->point->x = SnakePoints->point->x;
-        newList->point->y = SnakePoints->point->y - 1;
-        break;
-    case Down:
-        newList->point->x = SnakePoints->point->x;
-        newList->point->y = SnakePoints->point->y + 1;
-        break;
-    case Left:
-        newList->point->x = SnakePoints->point->x - 1;
-        newList->point->y = SnakePoints->point->y;
-        break;
-    case Right:
-        newList->point->x = SnakePoints->point->x + 1;
-        newList->point->y = SnakePoints->point->y;
-        break;
-    default:
-        newList->point->x = SnakePoints->point->x;
-        newList->point->y = SnakePoints->point->y;
-        break;
-    }
-    LastDirection = SnakeDirection;
-
-    newList->next = SnakePoints;
-    SnakePoints = newList;
-    newList = NULL;
-
-    // Events to handle:
-    //     Snake touches apple
-    //     Snake touches border
-    //     Snake touches snake
-    if (GRID_AT(GAME_GRID, SnakePoints->point->x, SnakePoints->point->y) == BorderTile)
-    {
-        snakeSteps[actionCounter]->reward = DEATH_REWARD;
-        // printf("Reward is:\t%f\n\n", snakeSteps[actionCounter]->reward);
         GameOver(hwnd);
         return;
     }
-    if (GRID_AT(GAME_GRID, SnakePoints->point->x, SnakePoints->point->y) == SnakeTile)
-    {
-        PointList *last = SnakePoints;
-        while (last->next)
-            last = last->next;
-        if (!(SnakePoints->point->x == last->point->x && SnakePoints->point->y == last->point->y))
-        {
-            snakeSteps[actionCounter]->reward = DEATH_REWARD;
-            // printf("Reward is:\t%f\n\n", snakeSteps[actionCounter]->reward);
-            GameOver(hwnd);
-            return;
-        }
-    }
-
-    if (GRID_AT(GAME_GRID, SnakePoints->point->x, SnakePoints->point->y) == AppleTile)
-    {
-        snakeSteps[actionCounter]->reward = APPLE_REWARD;
-        // printf("Reward is:\t%f\n\n", snakeSteps[actionCounter]->reward);
-        GRID_AT(GAME_GRID, SnakePoints->point->x, SnakePoints->point->y) = SnakeTile;
-        NewApple();
-    }
-    else
-    {
-        snakeSteps[actionCounter]->reward = NONE_REWARD;
-        // printf("Reward is:\t%f\n\n", snakeSteps[actionCounter]->reward);
-        PointList *oneBeforeLast = SnakePoints;
-        while (oneBeforeLast->next && oneBeforeLast->next->next)
-        {
-            oneBeforeLast = oneBeforeLast->next;
-        }
-        GRID_AT(GAME_GRID, oneBeforeLast->next->point->x, oneBeforeLast->next->point->y) = NoneTile;
-        GlobalFree(oneBeforeLast->next);
-        oneBeforeLast->next = NULL;
-        GRID_AT(GAME_GRID, SnakePoints->point->x, SnakePoints->point->y) = SnakeTile;
-    }
     InvalidateRect(hwnd, NULL, FALSE);
     SendMessage(hwnd, WM_PAINT, 0, 0);
 }
 
 int GetSnakeAction()
 {
-    float *floatGrid = (float *)GlobalAlloc(GMEM_FIXED, sizeof(float) * GRID_LEN);
-
-    for (int y = 0; y < GRID_HEIGHT; y++)
+    // only the cells the last moves touched go through the first layer
+    if (!SnakeAccumulatorValid || Game.changedCount == ALL_CHANGED)
     {
-        for (int x = 0; x < GRID_WIDTH; x++)
-        {
-            floatGrid[y * GRID_WIDTH + x] = (float)GAME_GRID[y][x] / 3.f;
-        }
+        SnakeGame_observe(&Game, &MAT_AT(NETWORK_IN(SnakeNN), 0, 0));
+        Network_accumulator_refresh(SnakeNN, SnakeAccumulator);
+        SnakeAccumulatorValid = true;
     }
-    Matrix gameGrid = {
-        .rows = 1,
-        .cols = GRID_LEN,
-        .stride = GRID_LEN,
-        .es = floatGrid,
-    };
-
-    for (int i = 0; i < gameGrid.cols; i++)
+    else
     {
-        MAT_AT(NETWORK_IN(SnakeNN), 0, i) = MAT_AT(gameGrid, 0, i) / 3.f;
+        for (int i = 0; i < Game.changedCount; i++)
+        {
+            uint16_t cell = Game.changed[i];
+            Network_accumulator_set(SnakeNN, SnakeAccumulator, cell, TileFeatures[CELL_AT(Game.grid, cell)]);
+        }
     }
-    Network_forward(SnakeNN);
+    Game.changedCount = 0;
+    SnakeGame_encode(&Game, Trajectory_state(*snakeTrajectory, actionCounter));
+    Network_forward_accumulator(SnakeNN, SnakeAccumulator);
     // print_mat(NETWORK_OUT(SnakeNN), "Before softmax", 0, "%.3f");
     // SOFTMAX_OUTPUTS(SnakeNN);
     // print_mat(NETWORK_OUT(SnakeNN), "After softmax", 0, "%.3f");
@@ -343,7 +188,7 @@ int GetSnakeAction()
         if (MAT_AT(NETWORK_OUT(SnakeNN), 0, i) > probability)
         {
 
-            if (i == (LastDirection + 2) % 4)
+            if (Game.lastDirection != NO_DIRECTION && i == (Game.lastDirection + 2) % 4)
             {
                 // invalid move
             }
@@ -356,19 +201,17 @@ int GetSnakeAction()
     }
 
     float epsilon = 0.05;
-    if ((rand() / (float)RAND_MAX) < epsilon)
+    if (Rng_float(Rng_thread()) < epsilon)
     {
         do
         {
-            action = rand() % 4;
-        } while (action == (LastDirection + 2) % 4);
+            action = Rng_bounded(Rng_thread(), 4);
+        } while (Game.lastDirection != NO_DIRECTION && action == (Game.lastDirection + 2) % 4);
     }
 
-    mat_copy(snakeSteps[actionCounter]->state, gameGrid);
-    snakeSteps[actionCounter]->probability = probability;
-    snakeSteps[actionCounter]->action = action;
+    snakeTrajectory->probabilities[actionCounter] = probability;
+    snakeTrajectory->actions[actionCounter] = action;
 
-    GlobalFree(floatGrid);
     // printf("#Action %d\n", actionCounter);
     // printf("Snake wants:\t%d\n", action);
     return action;
@@ -387,7 +230,7 @@ DWORD WINAPI GameLoop(LPVOID lpParam)
                 GameOver(hwnd);
                 ManualDeath = 0;
             }
-            if (SnakeDirection != 255)
+            if (SnakeDirection != NO_DIRECTION)
             {
                 if (ManualControl == 0)
                 {
@@ -404,16 +247,17 @@ DWORD WINAPI GameLoop(LPVOID lpParam)
         }
         else
         {
-            ReinforcementLearning();
-
-            for (int i = 0; i < GAME_STEPS; i++)
+            // the learner trains on it while this thread keeps playing
+            snakeTrajectory->count = actionCounter;
+            TrajectoryQueue_submit(SnakeQueue, snakeTrajectory);
+            while (!(snakeTrajectory = TrajectoryQueue_acquire(SnakeQueue)))
             {
-                mat_clear(snakeSteps[i]->state);
-                snakeSteps[i]->action = 0;
-                snakeSteps[i]->probability = 0;
-                snakeSteps[i]->reward = 0;
+                Sleep(1);
             }
             actionCounter = 0;
+
+            if (WeightBuffer_fetch(SnakeWeights, SnakeNN, &snakeWeightsVersion))
+                SnakeAccumulatorValid = false;
         }
     }
 }
@@ -428,23 +272,23 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
             switch (wParam)
             {
             case 'W':
-                if (LastDirection != Down)
+                if (Game.lastDirection != Down)
                     SnakeDirection = Up;
                 break;
             case 'A':
-                if (LastDirection != Right)
+                if (Game.lastDirection != Right)
                     SnakeDirection = Left;
                 break;
             case 'S':
-                if (LastDirection != Up)
+                if (Game.lastDirection != Up)
                     SnakeDirection = Down;
                 break;
             case 'D':
-                if (LastDirection != Left)
+                if (Game.lastDirection != Left)
                     SnakeDirection = Right;
                 break;
             case VK_SPACE:
-                SnakeDirection = (SnakeDirection == 255) ? 0 : 255;
+                SnakeDirection = (SnakeDirection == NO_DIRECTION) ? Up : NO_DIRECTION;
                 break;
             case VK_ESCAPE:
                 sleepTime = 100 - sleepTime;
@@ -474,66 +318,68 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
         {
             for (int x = 0; x < GRID_WIDTH; x++)
             {
-                if (GRID_AT(SCREEN_GRID, x, y) != GRID_AT(GAME_GRID, x, y))
+                if (GRID_AT(SCREEN_GRID, x, y) != GRID_AT(Game.grid, x, y))
                 {
                     tileRect.left = (x * TILE_SIZE);
                     tileRect.top = (y * TILE_SIZE);
                     tileRect.right = (tileRect.left + TILE_SIZE);
                     tileRect.bottom = (tileRect.top + TILE_SIZE);
-                    TileType tileType = GRID_AT(GAME_GRID, x, y);
+                    TileType tileType = GRID_AT(Game.grid, x, y);
                     TileRGB tileRGB = GetTileRGB(tileType);
                     hBrush = CreateSolidBrush(tileRGB);
                     FillRect(hdc, &tileRect, hBrush);
                     DeleteObject(hBrush);
-                    GRID_AT(SCREEN_GRID, x, y) = GRID_AT(GAME_GRID, x, y);
+                    GRID_AT(SCREEN_GRID, x, y) = GRID_AT(Game.grid, x, y);
                 }
             }
         }
 
-        Point *head = SnakePoints->point;
-        if (SnakePoints->next)
+        uint16_t head = SnakeGame_body_at(&Game, 0);
+        int headX = CELL_X(head);
+        int headY = CELL_Y(head);
+        if (Game.length > 1)
         {
-            Point *lastHead = SnakePoints->next->point;
-            tileRect.left = lastHead->x * TILE_SIZE;
-            tileRect.top = lastHead->y * TILE_SIZE;
+            uint16_t lastHead = SnakeGame_body_at(&Game, 1);
+            tileRect.left = CELL_X(lastHead) * TILE_SIZE;
+            tileRect.top = CELL_Y(lastHead) * TILE_SIZE;
             tileRect.right = tileRect.left + TILE_SIZE;
             tileRect.bottom = tileRect.top + TILE_SIZE;
             hBrush = CreateSolidBrush(SnakeTileRGB);
             FillRect(hdc, &tileRect, hBrush);
-            GRID_AT(SCREEN_GRID, lastHead->x, lastHead->y) = SnakeTile;
+            GRID_AT(SCREEN_GRID, CELL_X(lastHead), CELL_Y(lastHead)) = SnakeTile;
             DeleteObject(hBrush);
         }
         RECT leftEye;
         RECT rightEye;
-        switch (LastDirection)
+        switch (Game.lastDirection)
         {
         case Up:
-            leftEye.left = (head->x * TILE_SIZE) + (TILE_SIZE / 4);
-            leftEye.top = (head->y * TILE_SIZE) + (TILE_SIZE / 4);
+            leftEye.left = (headX * TILE_SIZE) + (TILE_SIZE / 4);
+            leftEye.top = (headY * TILE_SIZE) + (TILE_SIZE / 4);
 
-            rightEye.left = (head->x * TILE_SIZE) + (3 * TILE_SIZE / 4);
-            rightEye.top = (head->y * TILE_SIZE) + (TILE_SIZE / 4);
+            rightEye.left = (headX * TILE_SIZE) + (3 * TILE_SIZE / 4);
+            rightEye.top = (headY * TILE_SIZE) + (TILE_SIZE / 4);
             break;
         case Left:
-            leftEye.left = (head->x * TILE_SIZE) + (TILE_SIZE / 4);
-            leftEye.top = (head->y * TILE_SIZE) + (3 * TILE_SIZE / 4);
+            leftEye.left = (headX * TILE_SIZE) + (TILE_SIZE / 4);
+            leftEye.top = (headY * TILE_SIZE) + (3 * TILE_SIZE / 4);
 
-            rightEye.left = (head->x * TILE_SIZE) + (TILE_SIZE / 4);
-            rightEye.top = (head->y * TILE_SIZE) + (TILE_SIZE / 4);
+            rightEye.left = (headX * TILE_SIZE) + (TILE_SIZE / 4);
+            rightEye.top = (headY * TILE_SIZE) + (TILE_SIZE / 4);
             break;
         case Down:
-            leftEye.left = (head->x * TILE_SIZE) + (3 * TILE_SIZE / 4);
-            leftEye.top = (head->y * TILE_SIZE) + (3 * TILE_SIZE / 4);
+            leftEye.left = (headX * TILE_SIZE) + (3 * TILE_SIZE / 4);
+            leftEye.top = (headY * TILE_SIZE) + (3 * TILE_SIZE / 4);
 
-            rightEye.left = (head->x * TILE_SIZE) + (TILE_SIZE / 4);
-            rightEye.top = (head->y * TILE_SIZE) + (3 * TILE_SIZE / 4);
+            rightEye.left = (headX * TILE_SIZE) + (TILE_SIZE / 4);
+            rightEye.top = (headY * TILE_SIZE) + (3 * TILE_SIZE / 4);
             break;
         case Right:
-            leftEye.left = (head->x * TILE_SIZE) + (3 * TILE_SIZE / 4);
-            leftEye.top = (head->y * TILE_SIZE) + (TILE_SIZE / 4);
+            leftEye.left = (headX * TILE_SIZE) + (3 * TILE_SIZE / 4);
+            leftEye.top = (headY * TILE_SIZE) + (TILE_SIZE / 4);
 
-            rightEye.left = (head->x * TILE_SIZE) + (3 * TILE_SIZE / 4);
-            rightEye.top = (head->y * TILE_SIZE) + (3 * TILE_SIZE / 4);
+            rightEye.left = (headX * TILE_SIZE) + (3 * TILE_SIZE / 4);
+            rightEye.top = (headY * TILE_SIZE) + (3 * TILE_SIZE / 4);
             break;
         }
         leftEye.right = leftEye.left + TILE_SIZE / 20;
@@ -573,7 +419,7 @@ void AttachConsoleToWindow()
 const char mainClassName[] = "SnakeWindowClass";
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 {
-    srand((unsigned int)time(NULL));
+    Rng_seed_threads((uint64_t)time(NULL));
     AttachConsoleToWindow();
 
     WNDCLASSEX wc = {
@@ -624,20 +470,29 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         return 0;
     }
 
-    SnakePoints = (PointList *)GlobalAlloc(GMEM_FIXED, sizeof(*SnakePoints));
-    SnakePoints->next = NULL;
-    SnakePoints->point = (Point *)GlobalAlloc(GMEM_FIXED, sizeof(*SnakePoints->point));
-    ApplePoint = (Point *)GlobalAlloc(GMEM_FIXED, sizeof(*ApplePoint));
-    for (int i = 0; i < GAME_STEPS; i++)
-    {
-        snakeSteps[i] = (Step *)GlobalAlloc(GMEM_FIXED, sizeof(*snakeSteps[i]));
-        snakeSteps[i]->state = mat_alloc(1, GRID_LEN);
-        snakeSteps[i]->reward = 0.f;
-        snakeSteps[i]->probability = 0.f;
-        snakeSteps[i]->action = 0;
-    }
+    SnakeQueue = TrajectoryQueue_alloc(QUEUE_SLOTS, GAME_STEPS, GRID_LEN, TileFeatures, ARR_LEN(TileFeatures));
+    snakeTrajectory = TrajectoryQueue_acquire(SnakeQueue);
+    SnakeGame_seed(&Game, Rng_next(Rng_thread()));
     InitializeGame();
 
+    size_t layers[] = {GRID_LEN, 16, 16, 16, 4};
+    size_t len = ARR_LEN(layers);
+    ActivationType acts[] = {RELU, RELU, RELU, SOFTMAX};
+    // the game only ever evaluates one board
+    SnakeNN = NeuralNetwork_batch(layers, len, acts, 1);
+    SnakeLearnerNN = NeuralNetwork_batch(layers, len, acts, TRAIN_BATCH);
+    SnakeNNGradient = NeuralNetwork_batch(layers, len, NULL, TRAIN_BATCH);
+    // Network_rand(SnakeLearnerNN, -1, 1);
+    Network_xavier_init(SnakeLearnerNN);
+    SnakeOptimizer = Optimizer_alloc(SnakeLearnerNN, OPTIMIZER_ADAM, 0.001f);
+    SnakeOptimizer.clipNorm = 1.f;
+    SnakeCheckpoints = Checkpointer_create(SnakeLearnerNN, CHECKPOINT_PREFIX, CHECKPOINT_KEEP);
+    if (Checkpointer_resume(SnakeCheckpoints, SnakeLearnerNN, &trainingRounds))
+        printf("Resumed from training round %llu\n", (unsigned long long)trainingRounds);
+    SnakeWeights = WeightBuffer_alloc(SnakeLearnerNN);
+    WeightBuffer_fetch(SnakeWeights, SnakeNN, &snakeWeightsVersion);
+    SnakeAccumulator = Network_accumulator_alloc(SnakeNN);
+
     HANDLE hThread;
     DWORD threadID;
     hThread = CreateThread(
@@ -647,20 +502,13 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         hwnd,
         0,
         &threadID);
-    if (!hThread)
+    HANDLE hLearner = CreateThread(NULL, 0, LearnerLoop, NULL, 0, NULL);
+    if (!hThread || !hLearner)
     {
         MessageBox(hwnd, "The program failed to create a thread", "Fatal Error", MB_OK | MB_ICONERROR);
         return 0;
     }
 
-    size_t layers[] = {GRID_LEN, 16, 16, 16, 4};
-    size_t len = ARR_LEN(layers);
-    ActivationType acts[] = {RELU, RELU, RELU, SOFTMAX};
-    SnakeNN = NeuralNetwork(layers, len, acts);
-    SnakeNNGradient = NeuralNetwork(layers, len, NULL);
-    // Network_rand(SnakeNN, -1, 1);
-    Network_xavier_init(SnakeNN);
-
     ShowWindow(hwnd, nCmdShow);
     UpdateWindow(hwnd);
 
@@ -671,5 +519,8 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         DispatchMessage(&msg);
     }
     CloseHandle(hThread);
+    CloseHandle(hLearner);
+    // the learner may still train, only wait for the snapshots already taken
+    Checkpointer_flush(SnakeCheckpoints);
     return msg.wParam;
 }
\ No newline at end of file
@@ -0,0 +1,488 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ML.h"
+#include "SnakeEngine.h"
+
+// runs the engine without a window and reports the step rate
+// usage: snake_headless [steps] [envs] [mode] [seed] [actors]
+//     envs == 0 plays random moves in a single game
+//     envs > 0 lets one batched network forward pick the moves of that many games
+//     mode conv reads the board through two 3x3 convolutions instead of a dense first layer
+//     mode train runs actors threads of envs games each while a learner trains on what they play
+//     mode es trains with an evolution strategy, every member plays envs games on the calling
+//     thread plus actors worker threads
+//     the same seed replays the same run, except in train mode where threads interleave freely
+
+typedef struct RunStats
+{
+    long long steps;
+    long long games;
+    long long wins;
+    long long apples;
+    size_t longest;
+    double rewards;
+} RunStats;
+
+void CountEvent(RunStats *stats, SnakeEvent event, float reward, size_t length)
+{
+    stats->steps++;
+    stats->rewards += reward;
+    if (length > stats->longest)
+        stats->longest = length;
+    if (event == AppleEvent)
+        stats->apples++;
+    else if (event == DeathEvent || event == WinEvent)
+    {
+        stats->games++;
+        stats->wins += event == WinEvent;
+    }
+}
+
+void RunRandom(long long totalSteps, RunStats *stats)
+{
+    SnakeGame game;
+    SnakeGame_seed(&game, Rng_next(Rng_thread()));
+    SnakeGame_reset(&game);
+
+    for (long long i = 0; i < totalSteps; i++)
+    {
+        // never turn straight back into the neck
+        uint8_t action = (uint8_t)(Rng_next(Rng_thread()) >> 62);
+        if (game.lastDirection != NO_DIRECTION && action == (game.lastDirection + 2) % 4)
+            action = game.lastDirection;
+
+        float reward;
+        SnakeEvent event = SnakeGame_step(&game, action, &reward);
+        CountEvent(stats, event, reward, game.length);
+        if (event == DeathEvent || event == WinEvent)
+            SnakeGame_reset(&game);
+    }
+}
+
+// best output that does not reverse into the neck, same rule as the windowed game,
+// and a random move instead with probability epsilon
+uint8_t ChooseAction(const float *probs, size_t count, uint8_t lastDirection, float epsilon)
+{
+    uint8_t action = 0;
+    float probability = -1.f;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (lastDirection != NO_DIRECTION && i == (size_t)(lastDirection + 2) % 4)
+            continue;
+        if (probs[i] > probability)
+        {
+            probability = probs[i];
+            action = (uint8_t)i;
+        }
+    }
+
+    if (epsilon > 0.f && Rng_float(Rng_thread()) < epsilon)
+    {
+        do
+        {
+            action = (uint8_t)Rng_bounded(Rng_thread(), 4);
+        } while (lastDirection != NO_DIRECTION && action == (lastDirection + 2) % 4);
+    }
+    return action;
+}
+
+// draws an action from probs, never straight back into the neck
+uint8_t SampleAction(const float *probs, size_t count, uint8_t lastDirection, Rng *rng)
+{
+    size_t back = lastDirection != NO_DIRECTION ? (size_t)(lastDirection + 2) % 4 : count;
+    float total = 0.f;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i != back)
+            total += probs[i];
+    }
+
+    float u = Rng_float(rng) * total;
+    uint8_t action = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i == back)
+            continue;
+        action = (uint8_t)i;
+        u -= probs[i];
+        if (u < 0.f)
+            break;
+    }
+    return action;
+}
+
+Network MakeNetwork(size_t envCount, bool conv)
+{
+    if (conv)
+    {
+        // 8 filters over the full board, then 16 at half resolution
+        LayerSpec first = conv_spec(GRID_HEIGHT, GRID_WIDTH, 1, 8, 3, 1);
+        LayerSpec second = conv_spec(GRID_HEIGHT, GRID_WIDTH, 8, 16, 3, 2);
+        size_t layers[] = {GRID_LEN, conv_output_size(first), conv_output_size(second), 16, 4};
+        ActivationType acts[] = {RELU, RELU, RELU, SOFTMAX};
+        LayerSpec specs[] = {first, second, {DENSE}, {DENSE}};
+        return NeuralNetwork_spec(layers, ARR_LEN(layers), acts, specs, envCount);
+    }
+
+    size_t layers[] = {GRID_LEN, 16, 16, 16, 4};
+    ActivationType acts[] = {RELU, RELU, RELU, SOFTMAX};
+    return NeuralNetwork_batch(layers, ARR_LEN(layers), acts, envCount);
+}
+
+void RunNetwork(long long totalSteps, size_t envCount, bool conv, RunStats *stats)
+{
+    Network nn = MakeNetwork(envCount, conv);
+    Network_xavier_init(nn);
+
+    SnakeEnvs envs = SnakeEnvs_alloc(envCount, Rng_next(Rng_thread()));
+    Matrix in = NETWORK_IN(nn);
+    Matrix out = NETWORK_OUT(nn);
+
+    for (long long step = 0; step < totalSteps; step += envCount)
+    {
+        SnakeEnvs_observe(envs, in.es, in.stride);
+        Network_forward_rows(nn, envCount);
+        for (size_t i = 0; i < envCount; i++)
+        {
+            envs.actions[i] = ChooseAction(&MAT_AT(out, i, 0), out.cols, envs.games[i].lastDirection, 0.05f);
+        }
+
+        SnakeEnvs_step(envs);
+        for (size_t i = 0; i < envCount; i++)
+        {
+            // a finished game is already reset, its length is not tracked here
+            CountEvent(stats, envs.events[i], envs.rewards[i], envs.games[i].length);
+        }
+    }
+
+    SnakeEnvs_free(envs);
+    Network_free(nn);
+}
+
+// steps an actor plays before handing over one trajectory per game, a game still
+// running at the end of the block is cut there
+#define ACTOR_STEPS 200
+// blocks every game can have in flight, one being played and the rest waiting for the learner
+#define QUEUE_DEPTH 2
+// the learner updates once it has gathered this many steps
+#define LEARN_STEPS 1024
+#define LEARN_BATCH 256
+
+typedef struct Training
+{
+    TrajectoryQueue *queue;
+    WeightBuffer *weights;
+    size_t envCount;
+    volatile int64_t steps; // played by all actors together
+    volatile int64_t stop;
+} Training;
+
+typedef struct Actor
+{
+    Training *training;
+    Rng rng; // seeds the actor's games
+    RunStats stats;
+} Actor;
+
+// plays envCount games with the latest published weights and hands a block of
+// ACTOR_STEPS steps of every game to the learner, returns already computed
+void ActorLoop(void *arg)
+{
+    Actor *actor = (Actor *)arg;
+    Training *training = actor->training;
+    size_t envCount = training->envCount;
+
+    Network nn = MakeNetwork(envCount, false);
+    int64_t version = 0;
+    WeightBuffer_fetch(training->weights, nn, &version);
+
+    SnakeEnvs envs = SnakeEnvs_alloc(envCount, Rng_next(&actor->rng));
+    Trajectory **current = (Trajectory **)calloc(envCount, sizeof(*current));
+    Matrix in = NETWORK_IN(nn);
+    Matrix out = NETWORK_OUT(nn);
+    // the block as ACTOR_STEPS x envCount arrays, step t of every game is one row
+    float *rewards = (float *)malloc(sizeof(*rewards) * ACTOR_STEPS * envCount);
+    float *returns = (float *)malloc(sizeof(*returns) * ACTOR_STEPS * envCount);
+    uint8_t *dones = (uint8_t *)malloc(ACTOR_STEPS * envCount);
+    size_t step = 0;
+
+    while (!ml_atomic_load(&training->stop))
+    {
+        // every game needs somewhere to record its next step
+        bool ready = true;
+        for (size_t i = 0; i < envCount; i++)
+        {
+            if (!current[i])
+                current[i] = TrajectoryQueue_acquire(training->queue);
+            ready = ready && current[i];
+        }
+        if (!ready)
+        {
+            ml_yield();
+            continue;
+        }
+
+        WeightBuffer_fetch(training->weights, nn, &version);
+        SnakeEnvs_observe(envs, in.es, in.stride);
+        Network_forward_rows(nn, envCount);
+        for (size_t i = 0; i < envCount; i++)
+        {
+            Trajectory *t = current[i];
+            SnakeGame_encode(&envs.games[i], Trajectory_state(*t, t->count));
+            envs.actions[i] = ChooseAction(&MAT_AT(out, i, 0), out.cols, envs.games[i].lastDirection, 0.05f);
+            t->actions[t->count] = envs.actions[i];
+            t->probabilities[t->count] = MAT_AT(out, i, envs.actions[i]);
+        }
+
+        SnakeEnvs_step(envs);
+        for (size_t i = 0; i < envCount; i++)
+        {
+            CountEvent(&actor->stats, envs.events[i], envs.rewards[i], envs.games[i].length);
+            Trajectory *t = current[i];
+            bool done = envs.events[i] == DeathEvent || envs.events[i] == WinEvent;
+            t->rewards[t->count] = envs.rewards[i];
+            t->dones[t->count] = done;
+            t->count++;
+            rewards[step * envCount + i] = envs.rewards[i];
+            dones[step * envCount + i] = done;
+        }
+        ml_atomic_add(&training->steps, (int64_t)envCount);
+
+        if (++step < ACTOR_STEPS)
+            continue;
+        // returns never run across the end of a game
+        Returns_discounted(rewards, dones, NULL, ACTOR_STEPS, envCount, 0.9f, returns);
+        for (size_t i = 0; i < envCount; i++)
+        {
+            for (size_t t = 0; t < ACTOR_STEPS; t++)
+            {
+                current[i]->returns[t] = returns[t * envCount + i];
+            }
+            TrajectoryQueue_submit(training->queue, current[i]);
+            current[i] = NULL;
+        }
+        step = 0;
+    }
+
+    for (size_t i = 0; i < envCount; i++)
+    {
+        if (current[i])
+            TrajectoryQueue_recycle(training->queue, current[i]);
+    }
+    free(current);
+    free(rewards);
+    free(returns);
+    free(dones);
+    SnakeEnvs_free(envs);
+    Network_free(nn);
+}
+
+// the calling thread learns while actors threads play, until totalSteps were played
+void RunTraining(long long totalSteps, size_t envCount, size_t actors, RunStats *stats, long long *updates)
+{
+    Network nn = MakeNetwork(LEARN_BATCH, false);
+    Network g = MakeNetwork(LEARN_BATCH, false);
+    Network_xavier_init(nn);
+    Optimizer opt = Optimizer_alloc(nn, OPTIMIZER_ADAM, 0.001f);
+    opt.clipNorm = 1.f;
+
+    Training training = {0};
+    size_t slots = QUEUE_DEPTH * actors * envCount + LEARN_STEPS / ACTOR_STEPS + 1;
+    training.queue = TrajectoryQueue_alloc(slots, ACTOR_STEPS, GRID_LEN, TileFeatures, ARR_LEN(TileFeatures));
+    training.weights = WeightBuffer_alloc(nn);
+    training.envCount = envCount;
+
+    Actor *actorArgs = (Actor *)calloc(actors, sizeof(*actorArgs));
+    MlThread *threads = (MlThread *)malloc(sizeof(*threads) * actors);
+    for (size_t i = 0; i < actors; i++)
+    {
+        actorArgs[i].training = &training;
+        actorArgs[i].rng = Rng_split(Rng_thread());
+        actorArgs[i].stats.longest = 1;
+        ml_thread_start(&threads[i], ActorLoop, &actorArgs[i]);
+    }
+
+    Trajectory batch = Trajectory_alloc(LEARN_STEPS + ACTOR_STEPS, GRID_LEN, TileFeatures, ARR_LEN(TileFeatures));
+    while (ml_atomic_load(&training.steps) < totalSteps)
+    {
+        Trajectory *t = TrajectoryQueue_take(training.queue);
+        if (!t)
+        {
+            ml_yield();
+            continue;
+        }
+        Trajectory_append(&batch, *t);
+        TrajectoryQueue_recycle(training.queue, t);
+        if (batch.count < LEARN_STEPS)
+            continue;
+
+        Returns_normalize(batch.returns, batch.count);
+        Network_policy_gradient_backprop_trajectory(nn, g, batch);
+        Optimizer_step(&opt, nn, g);
+        WeightBuffer_publish(training.weights, nn);
+        batch.count = 0;
+        (*updates)++;
+    }
+
+    ml_atomic_store(&training.stop, 1);
+    for (size_t i = 0; i < actors; i++)
+    {
+        ml_thread_join(threads[i]);
+        RunStats a = actorArgs[i].stats;
+        stats->steps += a.steps;
+        stats->games += a.games;
+        stats->wins += a.wins;
+        stats->apples += a.apples;
+        stats->rewards += a.rewards;
+        if (a.longest > stats->longest)
+            stats->longest = a.longest;
+    }
+
+    Trajectory_free(batch);
+    free(threads);
+    free(actorArgs);
+    WeightBuffer_free(training.weights);
+    TrajectoryQueue_free(training.queue);
+    Optimizer_free(opt);
+    Network_free(g);
+    Network_free(nn);
+}
+
+// antithetic pairs per generation
+#define ES_PAIRS 32
+// a game still alive after this many steps ends there
+#define ES_EPISODE_STEPS 500
+
+typedef struct EsGames
+{
+    size_t envCount;
+    volatile int64_t steps;
+    MlMutex lock;
+    RunStats stats;
+} EsGames;
+
+// mean reward of one game in each of envCount envs, actions sampled from the policy.
+// A greedy near-uniform policy plays the same few moves whatever its params, so most
+// antithetic pairs would tie. Both members of a pair share seed and so the same games
+// and random draws. Finished games keep stepping in the batch but stop counting
+float EsFitness(Network nn, void *arg, uint64_t seed)
+{
+    EsGames *es = (EsGames *)arg;
+    size_t envCount = es->envCount;
+    SnakeEnvs envs = SnakeEnvs_alloc(envCount, seed);
+    // its own stream, the games already split Rng_seed(seed)
+    Rng rng = Rng_seed(~seed);
+    bool *finished = (bool *)calloc(envCount, sizeof(*finished));
+    Matrix in = NETWORK_IN(nn);
+    Matrix out = NETWORK_OUT(nn);
+
+    double total = 0.0;
+    size_t running = envCount;
+    RunStats stats = {0};
+    for (size_t step = 0; step < ES_EPISODE_STEPS && running > 0; step++)
+    {
+        SnakeEnvs_observe(envs, in.es, in.stride);
+        Network_forward_rows(nn, envCount);
+        for (size_t i = 0; i < envCount; i++)
+        {
+            envs.actions[i] = SampleAction(&MAT_AT(out, i, 0), out.cols, envs.games[i].lastDirection, &rng);
+        }
+        SnakeEnvs_step(envs);
+        for (size_t i = 0; i < envCount; i++)
+        {
+            if (finished[i])
+                continue;
+            total += envs.rewards[i];
+            CountEvent(&stats, envs.events[i], envs.rewards[i], envs.games[i].length);
+            if (envs.events[i] == DeathEvent || envs.events[i] == WinEvent)
+            {
+                finished[i] = true;
+                running--;
+            }
+        }
+    }
+
+    ml_atomic_add(&es->steps, (int64_t)stats.steps);
+    ml_mutex_lock(&es->lock);
+    es->stats.steps += stats.steps;
+    es->stats.games += stats.games;
+    es->stats.wins += stats.wins;
+    es->stats.apples += stats.apples;
+    es->stats.rewards += stats.rewards;
+    if (stats.longest > es->stats.longest)
+        es->stats.longest = stats.longest;
+    ml_mutex_unlock(&es->lock);
+    free(finished);
+    SnakeEnvs_free(envs);
+    return (float)(total / envCount);
+}
+
+// generations until totalSteps game steps were played, members are scored on the
+// calling thread and threads workers
+void RunEvolution(long long totalSteps, size_t envCount, size_t threads, uint64_t seed, RunStats *stats, long long *generations)
+{
+    Network nn = MakeNetwork(envCount, false);
+    Network_xavier_init(nn);
+    Evolution es = Evolution_alloc(nn, threads, ES_PAIRS, envCount, seed);
+    EsGames games = {0};
+    games.envCount = envCount;
+    games.stats = *stats;
+    ml_mutex_init(&games.lock);
+
+    while (ml_atomic_load(&games.steps) < totalSteps)
+    {
+        float mean = Evolution_step(&es, nn, EsFitness, &games);
+        (*generations)++;
+        if (*generations % 10 == 0)
+            printf("generation %lld: mean fitness %f\n", *generations, mean);
+    }
+
+    *stats = games.stats;
+    ml_mutex_destroy(&games.lock);
+    Evolution_free(es);
+    Network_free(nn);
+}
+
+int main(int argc, char **argv)
+{
+    long long totalSteps = argc > 1 ? atoll(argv[1]) : 10000000;
+    long long envCount = argc > 2 ? atoll(argv[2]) : 0;
+    bool conv = argc > 3 && strcmp(argv[3], "conv") == 0;
+    bool train = argc > 3 && strcmp(argv[3], "train") == 0;
+    bool evolve = argc > 3 && strcmp(argv[3], "es") == 0;
+    uint64_t seed = argc > 4 ? strtoull(argv[4], NULL, 10) : (uint64_t)time(NULL);
+    long long actors = argc > 5 ? atoll(argv[5]) : 0;
+    if (actors <= 0)
+        actors = ml_cpu_count() > 1 ? (long long)ml_cpu_count() - 1 : 1;
+    Rng_seed_threads(seed);
+
+    RunStats stats = {0};
+    stats.longest = 1;
+    long long updates = 0;
+
+    double start = ml_seconds();
+    if (evolve)
+        RunEvolution(totalSteps, envCount > 0 ? (size_t)envCount : 1, (size_t)actors, seed, &stats, &updates);
+    else if (train)
+        RunTraining(totalSteps, envCount > 0 ? (size_t)envCount : 1, (size_t)actors, &stats, &updates);
+    else if (envCount > 0)
+        RunNetwork(totalSteps, (size_t)envCount, conv, &stats);
+    else
+        RunRandom(totalSteps, &stats);
+    double elapsed = ml_seconds() - start;
+
+    printf("seed %llu\n", (unsigned long long)seed);
+    // train and es stop at the first check past totalSteps, report what was played
+    printf("%lld steps in %.3f s, %.2f M steps/s\n", stats.steps, elapsed, stats.steps / elapsed * 1e-6);
+    if (train)
+        printf("%lld actors, %lld updates, %.1f updates/s\n", actors, updates, updates / elapsed);
+    if (evolve)
+        printf("%lld threads, %lld generations, %.1f generations/s\n", actors + 1, updates, updates / elapsed);
+    printf("games: %lld, wins: %lld, apples: %lld, longest: %zu, mean reward: %f\n",
+           stats.games, stats.wins, stats.apples, stats.longest, stats.steps ? stats.rewards / stats.steps : 0.0);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+
+#include "../ML.h"
+
+// writes more checkpoints than the checkpointer can keep and checks that rotation
+// holds the newest ones, also after picking a full index back up
+// gcc -O2 -pthread tests/checkpoint_rotation.c -o checkpoint_rotation -lm && ./checkpoint_rotation
+
+#define PREFIX "checkpoint_rotation_test"
+
+// unlike assert these stay in with -DNDEBUG, any failure makes the exit code nonzero
+static int failures = 0;
+#define CHECK(cond)                                                                 \
+    do                                                                              \
+    {                                                                               \
+        if (!(cond))                                                                \
+        {                                                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                             \
+        }                                                                           \
+    } while (0)
+
+static void write_checkpoints(Checkpointer *c, Network nn, uint64_t first, uint64_t count)
+{
+    for (uint64_t step = first; step < first + count; step++)
+    {
+        nn.params[0] = (float)step;
+        bool saved = Checkpointer_save(c, nn, step);
+        CHECK(saved);
+        Checkpointer_flush(c);
+    }
+}
+
+static void check_newest(Checkpointer *c, Network nn, uint64_t last)
+{
+    CHECK(c->stepCount == CHECKPOINT_MAX_KEEP);
+    for (size_t i = 0; i < c->stepCount; i++)
+    {
+        CHECK(c->steps[i] == last - CHECKPOINT_MAX_KEEP + 1 + i);
+    }
+
+    uint64_t step = 0;
+    bool resumed = Checkpointer_resume(c, nn, &step);
+    CHECK(resumed && step == last && nn.params[0] == (float)last);
+
+    char path[FILENAME_MAX];
+    checkpoint_path(c, last - CHECKPOINT_MAX_KEEP, path, sizeof(path));
+    FILE *dropped = fopen(path, "rb");
+    if (dropped)
+        fclose(dropped);
+    CHECK(!dropped);
+}
+
+static void remove_checkpoints(Checkpointer *c)
+{
+    char path[FILENAME_MAX];
+    for (size_t i = 0; i < c->stepCount; i++)
+    {
+        checkpoint_path(c, c->steps[i], path, sizeof(path));
+        remove(path);
+    }
+    remove(PREFIX ".index");
+}
+
+int main(void)
+{
+    size_t layers[] = {8, 4};
+    ActivationType acts[] = {SIGMOID};
+    Network nn = NeuralNetwork_batch(layers, ARR_LEN(layers), acts, 1);
+    Network_xavier_init(nn);
+    remove(PREFIX ".index");
+
+    Checkpointer *c = Checkpointer_create(nn, PREFIX, CHECKPOINT_MAX_KEEP);
+    write_checkpoints(c, nn, 1, CHECKPOINT_MAX_KEEP + 10);
+    check_newest(c, nn, CHECKPOINT_MAX_KEEP + 10);
+    Checkpointer_destroy(c);
+
+    // a restart loads the full index, the next write has to rotate it
+    c = Checkpointer_create(nn, PREFIX, CHECKPOINT_MAX_KEEP);
+    CHECK(c->stepCount == CHECKPOINT_MAX_KEEP);
+    write_checkpoints(c, nn, CHECKPOINT_MAX_KEEP + 11, 5);
+    check_newest(c, nn, CHECKPOINT_MAX_KEEP + 15);
+
+    remove_checkpoints(c);
+    Checkpointer_destroy(c);
+    Network_free(nn);
+    if (failures)
+    {
+        fprintf(stderr, "checkpoint rotation: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("checkpoint rotation ok\n");
+    return 0;
+}
@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+
+#include "../ML.h"
+
+// runs the evolution strategy on a separable objective and checks that it improves,
+// that the arena padding is never touched and that the thread count changes nothing
+// gcc -O2 -pthread tests/evolution.c -o evolution -lm && ./evolution
+
+#define GENERATIONS 200
+#define PAIRS 16
+
+// unlike assert these stay in with -DNDEBUG, any failure makes the exit code nonzero
+static int failures = 0;
+#define CHECK(cond)                                                                 \
+    do                                                                              \
+    {                                                                               \
+        if (!(cond))                                                                \
+        {                                                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                             \
+        }                                                                           \
+    } while (0)
+
+// every weight and bias wants to sit at its own target, the padding is not scored
+static float separable(Network nn, void *arg, uint64_t seed)
+{
+    (void)arg;
+    (void)seed;
+    float cost = 0.f;
+    for (size_t i = 0; i < nn.count; i++)
+    {
+        Matrix m[] = {nn.weights[i], nn.biases[i]};
+        for (size_t k = 0; k < ARR_LEN(m); k++)
+        {
+            for (size_t r = 0; r < m[k].rows; r++)
+            {
+                for (size_t c = 0; c < m[k].cols; c++)
+                {
+                    float target = 0.5f - 0.1f * (float)((r + c + k) % 10);
+                    float d = MAT_AT(m[k], r, c) - target;
+                    cost += d * d;
+                }
+            }
+        }
+    }
+    return -cost;
+}
+
+static void fill(Matrix m, Rng *rng)
+{
+    for (size_t r = 0; r < m.rows; r++)
+    {
+        Rng_fill_uniform(rng, &MAT_AT(m, r, 0), m.cols, -0.5f, 0.5f);
+    }
+}
+
+typedef struct EsRun
+{
+    Network nn;
+    float first;
+    float last;
+} EsRun;
+
+static EsRun run(size_t threads)
+{
+    // odd widths so every matrix has padding in the arena
+    size_t layers[] = {13, 7, 3};
+    ActivationType acts[] = {RELU, SOFTMAX};
+    EsRun r = {0};
+    r.nn = NeuralNetwork_batch(layers, ARR_LEN(layers), acts, 1);
+    Rng rng = Rng_seed(7);
+    for (size_t i = 0; i < r.nn.count; i++)
+    {
+        fill(r.nn.weights[i], &rng);
+        fill(r.nn.biases[i], &rng);
+    }
+
+    Evolution es = Evolution_alloc(r.nn, threads, PAIRS, 1, 42);
+    r.first = separable(r.nn, NULL, 0);
+    for (size_t g = 0; g < GENERATIONS; g++)
+    {
+        Evolution_step(&es, r.nn, separable, NULL);
+    }
+    r.last = separable(r.nn, NULL, 0);
+
+    size_t touched = 0;
+    for (size_t i = 0; i < r.nn.paramCount; i++)
+    {
+        touched += es.mask[i] == 0.f && r.nn.params[i] != 0.f;
+    }
+    CHECK(touched == 0);
+    Evolution_free(es);
+    return r;
+}
+
+int main(void)
+{
+    size_t threads[] = {0, 1, 3};
+    EsRun runs[ARR_LEN(threads)];
+    for (size_t i = 0; i < ARR_LEN(threads); i++)
+    {
+        runs[i] = run(threads[i]);
+    }
+
+    printf("fitness %f -> %f over %d generations\n", runs[0].first, runs[0].last, GENERATIONS);
+    CHECK(runs[0].last > 0.1f * runs[0].first);
+    for (size_t i = 1; i < ARR_LEN(threads); i++)
+    {
+        CHECK(memcmp(&runs[i].last, &runs[0].last, sizeof(float)) == 0);
+        CHECK(runs[i].nn.paramCount == runs[0].nn.paramCount &&
+              memcmp(runs[i].nn.params, runs[0].nn.params, sizeof(float) * runs[0].nn.paramCount) == 0);
+    }
+
+    for (size_t i = 0; i < ARR_LEN(threads); i++)
+    {
+        Network_free(runs[i].nn);
+    }
+    if (failures)
+    {
+        fprintf(stderr, "evolution: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("evolution ok\n");
+    return 0;
+}